@@ -0,0 +1,197 @@
+/*  This file is part of "testtool"
+ *  Copyright (C) 2006 Bernhard R. Link
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+#include <config.h>
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "batch.h"
+
+static bool append(char ***list, int *count, const char *value) {
+	char **n, *copy;
+
+	copy = strdup(value);
+	n = realloc(*list, (*count + 2) * sizeof(char*));
+	if( copy == NULL || n == NULL ) {
+		free(copy);
+		if( n != NULL )
+			*list = n;
+		return false;
+	}
+	n[(*count)++] = copy;
+	n[*count] = NULL;
+	*list = n;
+	return true;
+}
+
+static void freelist(char **list, int count) {
+	int i;
+
+	for( i = 0 ; i < count ; i++ )
+		free(list[i]);
+	free(list);
+}
+
+void batch_free(struct batchtest *tests) {
+	struct batchtest *t;
+
+	while( (t = tests) != NULL ) {
+		tests = t->next;
+		free(t->name);
+		free(t->rules);
+		freelist(t->options, t->optioncount);
+		freelist(t->args, t->argcount);
+		free(t);
+	}
+}
+
+static bool complete(const char *filename, const struct batchtest *t) {
+	if( t != NULL && t->argcount == 0 ) {
+		fprintf(stderr, "%s: %s:%u: test '%s' has no 'arg' lines\n",
+				program_invocation_short_name,
+				filename, t->line, t->name);
+		return false;
+	}
+	return true;
+}
+
+/* one line without its newline, returns false on errors */
+static bool parseline(const char *filename, unsigned int lineno, char *line, struct batchtest **last, struct batchtest ***next) {
+	struct batchtest *t = *last;
+	char *value, *option, *e;
+	long number;
+	bool ok = true;
+
+	while( *line == ' ' || *line == '\t' )
+		line++;
+	if( *line == '\0' || *line == '#' )
+		return true;
+	value = strchr(line, ' ');
+	if( value != NULL )
+		*(value++) = '\0';
+	else
+		value = line + strlen(line);
+	if( strcmp(line, "test") == 0 ) {
+		if( *value == '\0' ) {
+			fprintf(stderr, "%s: %s:%u: test without a name\n",
+					program_invocation_short_name,
+					filename, lineno);
+			return false;
+		}
+		if( !complete(filename, t) )
+			return false;
+		t = calloc(1, sizeof(struct batchtest));
+		if( t == NULL )
+			return false;
+		t->returncode = -1;
+		t->line = lineno;
+		**next = t;
+		*next = &t->next;
+		*last = t;
+		t->name = strdup(value);
+		return t->name != NULL;
+	}
+	if( t == NULL ) {
+		fprintf(stderr, "%s: %s:%u: '%s' before the first 'test' line\n",
+				program_invocation_short_name,
+				filename, lineno, line);
+		return false;
+	}
+	if( strcmp(line, "rules") == 0 && *value != '\0' ) {
+		free(t->rules);
+		t->rules = strdup(value);
+		ok = t->rules != NULL;
+	} else if( strcmp(line, "variable") == 0 && *value != '\0' ) {
+		if( asprintf(&option, "--variable=%s", value) < 0 )
+			return false;
+		ok = append(&t->options, &t->optioncount, option);
+		free(option);
+	} else if( strcmp(line, "returns") == 0 ) {
+		errno = 0;
+		number = strtol(value, &e, 10);
+		if( *value < '0' || *value > '9' || *e != '\0' ||
+				errno != 0 || number > 255 ) {
+			fprintf(stderr, "%s: %s:%u: invalid return code '%s'\n",
+					program_invocation_short_name,
+					filename, lineno, value);
+			return false;
+		}
+		t->returncode = number;
+	} else if( strcmp(line, "option") == 0 && *value == '-' ) {
+		ok = append(&t->options, &t->optioncount, value);
+	} else if( strcmp(line, "arg") == 0 ) {
+		ok = append(&t->args, &t->argcount, value);
+	} else {
+		fprintf(stderr, "%s: %s:%u: cannot parse '%s%s%s'\n",
+				program_invocation_short_name,
+				filename, lineno, line,
+				(*value != '\0')?" ":"", value);
+		return false;
+	}
+	if( !ok )
+		fputs("Out of memory!\n", stderr);
+	return ok;
+}
+
+bool batch_read(const char *filename, struct batchtest **tests) {
+	struct batchtest *last = NULL, **next = tests;
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+	unsigned int lineno = 0;
+	bool ok = true;
+	FILE *f;
+
+	*tests = NULL;
+	f = fopen(filename, "r");
+	if( f == NULL ) {
+		fprintf(stderr, "%s: Cannot open %s: %s\n",
+				program_invocation_short_name,
+				filename, strerror(errno));
+		return false;
+	}
+	while( ok && (len = getline(&line, &size, f)) >= 0 ) {
+		lineno++;
+		if( len > 0 && line[len-1] == '\n' )
+			line[--len] = '\0';
+		if( strlen(line) != (size_t)len ) {
+			fprintf(stderr, "%s: %s:%u: NUL character\n",
+					program_invocation_short_name,
+					filename, lineno);
+			ok = false;
+			break;
+		}
+		ok = parseline(filename, lineno, line, &last, &next);
+	}
+	if( ok && ferror(f) ) {
+		fprintf(stderr, "%s: Error reading %s: %s\n",
+				program_invocation_short_name,
+				filename, strerror(errno));
+		ok = false;
+	}
+	free(line);
+	fclose(f);
+	if( ok )
+		ok = complete(filename, last);
+	if( !ok ) {
+		batch_free(*tests);
+		*tests = NULL;
+	}
+	return ok;
+}
@@ -0,0 +1,41 @@
+#ifndef TESTTOOL_BATCH_H
+#define TESTTOOL_BATCH_H
+
+#include <stdbool.h>
+
+/* The manifest for --batch lists tests, each starting with a
+ * "test NAME" line followed by lines describing it:
+ *
+ *	rules FILE	read the rules from FILE
+ *	variable C=N	like --variable C=N
+ *	returns N	expected return code, overriding the rules
+ *	option OPTION	some other option, like "option --silent"
+ *	arg ARGUMENT	the program to run (the first one) and its
+ *			arguments, one per line
+ *
+ * Everything after the keyword and one space is taken as is. Empty
+ * lines and lines starting with '#' are ignored, leading whitespace
+ * is allowed. */
+
+struct batchtest {
+	struct batchtest *next;
+	char *name;
+	/* the rules file, NULL if none */
+	char *rules;
+	/* -1 if not given */
+	int returncode;
+	/* testtool options, including those from variable lines */
+	int optioncount;
+	char **options;
+	/* the program and its arguments */
+	int argcount;
+	char **args;
+	/* where it starts in the manifest */
+	unsigned int line;
+};
+
+/* errors are reported to stderr, *tests is NULL if there are none */
+bool batch_read(const char *filename, struct batchtest **tests);
+void batch_free(struct batchtest *);
+
+#endif
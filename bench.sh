@@ -0,0 +1,116 @@
+#!/bin/sh
+# Throughput benchmarks for testtool, run by "make bench".
+# Syntax: bench.sh TESTTOOL TTBENCH
+#
+# BENCH_BYTES (default 64M) is the amount of output for most runs,
+# BENCH_MAX_BYTES (default 1G) the largest one of the volume sweep.
+set -e
+
+testtool="$1"
+ttbench="$2"
+if test -z "$testtool" || test -z "$ttbench" ; then
+	echo "Syntax: $0 testtool ttbench" >&2
+	exit 2
+fi
+
+bytes() {
+	case "$1" in
+		*k) echo $(( ${1%k} * 1024 )) ;;
+		*M) echo $(( ${1%M} * 1024 * 1024 )) ;;
+		*G) echo $(( ${1%G} * 1024 * 1024 * 1024 )) ;;
+		*) echo "$1" ;;
+	esac
+}
+BYTES=$(bytes "${BENCH_BYTES:-64M}")
+MAXBYTES=$(bytes "${BENCH_MAX_BYTES:-1G}")
+
+dir="$(mktemp -d "${TMPDIR:-/tmp}/ttbench-XXXXXX")"
+trap 'rm -rf "$dir"' EXIT
+
+now() {
+	date +%s%N
+}
+
+# report NAME LINES BYTES START END
+report() {
+	awk -v name="$1" -v lines="$2" -v bytes="$3" -v ns="$(( $5 - $4 ))" 'BEGIN {
+		s = ns / 1e9; if( s <= 0 ) s = 1e-9;
+		printf "%-32s %11d lines %9.1f MB/s %12.0f lines/s %8.3f s\n",
+			name, lines, bytes / s / 1048576, lines / s, s;
+	}'
+}
+
+# run NAME RULES LENGTH BYTES EXPECTED% IGNORED% [testtool options]
+run() {
+	name="$1" rules="$2" length="$3" total="$4" expected="$5" ignored="$6"
+	shift 6
+	lines=$(( total / (length + 1) ))
+	rulesfile="$dir/rules.$rules.$length"
+	test -e "$rulesfile" || "$ttbench" rules "$rules" "$length" > "$rulesfile"
+	start=$(now)
+	"$testtool" "$@" --rules -- "$ttbench" output "$rules" "$length" \
+		"$lines" "$expected" "$ignored" 3<"$rulesfile" >/dev/null 2>&1 || true
+	end=$(now)
+	# the expected lines written first to not have any missing
+	report "$name" $(( lines + rules / 2 )) \
+		$(( (lines + rules / 2) * (length + 1) )) "$start" "$end"
+}
+
+echo "# raw generator speed, for reference"
+lines=$(( BYTES / 81 ))
+start=$(now)
+"$ttbench" output 1000 80 "$lines" 40 40 > /dev/null
+end=$(now)
+report "ttbench alone" "$lines" $(( lines * 81 )) "$start" "$end"
+
+echo "# line length (1000 rules, 40% expected, 40% ignored, --silent)"
+for length in 16 80 256 4096 ; do
+	run "length $length" 1000 "$length" "$BYTES" 40 40 --silent
+done
+
+echo "# rule count (80 characters, 40% expected, 40% ignored, --silent)"
+for rules in 10 100 1000 10000 100000 ; do
+	run "rules $rules" "$rules" 80 "$BYTES" 40 40 --silent
+done
+
+echo "# line mix (1000 rules, 80 characters, --silent)"
+run "all expected" 1000 80 "$BYTES" 100 0 --silent
+run "all ignored" 1000 80 "$BYTES" 0 100 --silent
+run "all unknown" 1000 80 "$BYTES" 0 0 --silent
+
+echo "# output mode (1000 rules, 80 characters, 40% expected, 40% ignored)"
+run "silent" 1000 80 "$BYTES" 40 40 --silent
+run "echo" 1000 80 "$BYTES" 40 40
+run "annotate" 1000 80 "$BYTES" 40 40 --annotate
+
+echo "# volume (1000 rules, 80 characters, 40% expected, 40% ignored, --silent)"
+total=$(( 16 * 1024 * 1024 ))
+while test "$total" -lt "$MAXBYTES" ; do
+	run "$(( total / 1048576 ))M" 1000 80 "$total" 40 40 --silent
+	total=$(( total * 4 ))
+done
+run "$(( MAXBYTES / 1048576 ))M" 1000 80 "$MAXBYTES" 40 40 --silent
+
+echo "# rule loading (80 characters, time for 'testtool --rules true')"
+start=$(now)
+"$testtool" true
+end=$(now)
+base=$(( end - start ))
+for rules in 10 100 1000 10000 100000 ; do
+	# only ignore rules, so nothing is reported missing
+	rulesfile="$dir/load.$rules"
+	"$ttbench" rules "$rules" 80 | sed -e 's/^\*=/=/' > "$rulesfile"
+	start=$(now)
+	"$testtool" --rules true 3<"$rulesfile" || true
+	end=$(now)
+	"$testtool" --compile-rules 3<"$rulesfile"
+	cstart=$(now)
+	"$testtool" --rules true 3<"$rulesfile" || true
+	cend=$(now)
+	awk -v rules="$rules" -v plain="$(( end - start - base ))" \
+		-v compiled="$(( cend - cstart - base ))" 'BEGIN {
+		printf "%-32s %9.2f ms parsed %9.2f ms compiled\n",
+			"rules " rules, plain / 1e6, compiled / 1e6;
+	}'
+	rm -f "$rulesfile.compiled"
+done
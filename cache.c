@@ -0,0 +1,575 @@
+/*  This file is part of "testtool"
+ *  Copyright (C) 2006 Bernhard R. Link
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+#include <config.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <dirent.h>
+#include <unistd.h>
+
+#include "cache.h"
+
+static const uint32_t k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+	0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+	0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+	0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+	0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+	0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline uint32_t ror(uint32_t x, int n) {
+	return (x >> n) | (x << (32 - n));
+}
+
+static void sha256block(uint32_t *state, const unsigned char *p) {
+	uint32_t w[64], a, b, c, d, e, f, g, h, t1, t2;
+	int i;
+
+	for( i = 0 ; i < 16 ; i++ )
+		w[i] = (uint32_t)p[4*i] << 24 | (uint32_t)p[4*i+1] << 16 |
+			(uint32_t)p[4*i+2] << 8 | p[4*i+3];
+	for( ; i < 64 ; i++ )
+		w[i] = w[i-16] + (ror(w[i-15], 7) ^ ror(w[i-15], 18) ^
+				(w[i-15] >> 3)) + w[i-7] +
+			(ror(w[i-2], 17) ^ ror(w[i-2], 19) ^ (w[i-2] >> 10));
+	a = state[0]; b = state[1]; c = state[2]; d = state[3];
+	e = state[4]; f = state[5]; g = state[6]; h = state[7];
+	for( i = 0 ; i < 64 ; i++ ) {
+		t1 = h + (ror(e, 6) ^ ror(e, 11) ^ ror(e, 25)) +
+			((e & f) ^ (~e & g)) + k[i] + w[i];
+		t2 = (ror(a, 2) ^ ror(a, 13) ^ ror(a, 22)) +
+			((a & b) ^ (a & c) ^ (b & c));
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+	state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+	state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+void cachekey_init(struct cachekey *key) {
+	static const uint32_t initial[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+
+	memcpy(key->state, initial, sizeof(initial));
+	key->length = 0;
+	key->used = 0;
+}
+
+void cachekey_add(struct cachekey *key, const void *data, size_t len) {
+	const unsigned char *p = data;
+	size_t n;
+
+	key->length += len;
+	if( key->used > 0 ) {
+		n = 64 - key->used;
+		if( n > len )
+			n = len;
+		memcpy(key->block + key->used, p, n);
+		key->used += n;
+		p += n;
+		len -= n;
+		if( key->used < 64 )
+			return;
+		sha256block(key->state, key->block);
+		key->used = 0;
+	}
+	while( len >= 64 ) {
+		sha256block(key->state, p);
+		p += 64;
+		len -= 64;
+	}
+	memcpy(key->block, p, len);
+	key->used = len;
+}
+
+void cachekey_addstring(struct cachekey *key, const char *s) {
+	cachekey_add(key, s, strlen(s) + 1);
+}
+
+void cachekey_addfile(struct cachekey *key, const char *filename) {
+	struct stat st;
+	void *data;
+	int fd;
+
+	cachekey_addstring(key, filename);
+	fd = open(filename, O_RDONLY|O_NOCTTY|O_CLOEXEC);
+	if( fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ) {
+		if( fd >= 0 )
+			close(fd);
+		cachekey_addstring(key, "unreadable");
+		return;
+	}
+	cachekey_add(key, &st.st_size, sizeof(st.st_size));
+	if( st.st_size == 0 ) {
+		close(fd);
+		return;
+	}
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if( data == MAP_FAILED ) {
+		cachekey_addstring(key, "unreadable");
+		return;
+	}
+	cachekey_add(key, data, st.st_size);
+	munmap(data, st.st_size);
+}
+
+bool cachekey_addinput(struct cachekey *key, int fd) {
+	struct stat st, null;
+	char buffer[65536];
+	off_t offset;
+	ssize_t got;
+
+	if( fstat(fd, &st) != 0 ) {
+		if( errno != EBADF )
+			return false;
+		cachekey_addstring(key, "closed");
+		return true;
+	}
+	if( S_ISCHR(st.st_mode) && stat("/dev/null", &null) == 0 &&
+			S_ISCHR(null.st_mode) && st.st_rdev == null.st_rdev ) {
+		cachekey_addstring(key, "/dev/null");
+		return true;
+	}
+	if( !S_ISREG(st.st_mode) )
+		return false;
+	/* what the program will get is what is after the current offset,
+	 * which must stay where it is */
+	offset = lseek(fd, 0, SEEK_CUR);
+	if( offset < 0 )
+		return false;
+	cachekey_addstring(key, "input");
+	while( (got = pread(fd, buffer, sizeof(buffer), offset)) != 0 ) {
+		if( got < 0 && errno == EINTR )
+			continue;
+		if( got < 0 )
+			return false;
+		cachekey_add(key, buffer, got);
+		offset += got;
+	}
+	return true;
+}
+
+/* the libraries next to a libtool wrapper's real program */
+static int islibrary(const struct dirent *e) {
+	return strstr(e->d_name, ".so") != NULL;
+}
+
+static void addlibrarydir(struct cachekey *key, const char *dir) {
+	char path[PATH_MAX];
+	struct dirent **entries;
+	int i, count;
+
+	count = scandir(dir, &entries, islibrary, alphasort);
+	if( count < 0 ) {
+		cachekey_addstring(key, dir);
+		cachekey_addstring(key, "unreadable");
+		return;
+	}
+	for( i = 0 ; i < count ; i++ ) {
+		snprintf(path, sizeof(path), "%s/%s", dir,
+				entries[i]->d_name);
+		cachekey_addfile(key, path);
+		free(entries[i]);
+	}
+	free(entries);
+}
+
+#define WRAPPER_MARK "This wrapper script should never be moved out of the build directory"
+#define WRAPPER_MAX (1024*1024)
+#define WRAPPER_DIRS 32
+
+static inline bool delimiter(char c) {
+	return c == ':' || c == '"' || c == '\'' || c == ' ' || c == '\t' ||
+		c == '\n' || c == '\\' || c == '=' || c == ';' || c == '(' ||
+		c == ',';
+}
+
+/* A libtool wrapper script stays the same when the program it
+ * starts (in .libs/) or an uninstalled library it uses is rebuilt,
+ * so those are added, too: the libraries are looked for in every
+ * absolute .../.libs directory the script names (where it sets the
+ * library path or relinks with -rpath). */
+static void addlibtoolwrapper(struct cachekey *key, const char *path) {
+	char *data, *p, *start, *end, file[PATH_MAX];
+	char *dirs[WRAPPER_DIRS];
+	const char *name;
+	ssize_t got;
+	size_t len = 0;
+	int fd, dircount = 0, i;
+
+	fd = open(path, O_RDONLY|O_NOCTTY|O_CLOEXEC);
+	if( fd < 0 )
+		return;
+	data = malloc(WRAPPER_MAX + 1);
+	if( data == NULL ) {
+		close(fd);
+		return;
+	}
+	while( len < WRAPPER_MAX &&
+			(got = read(fd, data + len, WRAPPER_MAX - len)) != 0 ) {
+		if( got < 0 && errno == EINTR )
+			continue;
+		if( got < 0 )
+			break;
+		len += got;
+	}
+	close(fd);
+	data[len] = '\0';
+	if( len < 2 || data[0] != '#' || data[1] != '!' ||
+			memmem(data, len, WRAPPER_MARK,
+				strlen(WRAPPER_MARK)) == NULL ) {
+		free(data);
+		return;
+	}
+	name = strrchr(path, '/');
+	name = (name != NULL)?name + 1:path;
+	snprintf(file, sizeof(file), "%.*s.libs/%s",
+			(int)(name - path), path, name);
+	cachekey_addfile(key, file);
+	snprintf(file, sizeof(file), "%.*s.libs/lt-%s",
+			(int)(name - path), path, name);
+	cachekey_addfile(key, file);
+	p = data;
+	while( (p = memmem(p, data + len - p, "/.libs", 6)) != NULL ) {
+		end = p + 6;
+		p = end;
+		if( *end != '\0' && !delimiter(*end) && *end != '/' )
+			continue;
+		start = end - 6;
+		while( start > data && !delimiter(start[-1]) )
+			start--;
+		if( *start != '/' )
+			continue;
+		for( i = 0 ; i < dircount ; i++ ) {
+			if( strlen(dirs[i]) == (size_t)(end - start) &&
+					strncmp(dirs[i], start, end - start) == 0 )
+				break;
+		}
+		if( i < dircount || dircount == WRAPPER_DIRS )
+			continue;
+		dirs[dircount] = strndup(start, end - start);
+		if( dirs[dircount] != NULL )
+			dircount++;
+	}
+	for( i = 0 ; i < dircount ; i++ ) {
+		addlibrarydir(key, dirs[i]);
+		free(dirs[i]);
+	}
+	free(data);
+}
+
+static void addexecutable(struct cachekey *key, const char *path) {
+	cachekey_addfile(key, path);
+	addlibtoolwrapper(key, path);
+}
+
+void cachekey_addprogram(struct cachekey *key, const char *name) {
+	char path[PATH_MAX];
+	const char *dirs, *e;
+	size_t len;
+
+	if( strchr(name, '/') != NULL ) {
+		addexecutable(key, name);
+		return;
+	}
+	dirs = getenv("PATH");
+	if( dirs == NULL )
+		dirs = "/bin:/usr/bin";
+	while( *dirs != '\0' ) {
+		e = strchrnul(dirs, ':');
+		len = e - dirs;
+		if( len == 0 )
+			snprintf(path, sizeof(path), "%s", name);
+		else
+			snprintf(path, sizeof(path), "%.*s/%s",
+					(int)len, dirs, name);
+		if( access(path, X_OK) == 0 ) {
+			addexecutable(key, path);
+			return;
+		}
+		dirs = (*e == ':')?e + 1:e;
+	}
+	cachekey_addstring(key, name);
+	cachekey_addstring(key, "not found");
+}
+
+void cachekey_finish(struct cachekey *key, char hex[CACHEKEY_HEXSIZE]) {
+	uint64_t bits = key->length * 8;
+	unsigned char pad[72];
+	size_t padlen;
+	int i;
+
+	padlen = (key->used < 56)?56 - key->used:120 - key->used;
+	memset(pad, 0, sizeof(pad));
+	pad[0] = 0x80;
+	for( i = 0 ; i < 8 ; i++ )
+		pad[padlen + i] = bits >> (56 - 8*i);
+	cachekey_add(key, pad, padlen + 8);
+	for( i = 0 ; i < 32 ; i++ )
+		sprintf(hex + 2*i, "%02x",
+				(key->state[i/4] >> (24 - 8*(i%4))) & 0xff);
+}
+
+static char *recording = NULL;
+static size_t recordlen = 0, recordsize = 0;
+static bool recordfailed = false;
+
+void cache_record(int fd, const struct iovec *iov, int count) {
+	size_t len = 0, n;
+	uint32_t l;
+	char *p;
+	int i;
+
+	for( i = 0 ; i < count ; i++ )
+		len += iov[i].iov_len;
+	if( len == 0 || recordfailed )
+		return;
+	if( recordlen + len + 5 > recordsize ) {
+		n = (recordsize > 0)?recordsize:65536;
+		while( n < recordlen + len + 5 )
+			n *= 2;
+		p = realloc(recording, n);
+		if( p == NULL ) {
+			/* then it is simply not stored */
+			recordfailed = true;
+			return;
+		}
+		recording = p;
+		recordsize = n;
+	}
+	l = len;
+	recording[recordlen] = fd;
+	memcpy(recording + recordlen + 1, &l, 4);
+	recordlen += 5;
+	for( i = 0 ; i < count ; i++ ) {
+		memcpy(recording + recordlen, iov[i].iov_base, iov[i].iov_len);
+		recordlen += iov[i].iov_len;
+	}
+}
+
+void cache_free(void) {
+	free(recording);
+	recording = NULL;
+	recordlen = recordsize = 0;
+	recordfailed = false;
+}
+
+static bool writeall(int fd, const char *data, size_t len) {
+	ssize_t written;
+
+	while( len > 0 ) {
+		written = write(fd, data, len);
+		if( written < 0 && errno == EINTR )
+			continue;
+		if( written <= 0 ) {
+			if( written == 0 )
+				errno = EIO;
+			return false;
+		}
+		data += written;
+		len -= written;
+	}
+	return true;
+}
+
+static bool copyfile(int from, int to) {
+	char buffer[65536];
+	ssize_t got;
+
+	while( (got = read(from, buffer, sizeof(buffer))) != 0 ) {
+		if( got < 0 && errno == EINTR )
+			continue;
+		if( got < 0 || !writeall(to, buffer, got) )
+			return false;
+	}
+	return true;
+}
+
+/* DIR/XX/KEY with suffix, creating DIR/XX if asked to */
+static char *entryname(const char *dir, const char *key, const char *suffix, bool create) {
+	char *name;
+
+	if( asprintf(&name, "%s/%.2s", dir, key) < 0 )
+		return NULL;
+	if( create && mkdir(dir, 0777) != 0 && errno != EEXIST ) {
+		free(name);
+		return NULL;
+	}
+	if( create && mkdir(name, 0777) != 0 && errno != EEXIST ) {
+		free(name);
+		return NULL;
+	}
+	free(name);
+	if( asprintf(&name, "%s/%.2s/%s%s", dir, key, key, suffix) < 0 )
+		return NULL;
+	return name;
+}
+
+/* written under a temporary name and renamed, so others never see
+ * a partial entry */
+static bool storefile(const char *name, const char *data, size_t len, int from) {
+	char *tmp;
+	bool ok;
+	int fd;
+
+	if( asprintf(&tmp, "%s.XXXXXX", name) < 0 )
+		return false;
+	fd = mkostemp(tmp, O_CLOEXEC);
+	if( fd < 0 ) {
+		free(tmp);
+		return false;
+	}
+	if( from >= 0 )
+		ok = copyfile(from, fd);
+	else
+		ok = writeall(fd, data, len);
+	if( close(fd) != 0 )
+		ok = false;
+	if( ok && rename(tmp, name) != 0 )
+		ok = false;
+	if( !ok ) {
+		int e = errno;
+
+		(void)unlink(tmp);
+		errno = e;
+	}
+	free(tmp);
+	return ok;
+}
+
+bool cache_store(const char *dir, const char *key, const char *outfile) {
+	char *name, *outname;
+	bool ok = true;
+	int fd;
+
+	if( recordfailed ) {
+		errno = ENOMEM;
+		return false;
+	}
+	name = entryname(dir, key, "", true);
+	if( name == NULL )
+		return false;
+	/* the outfile first, so the entry is never there without it */
+	if( outfile != NULL ) {
+		outname = entryname(dir, key, ".out", false);
+		fd = open(outfile, O_RDONLY|O_NOCTTY|O_CLOEXEC);
+		ok = outname != NULL && fd >= 0 &&
+			storefile(outname, NULL, 0, fd);
+		if( fd >= 0 )
+			close(fd);
+		free(outname);
+	}
+	if( ok )
+		ok = storefile(name, recording, recordlen, -1);
+	free(name);
+	return ok;
+}
+
+/* checks everything first, as a partial replay could not be undone */
+static bool replayrecording(const char *data, size_t len) {
+	const char *p = data;
+	size_t left = len;
+	uint32_t l;
+
+	while( left > 0 ) {
+		if( left < 5 || (p[0] != 1 && p[0] != 2) )
+			return false;
+		memcpy(&l, p + 1, 4);
+		if( l > left - 5 )
+			return false;
+		p += 5 + l;
+		left -= 5 + l;
+	}
+	/* errors writing are ignored, as when echoing the output */
+	while( len > 0 ) {
+		memcpy(&l, data + 1, 4);
+		(void)writeall(data[0], data + 5, l);
+		data += 5 + l;
+		len -= 5 + l;
+	}
+	return true;
+}
+
+bool cache_replay(const char *dir, const char *key, const char *outfile) {
+	struct stat st;
+	char *name;
+	void *data = NULL;
+	int fd, ofd, out;
+	bool ok;
+
+	name = entryname(dir, key, "", false);
+	if( name == NULL )
+		return false;
+	fd = open(name, O_RDONLY|O_NOCTTY|O_CLOEXEC);
+	free(name);
+	if( fd < 0 )
+		return false;
+	if( fstat(fd, &st) != 0 ) {
+		close(fd);
+		return false;
+	}
+	if( st.st_size > 0 ) {
+		data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if( data == MAP_FAILED ) {
+			close(fd);
+			return false;
+		}
+	}
+	close(fd);
+	if( outfile != NULL ) {
+		name = entryname(dir, key, ".out", false);
+		ofd = (name != NULL)?open(name, O_RDONLY|O_NOCTTY|O_CLOEXEC):-1;
+		free(name);
+		if( ofd < 0 ) {
+			if( data != NULL )
+				munmap(data, st.st_size);
+			return false;
+		}
+		out = open(outfile, O_CREAT|O_TRUNC|O_NOFOLLOW|O_WRONLY|O_CLOEXEC,
+				0666);
+		ok = out >= 0 && copyfile(ofd, out);
+		if( out >= 0 && close(out) != 0 )
+			ok = false;
+		close(ofd);
+		if( !ok ) {
+			if( data != NULL )
+				munmap(data, st.st_size);
+			return false;
+		}
+	}
+	ok = replayrecording(data, st.st_size);
+	if( data != NULL )
+		munmap(data, st.st_size);
+	return ok;
+}
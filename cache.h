@@ -0,0 +1,51 @@
+#ifndef TESTTOOL_CACHE_H
+#define TESTTOOL_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/* Result cache for --cache=DIR: a passing run is recorded under a
+ * SHA-256 of everything deciding its outcome, and an invocation with
+ * the same key replays the recording instead of running anything.
+ *
+ * DIR/XX/KEY holds the echoed output as records of a stream byte
+ * (1 or 2), a 4 byte length and the data, DIR/XX/KEY.out a copy of
+ * the --outfile if there was one. Entries are never changed once
+ * written, anything changing gives a different key. */
+
+struct cachekey {
+	uint32_t state[8];
+	uint64_t length;
+	unsigned char block[64];
+	size_t used;
+};
+
+#define CACHEKEY_HEXSIZE 65
+
+void cachekey_init(struct cachekey *);
+void cachekey_add(struct cachekey *, const void *, size_t);
+/* including the terminating NUL, so "a","bc" differs from "ab","c" */
+void cachekey_addstring(struct cachekey *, const char *);
+/* the file's content (or that it could not be read) */
+void cachekey_addfile(struct cachekey *, const char *filename);
+/* the file a program name resolves to (looking in PATH if there is
+ * no '/'), and its content. For a libtool wrapper script also the
+ * program in .libs/ and the uninstalled libraries it names */
+void cachekey_addprogram(struct cachekey *, const char *name);
+/* what the program will read from that fd (a regular file from its
+ * current offset, /dev/null or a closed fd), false if that cannot
+ * be known beforehand (a pipe, a terminal, ...) */
+bool cachekey_addinput(struct cachekey *, int fd);
+void cachekey_finish(struct cachekey *, char hex[CACHEKEY_HEXSIZE]);
+
+/* collect what is written to stdout (1) or stderr (2) */
+void cache_record(int fd, const struct iovec *, int count);
+/* false (errno set) if the recording could not be stored */
+bool cache_store(const char *dir, const char *key, const char *outfile);
+/* false if there is no entry, true if it was replayed */
+bool cache_replay(const char *dir, const char *key, const char *outfile);
+void cache_free(void);
+
+#endif
@@ -0,0 +1,218 @@
+/*  This file is part of "testtool"
+ *  Copyright (C) 2006 Bernhard R. Link
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+#include <config.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "jobserver.h"
+
+/* the read end is always non-blocking, so that no other process
+ * taking the token between poll and read can make us hang */
+static int jsread = -1, jswrite = -1;
+static unsigned int slots = 0;
+/* the tokens got, make wants the same characters back */
+static char *tokens = NULL;
+static unsigned int held = 0, tokensize = 0;
+
+static bool isfifo(int fd) {
+	struct stat st;
+
+	return fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+}
+
+static bool openpipe(const char *fds) {
+	char link[40], *e;
+	long r, w;
+
+	r = strtol(fds, &e, 10);
+	if( e == fds || *e != ',' || r < 0 )
+		return false;
+	w = strtol(e + 1, &e, 10);
+	if( *e != '\0' || w < 0 )
+		return false;
+	/* make does not pass them to commands not marked as recursive */
+	if( !isfifo(r) || !isfifo(w) )
+		return false;
+	/* a new open file description, as O_NONBLOCK must not be set
+	 * on the one shared with make */
+	snprintf(link, sizeof(link), "/proc/self/fd/%ld", r);
+	jsread = open(link, O_RDONLY|O_NONBLOCK|O_CLOEXEC);
+	if( jsread < 0 )
+		return false;
+	jswrite = w;
+	return true;
+}
+
+static bool openfifo(const char *path) {
+	jsread = open(path, O_RDONLY|O_NONBLOCK|O_CLOEXEC);
+	if( jsread < 0 )
+		return false;
+	jswrite = open(path, O_WRONLY|O_CLOEXEC);
+	if( jswrite < 0 || !isfifo(jsread) ) {
+		close(jsread);
+		if( jswrite >= 0 )
+			close(jswrite);
+		jsread = jswrite = -1;
+		return false;
+	}
+	return true;
+}
+
+bool jobserver_open(const char *makeflags) {
+	char *flags, *word, *save, *auth = NULL;
+	bool ok = false;
+
+	if( jsread >= 0 )
+		return true;
+	if( makeflags == NULL )
+		return false;
+	flags = strdup(makeflags);
+	if( flags == NULL )
+		return false;
+	/* the last one counts */
+	for( word = strtok_r(flags, " \t", &save) ; word != NULL ;
+			word = strtok_r(NULL, " \t", &save) ) {
+		if( strncmp(word, "--jobserver-auth=", 17) == 0 )
+			auth = word + 17;
+		else if( strncmp(word, "--jobserver-fds=", 16) == 0 )
+			auth = word + 16;
+		else if( strncmp(word, "-j", 2) == 0 && word[2] >= '1' &&
+				word[2] <= '9' )
+			slots = strtoul(word + 2, NULL, 10);
+	}
+	if( auth != NULL && strncmp(auth, "fifo:", 5) == 0 )
+		ok = openfifo(auth + 5);
+	else if( auth != NULL )
+		ok = openpipe(auth);
+	free(flags);
+	return ok;
+}
+
+unsigned int jobserver_slots(void) {
+	return slots;
+}
+
+unsigned int jobserver_held(void) {
+	return held;
+}
+
+bool jobserver_tryacquire(void) {
+	char *n, c;
+	ssize_t got;
+
+	if( jsread < 0 )
+		return false;
+	if( held >= tokensize ) {
+		n = realloc(tokens, tokensize + 16);
+		if( n == NULL ) {
+			errno = ENOMEM;
+			return false;
+		}
+		tokens = n;
+		tokensize += 16;
+	}
+	do {
+		got = read(jsread, &c, 1);
+	} while( got < 0 && errno == EINTR );
+	if( got == 0 ) {
+		/* make is gone */
+		errno = EPIPE;
+		return false;
+	}
+	if( got != 1 )
+		return false;
+	tokens[held++] = c;
+	return true;
+}
+
+void jobserver_releaseone(void) {
+	ssize_t got;
+
+	if( held == 0 )
+		return;
+	do {
+		got = write(jswrite, &tokens[held - 1], 1);
+	} while( got < 0 && errno == EINTR );
+	held--;
+}
+
+void jobserver_release(void) {
+	while( held > 0 )
+		jobserver_releaseone();
+}
+
+void jobserver_forget(void) {
+	held = 0;
+}
+
+bool jobserver_acquire(unsigned int count, int timeout) {
+	struct pollfd p;
+	struct timespec now, end;
+	unsigned int had = held;
+	int left = timeout;
+
+	if( jsread < 0 )
+		return false;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	end.tv_sec += timeout / 1000;
+	end.tv_nsec += (long)(timeout % 1000) * 1000000;
+	if( end.tv_nsec >= 1000000000 ) {
+		end.tv_sec++;
+		end.tv_nsec -= 1000000000;
+	}
+	while( held - had < count ) {
+		if( jobserver_tryacquire() )
+			continue;
+		if( errno != EAGAIN && errno != EWOULDBLOCK )
+			break;
+		if( left <= 0 ) {
+			/* whatever we got is better than nothing, when every
+			 * other slot is held by others waiting the same way */
+			errno = ETIMEDOUT;
+			return false;
+		}
+		if( held > had ) {
+			/* holding some while waiting for more could
+			 * deadlock with others doing the same, so give
+			 * them back and let the others try first */
+			while( held > had )
+				jobserver_releaseone();
+			usleep(1000 + (unsigned int)getpid() % 4000);
+		}
+		p.fd = jsread;
+		p.events = POLLIN;
+		if( poll(&p, 1, left) < 0 && errno != EINTR )
+			break;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		left = (end.tv_sec - now.tv_sec) * 1000 +
+			(end.tv_nsec - now.tv_nsec) / 1000000;
+	}
+	if( held - had == count )
+		return true;
+	while( held > had )
+		jobserver_releaseone();
+	return false;
+}
@@ -0,0 +1,30 @@
+#ifndef TESTTOOL_JOBSERVER_H
+#define TESTTOOL_JOBSERVER_H
+
+#include <stdbool.h>
+
+/* Client for the jobserver of GNU make, as announced in MAKEFLAGS
+ * with --jobserver-auth=R,W (or the older --jobserver-fds=R,W) for
+ * a pipe or --jobserver-auth=fifo:PATH for a named pipe.
+ * The process itself already has one implicit job slot, tokens are
+ * only needed for everything beyond that. */
+
+/* false if there is no (usable) jobserver */
+bool jobserver_open(const char *makeflags);
+/* the N of -jN if make told it, 0 otherwise */
+unsigned int jobserver_slots(void);
+/* get one token if one is available right now */
+bool jobserver_tryacquire(void);
+/* wait up to timeout milliseconds until count tokens could be taken
+ * at once. false with errno ETIMEDOUT if that did not happen, then
+ * the tokens available at the end are held anyway. false (holding
+ * none of them) on other errors */
+bool jobserver_acquire(unsigned int count, int timeout);
+/* give back one or all tokens held */
+void jobserver_releaseone(void);
+void jobserver_release(void);
+unsigned int jobserver_held(void);
+/* in a forked child: the tokens are the parent's to give back */
+void jobserver_forget(void);
+
+#endif
@@ -0,0 +1,206 @@
+/*  This file is part of "testtool"
+ *  Copyright (C) 2006 Bernhard R. Link
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+#include <config.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "linetiming.h"
+
+/* values below SUBBUCKETS microseconds have a bucket each, above
+ * each power of two is split into SUBBUCKETS buckets */
+#define SUBBITS 3
+#define SUBBUCKETS (1 << SUBBITS)
+#define BUCKETS (64 * SUBBUCKETS)
+/* how many of the longest gaps are reported */
+#define STALLS 5
+/* how much of the line before a gap is kept */
+#define KEEP 72
+
+struct stall {
+	uint64_t gap;
+	unsigned long long line;
+	size_t len;
+	char text[KEEP];
+};
+
+static struct streamtiming {
+	unsigned long long lines;
+	uint64_t first, last, max;
+	unsigned long long counts[BUCKETS];
+	struct stall stalls[STALLS];
+	/* the line before the next gap */
+	size_t len;
+	char text[KEEP];
+} streams[3];
+
+static inline uint64_t microseconds(const struct timespec *t) {
+	return (uint64_t)t->tv_sec * 1000000 + t->tv_nsec / 1000;
+}
+
+static unsigned int bucket(uint64_t v) {
+	unsigned int e;
+
+	if( v < SUBBUCKETS )
+		return v;
+	e = 63 - __builtin_clzll(v);
+	return (e - SUBBITS + 1) * SUBBUCKETS +
+		((v >> (e - SUBBITS)) & (SUBBUCKETS - 1));
+}
+
+static uint64_t bucketlow(unsigned int b) {
+	if( b < SUBBUCKETS )
+		return b;
+	return (uint64_t)(SUBBUCKETS + b % SUBBUCKETS)
+		<< (b / SUBBUCKETS - 1);
+}
+
+/* the highest value counted in that bucket */
+static uint64_t buckethigh(unsigned int b) {
+	if( b < SUBBUCKETS )
+		return b;
+	return bucketlow(b) + ((uint64_t)1 << (b / SUBBUCKETS - 1)) - 1;
+}
+
+static void keepstall(struct streamtiming *s, uint64_t gap) {
+	int i;
+
+	if( gap <= s->stalls[STALLS-1].gap )
+		return;
+	for( i = STALLS - 1 ; i > 0 && s->stalls[i-1].gap < gap ; i-- )
+		s->stalls[i] = s->stalls[i-1];
+	s->stalls[i].gap = gap;
+	s->stalls[i].line = s->lines;
+	s->stalls[i].len = s->len;
+	memcpy(s->stalls[i].text, s->text, s->len);
+}
+
+void linetiming_line(int stream, const struct timespec *arrival, const char *line, size_t len) {
+	struct streamtiming *s = &streams[stream];
+	uint64_t now = microseconds(arrival), gap;
+
+	if( s->lines == 0 )
+		s->first = now;
+	else {
+		gap = (now > s->last)?now - s->last:0;
+		s->counts[bucket(gap)]++;
+		if( gap > s->max )
+			s->max = gap;
+		keepstall(s, gap);
+	}
+	s->last = now;
+	s->lines++;
+	s->len = (len < KEEP)?len:KEEP;
+	memcpy(s->text, line, s->len);
+}
+
+static const char *duration(char *buffer, size_t size, uint64_t us) {
+	if( us < 1000 )
+		snprintf(buffer, size, "%uus", (unsigned int)us);
+	else if( us < 1000000 )
+		snprintf(buffer, size, "%.2fms", us / 1e3);
+	else
+		snprintf(buffer, size, "%.3fs", us / 1e6);
+	return buffer;
+}
+
+/* the value below which that fraction of the gaps are */
+static uint64_t percentile(const struct streamtiming *s, double fraction) {
+	unsigned long long rank, seen = 0;
+	double wanted = fraction * (s->lines - 1);
+	unsigned int b;
+
+	rank = (unsigned long long)wanted;
+	if( rank < wanted || rank == 0 )
+		rank++;
+	for( b = 0 ; b < BUCKETS ; b++ ) {
+		seen += s->counts[b];
+		if( seen >= rank )
+			return (buckethigh(b) < s->max)?buckethigh(b):s->max;
+	}
+	return s->max;
+}
+
+static void reportstream(int stream, const char *name, uint64_t start) {
+	const struct streamtiming *s = &streams[stream];
+	char p50[16], p90[16], p99[16], p999[16], max[16], low[16], high[16];
+	unsigned long long count;
+	unsigned int b, e;
+	int i;
+
+	if( s->lines == 0 ) {
+		fprintf(stderr, "%s: line-timing %s: lines=0\n",
+				program_invocation_short_name, name);
+		return;
+	}
+	fprintf(stderr, "%s: line-timing %s: lines=%llu first-line=%.6f",
+			program_invocation_short_name, name, s->lines,
+			(s->first > start)?(s->first - start) / 1e6:0.0);
+	if( s->lines < 2 ) {
+		fputc('\n', stderr);
+		return;
+	}
+	fprintf(stderr, " gap-p50=%s gap-p90=%s gap-p99=%s gap-p99.9=%s"
+			" gap-max=%s\n",
+			duration(p50, sizeof(p50), percentile(s, 0.5)),
+			duration(p90, sizeof(p90), percentile(s, 0.9)),
+			duration(p99, sizeof(p99), percentile(s, 0.99)),
+			duration(p999, sizeof(p999), percentile(s, 0.999)),
+			duration(max, sizeof(max), s->max));
+	/* shown by powers of two, the finer buckets are only for the
+	 * percentiles */
+	if( s->counts[0] > 0 )
+		fprintf(stderr, "%s: line-timing %s: gaps <1us: %llu\n",
+				program_invocation_short_name, name,
+				s->counts[0]);
+	for( e = 0 ; e < 64 ; e++ ) {
+		unsigned int from, to;
+
+		if( e < SUBBITS ) {
+			from = 1u << e;
+			to = 2u << e;
+		} else {
+			from = (e - SUBBITS + 1) * SUBBUCKETS;
+			to = from + SUBBUCKETS;
+		}
+		count = 0;
+		for( b = from ; b < to ; b++ )
+			count += s->counts[b];
+		if( count == 0 )
+			continue;
+		fprintf(stderr, "%s: line-timing %s: gaps %s-%s: %llu\n",
+				program_invocation_short_name, name,
+				duration(low, sizeof(low), bucketlow(from)),
+				duration(high, sizeof(high),
+					buckethigh(to - 1) + 1),
+				count);
+	}
+	for( i = 0 ; i < STALLS && s->stalls[i].gap > 0 ; i++ )
+		fprintf(stderr, "%s: line-timing %s: stall of %s after"
+				" line %llu: %.*s\n",
+				program_invocation_short_name, name,
+				duration(max, sizeof(max), s->stalls[i].gap),
+				s->stalls[i].line,
+				(int)s->stalls[i].len, s->stalls[i].text);
+}
+
+void linetiming_report(const struct timespec *start) {
+	reportstream(1, "stdout", microseconds(start));
+	reportstream(2, "stderr", microseconds(start));
+}
@@ -0,0 +1,19 @@
+#ifndef TESTTOOL_LINETIMING_H
+#define TESTTOOL_LINETIMING_H
+
+#include <stddef.h>
+#include <time.h>
+
+/* When the lines of stdout (1) and stderr (2) arrived, for
+ * --line-timing. The gaps between consecutive lines of a stream are
+ * counted in a histogram of fixed relative precision (like a HDR
+ * histogram: each power of two of microseconds is split into 8
+ * buckets), the longest ones are kept with the line before them.
+ * A line arrives when the read giving its end returned, so lines
+ * from the same read have no gap between them. */
+
+void linetiming_line(int stream, const struct timespec *arrival, const char *line, size_t len);
+/* prints what was collected to stderr, times relative to start */
+void linetiming_report(const struct timespec *start);
+
+#endif
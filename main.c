@@ -25,28 +25,145 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <getopt.h>
+#include <fnmatch.h>
 #include <malloc.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
 #include <fcntl.h>
+#include <dirent.h>
+#include <stdint.h>
+#include <sched.h>
+#include <time.h>
+
+#include "scan.h"
+#include "pattern.h"
+#include "server.h"
+#include "vgxml.h"
+#include "batch.h"
+#include "jobserver.h"
+#include "outfile.h"
+#include "cache.h"
+#include "reader.h"
+#include "linetiming.h"
 
 /* return if there is some error (opposed to a failed check) */
 #define TESTTOOL_ERROR_EXIT 2
+/* return if the program was killed because of --fail-fast */
+#define TESTTOOL_FAILFAST_EXIT 3
 
 static bool silent = false;
 static bool echo = false;
 static bool annotate = false;
 static bool use_debugger = false;
 static bool readrules = false;
+static bool compile_rules = false;
+static char *compiledfile = NULL;
 static bool ignoreunexpected = false;
+static bool print_stats = false;
+static bool print_timing = false;
+static bool print_rusage = false;
+/* let valgrind write XML to the command fd instead of text */
+static bool valgrind_xml = false;
+/* collect the reports of a program built with -fsanitize= */
+static bool use_sanitizer = false;
+/* what the program (and its waited for children) used */
+static struct rusage childusage;
+/* limits from the rules, 0 if none */
+static struct {
+	uint64_t time, cpu;	/* in microseconds */
+	uint64_t rss;		/* in bytes */
+} budget = { 0, 0, 0 };
+/* when the program was started, produced output and was done */
+static struct {
+	struct timespec spawn, started, firstoutput, exited;
+	bool output;
+} timing;
+/* collect when each line arrived / prefix echoed lines with it */
+static bool line_timing = false;
+static bool elapsed_prefix = false;
+/* when the data of the lines being checked was read, only set
+ * if one of the above is */
+static struct timespec arrival;
+/* listen there for jobs (from testtool with TESTTOOL_SERVER set) */
+static char *server_socket = NULL;
+/* set in the process running a job for a client or of a --batch */
+static bool server_worker = false;
+/* in a worker the exit status is what the client waits for */
+static int server_connection = -1;
+/* run the tests listed there, that many at the same time */
+static char *batch_manifest = NULL;
+static unsigned int batch_jobs = 1;
+/* how many jobs of make's jobserver a run with --debugger counts as,
+ * 0 if not given (then TESTTOOL_DEBUGGER_WEIGHT is looked at) */
+static unsigned int debugger_weight = 0;
+/* the program's stdin, fed through a pipe unless stdin_direct,
+ * rules_stdin is from the rules (and points into the image) */
+static char *stdin_file = NULL;
+static const char *rules_stdin = NULL;
+static bool stdin_direct = false;
+/* drain stdout and stderr in a thread of their own (see reader.h),
+ * holding at most queuelimit bytes not yet checked (0: no limit) */
+static bool pipeline = true;
+static size_t queuelimit = 64*1024*1024;
+/* replay passing runs recorded there, NULL if not given (then
+ * TESTTOOL_CACHE is looked at unless --no-cache) */
+static char *cache_dir = NULL;
+static bool no_cache = false;
+/* environment variables and files that are part of the key */
+static struct namelist {
+	size_t count;
+	char **names;
+} cache_env, cache_inputs;
+/* flushout also gives everything to cache_record, and our own
+ * messages go through recordedstderr meanwhile */
+static bool cache_recording = false;
+static FILE *realstderr = NULL;
+/* signal to send on the first failure, 0 to wait for the end */
+static int failfast_signal = 0;
+/* in microseconds, 0 for none */
+static uint64_t timeout = 0;
+/* after a timeout, how long to wait after TERM and after KILL */
+#define TIMEOUT_GRACE 5000000
+/* setrlimit(2) limits for the program, indexed like limitnames */
+static const struct {
+	const char *name;
+	int resource;
+	bool size;
+} limitnames[] = {
+	{"as", RLIMIT_AS, true}, {"cpu", RLIMIT_CPU, false},
+	{"nofile", RLIMIT_NOFILE, false}, {"fsize", RLIMIT_FSIZE, true},
+	{NULL, 0, false}
+};
+#define LIMIT_AS 0
+#define LIMIT_CPU 1
+#define LIMIT_NOFILE 2
+#define LIMIT_FSIZE 3
+static struct {
+	bool set;
+	rlim_t value;
+} limits[4];
 static char *debugger = NULL;
 static char *outfile = NULL;
-static int outfile_fd = -1;
+static bool outfile_active = false;
+static enum outfile_compression outfile_compression = OC_AUTO;
+static unsigned long long outfile_written = 0;
 static unsigned char expected_returncode = 0;
+/* if set, the rules cannot change expected_returncode */
+static bool returncode_given = false;
 static int command_fd = -1;
 static int variables['z'-'a'+2] = { INT_MAX,INT_MAX,INT_MAX,INT_MAX,INT_MAX,INT_MAX,INT_MAX,INT_MAX,INT_MAX,INT_MAX,INT_MAX,INT_MAX,INT_MAX,INT_MAX,INT_MAX,INT_MAX,INT_MAX,INT_MAX,INT_MAX,INT_MAX,INT_MAX,INT_MAX,INT_MAX,INT_MAX,INT_MAX,INT_MAX,INT_MAX};
 
+static int rules_fd(void) {
+	return (command_fd < 0)?3:command_fd;
+}
+
 static void usage(int code) __attribute__ ((noreturn));
 static void usage(int code) {
 	printf("%s: run a command and check its output\n",
@@ -55,6 +172,10 @@ static void usage(int code) {
 			" [--debugger=debugger [debugger options]]"
 			" [--] program [program options]\n",
 		program_invocation_name);
+	printf("or: %s --compile-rules[=file] 3<rules-file\n",
+		program_invocation_name);
+	printf("or: %s [options] --batch=manifest [--jobs=N]\n",
+		program_invocation_name);
 	printf("or: %s --rules [options]"
 			" [--debugger=debugger [debugger options]]"
 			" [--] program [program options] 3<rules-file\n",
@@ -66,10 +187,68 @@ static void usage(int code) {
 	puts("	--echo: echo commands before executing them");
 	puts("	--annotate: annotate lines (to debug rules)");
 	puts("	--rules: read rules (default from fd 3)");
+	puts("	--compile-rules[=file]: compile rules (default next to them)");
 	puts("	--debugger: debugger (and its options) start the program in");
 	puts("	--outfile: file to save stdoutput into");
+	puts("	--outfile-compression=auto|none|gzip|zstd: compress the");
+	puts("	                      outfile (auto: gzip for *.gz, zstd");
+	puts("	                      for *.zst if compiled in, else");
+	puts("	                      none)");
 	puts("	--variable C=N: set variable for conditional rules");
 	puts("	--checkout: do not ignore unknown stdout data");
+	puts("	--stats: print I/O and matching statistics as key=value");
+	puts("	         pairs when done");
+	puts("	--buffer-limit=N[k|M|G]: longer lines are overlong (default 64M)");
+	puts("	--fail-fast[=SIG]: kill the program with SIG (default TERM)");
+	puts("	                   at the first unexpected or malformed line");
+	puts("	--timing: print how long starting the program and its first");
+	puts("	          output took");
+	puts("	--rusage: print the resources used by the program");
+	puts("	--valgrind-xml: let valgrind report errors as XML and check them");
+	puts("	                against the 'valgrind' rules");
+	puts("	--sanitizer: check the reports of a program built with");
+	puts("	             -fsanitize=address, leak or undefined");
+	puts("	--timeout=SECONDS: send TERM to the program after that long");
+	puts("	                   (KILL 5 seconds later)");
+	puts("	--limit=RESOURCE=N: set a limit for the program, RESOURCE is");
+	puts("	                    as, cpu, nofile or fsize (as and fsize");
+	puts("	                    in bytes with optional k, M or G suffix)");
+	puts("	--server=SOCKET: keep running and do the work for invocations");
+	puts("	                 with TESTTOOL_SERVER=SOCKET in the environment");
+	puts("	--batch=MANIFEST: run all tests listed in MANIFEST, showing");
+	puts("	                  the output of those failing");
+	puts("	--jobs=N: with --batch, run N tests at once (0: one per CPU)");
+	puts("	          (and no more than make's jobserver allows)");
+	puts("	--debugger-weight=N: with make's jobserver, let a run with");
+	puts("	                     --debugger take N job slots (default");
+	puts("	                     from TESTTOOL_DEBUGGER_WEIGHT, else 1)");
+	puts("	--stdin=FILE: feed FILE (or what a fifo gives) to the program's");
+	puts("	              stdin, like a 'stdin FILE' rule");
+	puts("	--stdin-direct: give a regular FILE itself as stdin instead of");
+	puts("	                copying it through a pipe, so the program can");
+	puts("	                seek or mmap it");
+	puts("	--cache=DIR: record passing runs there and replay them instead");
+	puts("	             of running the program again if nothing changed");
+	puts("	             (default from TESTTOOL_CACHE). Only the program");
+	puts("	             (for a libtool wrapper also .libs/ and the");
+	puts("	             libraries it names), the arguments, the rules and");
+	puts("	             stdin are looked at: every other file the test");
+	puts("	             depends on MUST be listed with --cache-input.");
+	puts("	             Not used if stdin is not a regular file or");
+	puts("	             /dev/null (a pipe or terminal)");
+	puts("	--no-cache: always run the program");
+	puts("	--cache-env=NAME: the outcome also depends on that variable");
+	puts("	--cache-input=FILE: the outcome also depends on that file");
+	puts("	--no-pipeline: read the program's output in the same thread");
+	puts("	               that checks it");
+	puts("	--queue-limit=N[k|M|G]: read ahead of the checking at most");
+	puts("	               that much (default 64M, 0: no limit), then");
+	puts("	               the program has to wait again once its pipe");
+	puts("	               is full (counted as reader_stalls in --stats)");
+	puts("	--line-timing: print when the first line came, a histogram of");
+	puts("	               the gaps between lines and the longest ones");
+	puts("	               with the line before them, for each stream");
+	puts("	--elapsed: prefix echoed lines with the seconds since start");
 	exit(code);
 }
 
@@ -80,7 +259,9 @@ static const char **createarguments(int *count, char **args, int argc) {
 
 	argumentcount = argc+1;
 	if( use_debugger ) {
-		if( debugger == NULL )
+		if( debugger == NULL && valgrind_xml )
+			argumentcount += 5;
+		else if( debugger == NULL )
 			argumentcount += 2;
 		else
 			argumentcount++;
@@ -89,7 +270,15 @@ static const char **createarguments(int *count, char **args, int argc) {
 	results = malloc(sizeof(char*)*argumentcount);
 	p = results;
 	if( use_debugger ) {
-		if( debugger == NULL ) {
+		if( debugger == NULL && valgrind_xml ) {
+			assert(argumentcount > 4);
+			*(p++) = "valgrind";
+			*(p++) = "--xml=yes";
+			*(p++) = "--xml-fd=3";
+			*(p++) = "--log-file=/dev/null";
+			*(p++) = "--leak-check=full";
+			argumentcount -= 5;
+		} else if( debugger == NULL ) {
 			assert(argumentcount > 1);
 			*(p++) = "valgrind";
 			*(p++) = "--log-fd=3";
@@ -110,6 +299,194 @@ static const char **createarguments(int *count, char **args, int argc) {
 	return results;
 }
 
+/* pipe capacity requested for the child's output */
+#define PIPE_CAPACITY (1024*1024)
+/* initial read size, doubled whenever a read fills the buffer */
+#define MINREAD 65536
+
+/* lines longer than this are cut and counted as overlong,
+ * which also limits how large line buffers can get */
+static size_t linelimit = 64*1024*1024;
+
+/* data[start..len) is the yet incomplete last line, new data is read
+ * behind it. It is only moved to the front when the end of the buffer
+ * is reached, and the buffer only grows if that does not suffice. */
+struct linebuffer {
+	char *data;
+	size_t size, start, len;
+	/* how much to make room for before the next read */
+	size_t readsize;
+	/* skip until the end of the current (overlong) line */
+	bool overrun;
+	/* how far the incomplete line was already looked at */
+	struct scanstate scan;
+};
+
+static struct {
+	/* stdin_splices are the splice calls feeding --stdin */
+	unsigned long reads, writes, waits, stdin_splices;
+	unsigned long long bytes;
+} iostats;
+/* what happened to the data of stdout (1) and stderr (2),
+ * for stdin (0) only the bytes fed into it are counted */
+static struct {
+	unsigned long long bytes, reads, lines;
+	unsigned long long expected, ignored, normal, unexpected;
+} streamstats[3];
+/* only measured with --stats: hash slots and pattern sets looked at,
+ * seconds spent checking lines and waiting in epoll */
+static struct {
+	unsigned long long probes, patternmatches;
+	unsigned long long controlbytes, controllines;
+	double checking, waiting;
+} hotstats;
+
+static double elapsed(const struct timespec *from, const struct timespec *to) {
+	return (to->tv_sec - from->tv_sec) +
+		(to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+/* echoed output of stdout (1) and stderr (2) is collected here and
+ * written with a single writev at the end of each chunk read */
+#define OUTBUFFER_IOVS 1024
+
+static struct outbuffer {
+	int count;
+	struct iovec iov[OUTBUFFER_IOVS];
+} outbuffers[3];
+
+enum { AN_EXPECTED, AN_IGNORED, AN_NORMAL, AN_UNEXPECTED, AN_UNTERMINATED,
+	AN_OVERLONG, AN_COUNT };
+
+static const char * const annotations[3][AN_COUNT] = {
+	[1] = { "EXPECTED(1):", "IGNORED(1):", "NORMAL(1):", "UNEXPECTED(1):",
+		"UNTERMINATED/OVERLONG LINE(1)\n", "[UNTERMINATED/OVERLONG]\n" },
+	[2] = { "EXPECTED(2):", "IGNORED(2):", "NORMAL(2):", "UNEXPECTED(2):",
+		"UNTERMINATED/OVERLONG LINE(2)\n", "[UNTERMINATED/OVERLONG]\n" },
+};
+
+static void flushout(int fd) {
+	struct outbuffer *ob = &outbuffers[fd];
+	struct iovec *iov = ob->iov;
+	int count = ob->count;
+	ssize_t written;
+
+	if( cache_recording )
+		cache_record(fd, iov, count);
+	while( count > 0 ) {
+		written = writev(fd, iov, count);
+		iostats.writes++;
+		if( written < 0 && errno == EINTR )
+			continue;
+		if( written <= 0 )
+			break;
+		while( count > 0 && (size_t)written >= iov->iov_len ) {
+			written -= iov->iov_len;
+			iov++; count--;
+		}
+		if( count > 0 ) {
+			iov->iov_base = (char*)iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+	}
+	ob->count = 0;
+}
+
+/* data must stay valid until the next flushout */
+static inline void queueout(int fd, const char *data, size_t len) {
+	struct outbuffer *ob = &outbuffers[fd];
+
+	/* consecutive lines of the same chunk become one entry */
+	if( ob->count > 0 && (const char*)ob->iov[ob->count-1].iov_base +
+			ob->iov[ob->count-1].iov_len == data ) {
+		ob->iov[ob->count-1].iov_len += len;
+		return;
+	}
+	if( ob->count == OUTBUFFER_IOVS )
+		flushout(fd);
+	ob->iov[ob->count].iov_base = (char*)data;
+	ob->iov[ob->count].iov_len = len;
+	ob->count++;
+}
+
+static inline void queueannotation(int fd, int kind) {
+	queueout(fd, annotations[fd][kind], strlen(annotations[fd][kind]));
+}
+
+/* the prefix of --elapsed is kept in the slot of the entry it becomes */
+#define ELAPSED_SIZE 24
+static char elapsedprefixes[3][OUTBUFFER_IOVS][ELAPSED_SIZE];
+
+static void queueelapsed(int fd) {
+	struct outbuffer *ob = &outbuffers[fd];
+	char *p;
+	int len;
+
+	if( ob->count == OUTBUFFER_IOVS )
+		flushout(fd);
+	p = elapsedprefixes[fd][ob->count];
+	len = snprintf(p, ELAPSED_SIZE, "[%10.6f] ",
+			elapsed(&timing.spawn, &arrival));
+	if( len >= ELAPSED_SIZE )
+		len = ELAPSED_SIZE - 1;
+	queueout(fd, p, len);
+}
+
+static bool preparebuffer(struct linebuffer *lb) {
+	size_t pending, newsize;
+	char *n;
+
+	if( lb->readsize == 0 )
+		lb->readsize = MINREAD;
+	if( lb->size - lb->len >= lb->readsize )
+		return true;
+	pending = lb->len - lb->start;
+	if( lb->start > 0 ) {
+		memmove(lb->data, lb->data + lb->start, pending);
+		lb->start = 0;
+		lb->len = pending;
+		if( lb->size - lb->len >= lb->readsize )
+			return true;
+	}
+	newsize = (lb->size > 0)?2*lb->size:MINREAD;
+	while( newsize < pending + lb->readsize )
+		newsize *= 2;
+	n = realloc(lb->data, newsize);
+	if( n == NULL )
+		return lb->size > lb->len;
+	lb->data = n;
+	lb->size = newsize;
+	return true;
+}
+
+/* read more at once next time if this read filled all it could */
+static inline void adaptreadsize(struct linebuffer *lb, size_t got, size_t space) {
+	iostats.bytes += got;
+	if( got == space && lb->readsize < PIPE_CAPACITY )
+		lb->readsize *= 2;
+}
+
+/* read what is waiting, returns like read(2) */
+static ssize_t fillbuffer(int fd, struct linebuffer *lb) {
+	ssize_t got;
+
+	if( !preparebuffer(lb) )
+		return -1;
+	got = read(fd, lb->data + lb->len, lb->size - lb->len);
+	iostats.reads++;
+	if( got > 0 )
+		adaptreadsize(lb, got, lb->size - lb->len);
+	return got;
+}
+
+/* everything before linestart has been processed */
+static inline void dropconsumed(struct linebuffer *lb, size_t linestart) {
+	if( linestart == lb->len )
+		lb->start = lb->len = 0;
+	else
+		lb->start = linestart;
+}
+
 static bool controlline(char *line, size_t len, int *result, pid_t child) {
 	char *p = line;
 	pid_t pid = 0;
@@ -152,13 +529,13 @@ static bool controlline(char *line, size_t len, int *result, pid_t child) {
 }
 
 static bool readcontroldata(int fd, int *result, pid_t child) {
-	static char buffer[10000];
-	static size_t len = 0;
-	size_t overrun = false;
+	static struct linebuffer controldata = { NULL, 0, 0, 0, 0, false, { HASH_SEED, 0 } };
+	struct linebuffer *lb = &controldata;
 	ssize_t got;
-	size_t i,linestart;
+	size_t linestart;
+	const char *p, *q, *end, *limit;
 
-	got = read(fd, buffer+len, 1000-len);
+	got = fillbuffer(fd, lb);
 	if( got < 0 ) {
 		fprintf(stderr, "%s: Error reading from helper: %s\n",
 				program_invocation_short_name,
@@ -167,173 +544,1446 @@ static bool readcontroldata(int fd, int *result, pid_t child) {
 	} else if( got == 0 ) { /* End of file */
 		return true;
 	}
+	hotstats.controlbytes += got;
 
-	linestart = 0;
-	for( i = len ; i < len+got ; i++ ) {
-		if( buffer[i] == '\n' || buffer[i] == '\0' ) {
-			if( !overrun &&	controlline(buffer+linestart, i-linestart+1,
-						result, child) )
-				write(2, buffer+linestart, i-linestart+1);
+	linestart = lb->start;
+	p = lb->data + lb->len;
+	end = p + got;
+	while( true ) {
+		const char *line = lb->data + linestart;
 
-			overrun = false;
-			linestart = i+1;
+		limit = ((size_t)(end - line) > linelimit)?line+linelimit:end;
+		q = findbreak(p, limit);
+		if( q == limit ) {
+			if( (size_t)(limit - line) < linelimit )
+				break;
+			lb->overrun = true;
+			queueout(2, line, linelimit);
+			queueout(2, "[...]\n", 6);
+			linestart += linelimit;
+			p = limit;
+			continue;
 		}
+		hotstats.controllines++;
+		if( !lb->overrun && controlline((char*)line, q-line+1,
+					result, child) )
+			queueout(2, line, q-line+1);
+		lb->overrun = false;
+		linestart = q + 1 - lb->data;
+		p = q + 1;
 	}
-	len += got;
-	if( linestart == 0 && len == sizeof(buffer) ) {
-		overrun = true;
-		write(2, buffer, got);
-		write(2, "[...]\n", 6);
-		len = 0;
-	} else if( linestart == len )
-		len = 0;
-	else {
-		len -= linestart;
-		memmove(buffer, buffer+linestart, len);
+	lb->len += got;
+	flushout(2);
+	dropconsumed(lb, linestart);
+	return false;
+}
+
+/* With --sanitizer the reports of AddressSanitizer, LeakSanitizer and
+ * UndefinedBehaviorSanitizer are collected. Those cannot be told to
+ * write to some file descriptor, only to files whose name gets the
+ * pid appended, so they go into a directory of their own and are read
+ * once the program is done. */
+static char *sanitizer_dir = NULL;
+static const char * const sanitizervariables[] = {
+	"ASAN_OPTIONS", "LSAN_OPTIONS", "UBSAN_OPTIONS", NULL
+};
+static struct {
+	unsigned long reports, errors, leaks;
+	unsigned long long leakedbytes;
+} sanitizerfound;
+
+static bool sanitizerline(const char *line, size_t len, int *result) {
+	const char *p = line, *end = line + len;
+	unsigned long long bytes;
+
+	/* "==PID==" */
+	if( len > 2 && p[0] == '=' && p[1] == '=' ) {
+		p += 2;
+		while( p < end && *p >= '0' && *p <= '9' )
+			p++;
+		if( end - p >= 2 && p[0] == '=' && p[1] == '=' )
+			p += 2;
+		else
+			p = line;
+	}
+	if( end - p > 7 && strncmp(p, "ERROR: ", 7) == 0 ) {
+		sanitizerfound.errors++;
+		*result = EXIT_FAILURE;
+	} else if( (end - p > 15 && strncmp(p, "Direct leak of ", 15) == 0) ||
+			(end - p > 17 && strncmp(p, "Indirect leak of ", 17) == 0) ) {
+		bytes = strtoull(p + ((p[0] == 'D')?15:17), NULL, 10);
+		sanitizerfound.leaks++;
+		sanitizerfound.leakedbytes += bytes;
+		*result = EXIT_FAILURE;
+	} else if( memmem(line, len, ": runtime error: ", 17) != NULL ) {
+		sanitizerfound.errors++;
+		*result = EXIT_FAILURE;
 	}
+	return true;
+}
+
+/* point the sanitizers' log_path into a new sanitizer_dir,
+ * keeping the options already set */
+static bool setsanitizeroptions(void) {
+	const char *tmpdir, *old;
+	char *value;
+	int i, r;
+
+	tmpdir = getenv("TMPDIR");
+	if( tmpdir == NULL || tmpdir[0] == '\0' )
+		tmpdir = "/tmp";
+	if( asprintf(&sanitizer_dir, "%s/testtool-XXXXXX", tmpdir) < 0 ) {
+		sanitizer_dir = NULL;
+		fputs("Out of memory!\n", stderr);
+		return false;
+	}
+	if( mkdtemp(sanitizer_dir) == NULL ) {
+		fprintf(stderr, "%s: error creating directory for sanitizer reports: %s\n",
+				program_invocation_short_name,
+				strerror(errno));
+		free(sanitizer_dir);
+		sanitizer_dir = NULL;
+		return false;
+	}
+	for( i = 0 ; sanitizervariables[i] != NULL ; i++ ) {
+		old = getenv(sanitizervariables[i]);
+		/* later options override earlier ones */
+		if( old != NULL && old[0] != '\0' )
+			r = asprintf(&value, "%s:log_path=%s/report",
+					old, sanitizer_dir);
+		else
+			r = asprintf(&value, "log_path=%s/report",
+					sanitizer_dir);
+		if( r < 0 ) {
+			fputs("Out of memory!\n", stderr);
+			return false;
+		}
+		r = setenv(sanitizervariables[i], value, 1);
+		free(value);
+		if( r != 0 ) {
+			fprintf(stderr, "%s: error setting %s: %s\n",
+					program_invocation_short_name,
+					sanitizervariables[i], strerror(errno));
+			return false;
+		}
+	}
+	return true;
+}
+
+static void readsanitizerreport(int dir, const char *name, int *result) {
+	const char *data, *p, *q, *end;
+	struct stat st;
+	int fd;
+
+	fd = openat(dir, name, O_RDONLY|O_NOCTTY|O_CLOEXEC);
+	if( fd < 0 || fstat(fd, &st) != 0 ) {
+		fprintf(stderr, "%s: error reading sanitizer report %s/%s: %s\n",
+				program_invocation_short_name,
+				sanitizer_dir, name, strerror(errno));
+		if( fd >= 0 )
+			close(fd);
+		*result = EXIT_FAILURE;
+		return;
+	}
+	sanitizerfound.reports++;
+	if( st.st_size == 0 ) {
+		close(fd);
+		return;
+	}
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if( data == MAP_FAILED ) {
+		fprintf(stderr, "%s: error reading sanitizer report %s/%s: %s\n",
+				program_invocation_short_name,
+				sanitizer_dir, name, strerror(errno));
+		*result = EXIT_FAILURE;
+		return;
+	}
+	end = data + st.st_size;
+	for( p = data ; p < end ; p = q ) {
+		q = memchr(p, '\n', end - p);
+		q = (q == NULL)?end:q + 1;
+		if( sanitizerline(p, q - p, result) )
+			queueout(2, p, q - p);
+	}
+	flushout(2);
+	munmap((void*)data, st.st_size);
+}
+
+/* if check is true, read and check all reports and return false if
+ * there were errors, they are removed in any case */
+static bool sanitizerreports(bool check) {
+	struct dirent *e;
+	int result = EXIT_SUCCESS;
+	DIR *dir;
+
+	if( sanitizer_dir == NULL )
+		return !check;
+	memset(&sanitizerfound, 0, sizeof(sanitizerfound));
+	dir = opendir(sanitizer_dir);
+	if( dir == NULL ) {
+		fprintf(stderr, "%s: error reading %s: %s\n",
+				program_invocation_short_name,
+				sanitizer_dir, strerror(errno));
+		free(sanitizer_dir);
+		sanitizer_dir = NULL;
+		return false;
+	}
+	while( (e = readdir(dir)) != NULL ) {
+		if( e->d_name[0] == '.' )
+			continue;
+		if( check )
+			readsanitizerreport(dirfd(dir), e->d_name, &result);
+		(void)unlinkat(dirfd(dir), e->d_name, 0);
+	}
+	closedir(dir);
+	(void)rmdir(sanitizer_dir);
+	free(sanitizer_dir);
+	sanitizer_dir = NULL;
+	if( sanitizerfound.reports > 0 )
+		fprintf(stderr, "%s: sanitizer: %lu reports with %lu errors, %lu leaks of %llu bytes\n",
+				program_invocation_short_name,
+				sanitizerfound.reports, sanitizerfound.errors,
+				sanitizerfound.leaks, sanitizerfound.leakedbytes);
+	return result == EXIT_SUCCESS;
+}
+
+/* With --valgrind-xml the errors valgrind reports are collected and
+ * checked against the 'valgrind' rules when it is done. */
+enum { VR_ALLOW, VR_ALLOWBYTES, VR_SUPPRESS };
+struct vgrule {
+	int type;
+	/* "*" for all kinds */
+	char *kind;
+	/* for VR_SUPPRESS, a fnmatch(3) pattern for some frame */
+	char *function;
+	unsigned long long value;
+};
+static struct vgrule *vgrules = NULL;
+static size_t vgrulecount = 0;
+
+struct vgseen {
+	unsigned long long unique, count, bytes;
+	char *kind, *what, *location, *function;
+	uint64_t digest;
+	bool suppressed;
+};
+static struct vgseen *vgseen = NULL;
+static size_t vgseencount = 0, vgseensize = 0;
+static struct vgxml *vgparser = NULL;
+static bool vgbroken = false;
+
+static void freevgseen(void) {
+	size_t i;
+
+	for( i = 0 ; i < vgseencount ; i++ ) {
+		free(vgseen[i].kind);
+		free(vgseen[i].what);
+		free(vgseen[i].location);
+		free(vgseen[i].function);
+	}
+	free(vgseen);
+	vgseen = NULL;
+	vgseencount = vgseensize = 0;
+	vgxml_free(vgparser);
+	vgparser = NULL;
+}
+
+static inline bool vgkindmatches(const struct vgrule *r, const char *kind) {
+	return strcmp(r->kind, "*") == 0 || strcmp(r->kind, kind) == 0;
+}
+
+static void vgonerror(const struct vgerror *e, void *privdata) {
+	struct vgseen *n;
+	size_t i, j;
+
+	(void)privdata;
+	if( vgseencount >= vgseensize ) {
+		n = realloc(vgseen, (2*vgseensize + 16) * sizeof(struct vgseen));
+		if( n == NULL ) {
+			fputs("Out of memory!\n", stderr);
+			exit(TESTTOOL_ERROR_EXIT);
+		}
+		vgseen = n;
+		vgseensize = 2*vgseensize + 16;
+	}
+	n = &vgseen[vgseencount];
+	memset(n, 0, sizeof(*n));
+	n->unique = e->unique;
+	n->count = 1;
+	n->bytes = e->leakedbytes;
+	n->digest = e->digest;
+	n->kind = strdup(e->kind);
+	n->what = strdup(e->what);
+	n->location = strdup(e->location);
+	n->function = strdup((e->framecount > 0)?e->frames[0]:"?");
+	if( n->kind == NULL || n->what == NULL || n->location == NULL ||
+			n->function == NULL ) {
+		fputs("Out of memory!\n", stderr);
+		exit(TESTTOOL_ERROR_EXIT);
+	}
+	vgseencount++;
+	for( i = 0 ; i < vgrulecount && !n->suppressed ; i++ ) {
+		const struct vgrule *r = &vgrules[i];
+
+		if( r->type != VR_SUPPRESS || !vgkindmatches(r, e->kind) )
+			continue;
+		for( j = 0 ; j < e->framecount ; j++ ) {
+			if( fnmatch(r->function, e->frames[j], 0) == 0 ) {
+				n->suppressed = true;
+				break;
+			}
+		}
+	}
+}
+
+static void vgoncount(unsigned long long unique, unsigned long long count, void *privdata) {
+	size_t i;
+
+	(void)privdata;
+	/* leak errors are not counted there */
+	for( i = 0 ; i < vgseencount ; i++ ) {
+		if( vgseen[i].unique == unique &&
+				strncmp(vgseen[i].kind, "Leak_", 5) != 0 )
+			vgseen[i].count = count;
+	}
+}
 
+static bool readvgxml(int fd) {
+	char buffer[65536];
+	ssize_t got;
+
+	if( vgparser == NULL ) {
+		vgparser = vgxml_new(vgonerror, vgoncount, NULL);
+		if( vgparser == NULL ) {
+			fputs("Out of memory!\n", stderr);
+			exit(TESTTOOL_ERROR_EXIT);
+		}
+	}
+	got = read(fd, buffer, sizeof(buffer));
+	iostats.reads++;
+	if( got < 0 ) {
+		fprintf(stderr, "%s: Error reading from helper: %s\n",
+				program_invocation_short_name,
+				strerror(errno));
+		return true;
+	} else if( got == 0 )
+		return true;
+	iostats.bytes += got;
+	hotstats.controlbytes += got;
+	if( !vgxml_feed(vgparser, buffer, got) )
+		vgbroken = true;
 	return false;
 }
 
-struct linecheck {
-	struct linecheck *next;
-	char *line;
-	size_t found;
-	size_t len;
-	int varlimit;
+/* the most specific rule of that type for the kind, NULL if none */
+static const struct vgrule *vgfindrule(int type, const char *kind) {
+	const struct vgrule *found = NULL;
+	size_t i;
+
+	for( i = 0 ; i < vgrulecount ; i++ ) {
+		if( vgrules[i].type != type || !vgkindmatches(&vgrules[i], kind) )
+			continue;
+		if( found == NULL || strcmp(vgrules[i].kind, "*") != 0 )
+			found = &vgrules[i];
+	}
+	return found;
+}
+
+/* print what valgrind found, returns false if it is too much */
+static bool vgsummary(void) {
+	unsigned long long count, bytes, total = 0, suppressed = 0;
+	const struct vgrule *r;
+	bool ok = true, done;
+	size_t i, j;
+
+	if( vgparser == NULL || vgbroken || !vgxml_complete(vgparser) ) {
+		fprintf(stderr, "%s: %s XML output from valgrind\n",
+				program_invocation_short_name,
+				(vgparser == NULL)?"no":
+				vgbroken?"malformed":"incomplete");
+		freevgseen();
+		return false;
+	}
+	for( i = 0 ; i < vgseencount ; i++ ) {
+		const struct vgseen *e = &vgseen[i];
+
+		if( e->suppressed ) {
+			suppressed += e->count;
+			continue;
+		}
+		total += e->count;
+		fprintf(stderr, "%s: valgrind: %s x%llu in %s%s%s%s [%016llx]: %s\n",
+				program_invocation_short_name,
+				e->kind, e->count, e->function,
+				(e->location[0] != '\0')?" (":"",
+				e->location,
+				(e->location[0] != '\0')?")":"",
+				(unsigned long long)e->digest, e->what);
+	}
+	/* check every kind once */
+	for( i = 0 ; i < vgseencount ; i++ ) {
+		if( vgseen[i].suppressed )
+			continue;
+		done = false;
+		for( j = 0 ; j < i && !done ; j++ )
+			done = !vgseen[j].suppressed &&
+				strcmp(vgseen[j].kind, vgseen[i].kind) == 0;
+		if( done )
+			continue;
+		count = bytes = 0;
+		for( j = i ; j < vgseencount ; j++ ) {
+			if( vgseen[j].suppressed ||
+					strcmp(vgseen[j].kind, vgseen[i].kind) != 0 )
+				continue;
+			count += vgseen[j].count;
+			bytes += vgseen[j].bytes;
+		}
+		r = vgfindrule(VR_ALLOWBYTES, vgseen[i].kind);
+		if( r != NULL && bytes <= r->value )
+			continue;
+		r = vgfindrule(VR_ALLOW, vgseen[i].kind);
+		if( count <= ((r != NULL)?r->value:0) )
+			continue;
+		fprintf(stderr, "%s: valgrind: %llu errors of kind %s (%llu bytes), only %llu allowed\n",
+				program_invocation_short_name,
+				count, vgseen[i].kind, bytes,
+				(r != NULL)?r->value:0);
+		ok = false;
+	}
+	if( total > 0 || suppressed > 0 )
+		fprintf(stderr, "%s: valgrind: %llu errors, %llu suppressed\n",
+				program_invocation_short_name,
+				total, suppressed);
+	freevgseen();
+	return ok;
+}
+
+/* A compiled set of rules, as written by --compile-rules and either
+ * mmap'ed from there or built in memory after parsing the rules.
+ * All offsets are relative to the start of the image. */
+
+#define RULEIMAGE_MAGIC "TTRULES\0"
+#define RULEIMAGE_VERSION 8
+#define RULEIMAGE_BYTEORDER 0x01020304
+#define RULEIMAGE_SUFFIX ".compiled"
+
+/* the first four sections are exact lines found by hashing them,
+ * the next four patterns matched as a whole, the last the arguments
+ * of 'valgrind' rules */
+enum { RS_stderr_expect, RS_stderr_ignore, RS_stdout_expect, RS_stdout_ignore,
+	RS_stderr_expectpatterns, RS_stderr_ignorepatterns,
+	RS_stdout_expectpatterns, RS_stdout_ignorepatterns,
+	RS_valgrind,
+	/* at most one rule, the file for stdin */
+	RS_stdin,
+	RS_COUNT };
+#define RS_FIRSTPATTERNS RS_stderr_expectpatterns
+
+struct imagesection {
+	uint64_t rules;
+	uint64_t slots;
+	uint32_t count;
+	uint32_t mask;
+};
+
+struct imageheader {
+	char magic[8];
+	uint32_t version;
+	uint32_t byteorder;
+	uint64_t size;
+	/* the rules file this was compiled from */
+	uint64_t sourcesize;
+	int64_t sourcemtime;
+	int64_t sourcemtimensec;
+	/* -1 if not set by the rules */
+	int32_t returncode;
+	int8_t ignoreunknown[2];
+	/* signal for fail-fast mode, 0 if not set by the rules */
+	uint8_t failfast;
+	uint8_t pad;
+	/* budgets as in struct budget, 0 if not set */
+	uint64_t maxtime, maxcpu, maxrss;
+	/* microseconds, 0 if not set */
+	uint64_t timeout;
+	struct imagesection sections[RS_COUNT];
+};
+
+struct imagerule {
+	uint64_t hash;
+	/* offset of the '\0'-terminated text */
+	uint64_t text;
+	uint32_t len;
+	int32_t varlimit;
+	/* 1 + index of the next rule with the same text, 0 if none */
+	uint32_t same;
 	unsigned char variable;
+	/* 0 for exact lines, otherwise an enum patternkind */
+	unsigned char kind;
+	unsigned char pad[2];
+};
+
+/* one section of the image in use, the hash slots hold
+ * 1 + index of the first rule of each chain of identical lines.
+ * For expected lines they are specialized to the variables once
+ * those are known: a slot then holds the first rule whose condition
+ * holds, or is SLOT_INACTIVE if there is none for that line. */
+#define SLOT_INACTIVE 0x80000000U
+struct rulelist {
+	const struct imagerule *rules;
+	const uint32_t *slots;
+	uint32_t count, mask;
+	size_t *found;
+	/* for pattern sections: those in use, numbered like rules
+	 * or, if map is not NULL, like map which gives the rule */
+	struct patternset *patterns;
+	const uint32_t *map;
 };
 
+static const char *ruleimage = NULL;
+static size_t ruleimage_size = 0;
+static bool ruleimage_mapped = false;
+/* the found counters of all lists and the specialized slots and maps,
+ * in one allocation */
+static void *rulearena = NULL;
+/* 'valgrind' rules, only their text is used */
+static struct rulelist valgrindrules = {NULL, NULL, 0, 0, NULL, NULL, NULL};
+static struct rulelist stdinrules = {NULL, NULL, 0, 0, NULL, NULL, NULL};
+
 struct expectdata {
 	bool ignoreunknown;
-	struct linecheck *ignore;
-	struct linecheck *expect;
+	struct rulelist ignore, ignorepatterns;
+	struct rulelist expect, expectpatterns;
 	size_t overlong, unexpected, malformed;
-	char buffer[10000];
-	size_t len;
-	bool overrun;
-} errorexpect = { false, NULL, NULL, 0, 0, 0, "", 0, false},
-  outexpect = { true, NULL, NULL, 0, 0, 0, "", 0, false};
+	struct linebuffer data;
+} errorexpect = { false, {NULL, NULL, 0, 0, NULL, NULL, NULL}, {NULL, NULL, 0, 0, NULL, NULL, NULL}, {NULL, NULL, 0, 0, NULL, NULL, NULL}, {NULL, NULL, 0, 0, NULL, NULL, NULL}, 0, 0, 0, {NULL, 0, 0, 0, 0, false, {HASH_SEED, 0}}},
+  outexpect = { true, {NULL, NULL, 0, 0, NULL, NULL, NULL}, {NULL, NULL, 0, 0, NULL, NULL, NULL}, {NULL, NULL, 0, 0, NULL, NULL, NULL}, {NULL, NULL, 0, 0, NULL, NULL, NULL}, 0, 0, 0, {NULL, 0, 0, 0, 0, false, {HASH_SEED, 0}}};
+
+/* returns 1 + index of the first rule matching, 0 if none */
+static inline uint32_t lookup(const struct rulelist *l, const char *line, size_t len, uint64_t hash) {
+	const struct imagerule *r;
+	uint32_t i, n;
+
+	if( l->count == 0 )
+		return 0;
+	i = hash & l->mask;
+	while( (n = l->slots[i]) != 0 ) {
+		hotstats.probes++;
+		r = &l->rules[(n & ~SLOT_INACTIVE)-1];
+		if( r->len == len && r->hash == hash &&
+				memcmp(ruleimage + r->text, line, len) == 0 )
+			return ((n & SLOT_INACTIVE) != 0)?0:n;
+		i = (i + 1) & l->mask;
+	}
+	return 0;
+}
+
+/* the first failure in fail-fast mode */
+#define FAILFAST_SHOWN 4096
+static struct {
+	const char *what;
+	int fd;
+	char *line;
+} failfast_cause = { NULL, 0, NULL };
+
+static void failfast(const char *what, int fd, const char *line, size_t len) {
+	if( failfast_signal == 0 || failfast_cause.what != NULL )
+		return;
+	failfast_cause.what = what;
+	failfast_cause.fd = fd;
+	failfast_cause.line = strndup(line,
+			(len > FAILFAST_SHOWN)?FAILFAST_SHOWN:len);
+}
+
+/* returns 1 + index of the first rule matching, 0 if none */
+static uint32_t matchpatterns(const struct rulelist *l, const char *line, size_t len) {
+	const uint32_t *matches;
+	int count;
+
+	if( l->patterns == NULL )
+		return 0;
+	hotstats.patternmatches++;
+	count = patternset_match(l->patterns, line, len, &matches);
+	if( count < 0 ) {
+		fputs("Out of memory!\n", stderr);
+		exit(TESTTOOL_ERROR_EXIT);
+	}
+	if( count == 0 )
+		return 0;
+	return ((l->map != NULL)?l->map[matches[0]]:matches[0]) + 1;
+}
 
-static void checkline(char *line, size_t len, struct expectdata *expect, int outfd) {
+/* hash is linehash() of the line without its newline */
+static void checkline(char *line, size_t len, uint64_t hash, struct expectdata *expect, int outfd) {
 	bool print = false;;
-	struct linecheck *p;
+	uint32_t n;
 	size_t efflen = len;
 	if( len > 0 && line[len-1] == '\n' )
 		efflen--;
-	for( p = expect->expect; p != NULL ; p = p->next ) {
-		if( efflen == p->len && variables[p->variable] >= p->varlimit &&
-				        strncmp(p->line, line, efflen) == 0 ) {
-			p->found++;
-			break;
-		}
+	if( line_timing )
+		linetiming_line(outfd, &arrival, line, efflen);
+	if( elapsed_prefix && !silent )
+		queueelapsed(outfd);
+	n = lookup(&expect->expect, line, efflen, hash);
+	if( n != 0 )
+		expect->expect.found[n-1]++;
+	else {
+		n = matchpatterns(&expect->expectpatterns, line, efflen);
+		if( n != 0 )
+			expect->expectpatterns.found[n-1]++;
 	}
-	if( p != NULL ) {
+	streamstats[outfd].lines++;
+	if( n != 0 ) {
+		streamstats[outfd].expected++;
 		if( annotate && !silent )
-			dprintf(outfd, "EXPECTED(%d):", outfd);
+			queueannotation(outfd, AN_EXPECTED);
 	} else {
-		for( p = expect->ignore; p != NULL ; p = p->next ) {
-			if( efflen == p->len && 
-					strncmp(p->line, line, efflen) == 0 ) {
-				p->found++;
-				break;
-			}
+		n = lookup(&expect->ignore, line, efflen, hash);
+		if( n != 0 )
+			expect->ignore.found[n-1]++;
+		else {
+			n = matchpatterns(&expect->ignorepatterns,
+					line, efflen);
+			if( n != 0 )
+				expect->ignorepatterns.found[n-1]++;
 		}
-		if( p != NULL ) {
+		if( n != 0 ) {
+			streamstats[outfd].ignored++;
 			if( annotate && !silent )
-				dprintf(outfd, "IGNORED(%d):", outfd);
+				queueannotation(outfd, AN_IGNORED);
 		} else if( expect->ignoreunknown ) {
+			streamstats[outfd].normal++;
 			if( annotate && !silent )
-				dprintf(outfd, "NORMAL(%d):", outfd);
+				queueannotation(outfd, AN_NORMAL);
 		} else {
+			streamstats[outfd].unexpected++;
 			expect->unexpected += 1;
 			print = true;
+			if( !ignoreunexpected )
+				failfast("unexpected line", outfd, line, efflen);
+			if( elapsed_prefix && silent )
+				queueelapsed(outfd);
 			if( annotate )
-				dprintf(outfd, "UNEXPECTED(%d):", outfd);
-		}
-	}
-
-	if( outfd == 1 && outfile_fd >= 0 ) {
-		ssize_t written = write(outfile_fd, line, len);
-		if( written != (ssize_t)len ) {
-			fprintf(stderr,"%s: Error writing to %s: %s\n",
-				program_invocation_short_name,
-				outfile, strerror(errno));
-			exit(TESTTOOL_ERROR_EXIT);
+				queueannotation(outfd, AN_UNEXPECTED);
 		}
 	}
 
 	if( print || !silent ) {
-		write(outfd, line, len);
+		queueout(outfd, line, len);
 		if( line[len-1] != '\n' ) {
-			dprintf(outfd, "[UNTERMINATED/OVERLONG]\n");
+			queueannotation(outfd, AN_OVERLONG);
 		}
 	} else {
 		if( line[len-1] != '\n' ) {
-			dprintf(outfd, "UNTERMINATED/OVERLONG LINE(%d)\n",
-					outfd);
+			queueannotation(outfd, AN_UNTERMINATED);
 		}
 	}
 }
 
-static bool readlinedata(int fd, struct expectdata *expect, int outfd) {
+static void outfileerror(void) __attribute__ ((noreturn));
+static void outfileerror(void) {
+	fprintf(stderr,"%s: Error writing to %s: %s\n",
+		program_invocation_short_name,
+		outfile, strerror(errno));
+	/* nothing left to finish */
+	outfile_active = false;
+	exit(TESTTOOL_ERROR_EXIT);
+}
+
+/* wait for the writer thread, false if it failed */
+static bool finishoutfile(void) {
+	if( !outfile_active )
+		return true;
+	outfile_active = false;
+	if( outfile_close() )
+		return true;
+	fprintf(stderr,"%s: Error writing to %s: %s\n",
+		program_invocation_short_name,
+		outfile, strerror(errno));
+	return false;
+}
+
+/* so what was read is also in the outfile when exiting early */
+static void finishoutfileatexit(void) {
+	(void)finishoutfile();
+}
+
+/* like fillbuffer, but also copy everything into the outfile */
+static ssize_t fillcopy(int fd, struct linebuffer *lb) {
 	ssize_t got;
-	int i, linestart;
 
-	got = read(fd, expect->buffer+expect->len, sizeof(expect->buffer)-expect->len);
-	if( got == 0 ) { /* End of file */
-		if( expect->len > 0 ) {
+	got = fillbuffer(fd, lb);
+	if( got <= 0 )
+		return got;
+	if( !outfile_write(lb->data + lb->len, got) )
+		outfileerror();
+	outfile_written += got;
+	return got;
+}
+
+/* the end of the stream, an unterminated last line is checked as is */
+static void checkend(struct expectdata *expect, int outfd) {
+	struct linebuffer *lb = &expect->data;
+	char *line;
+
+	if( lb->len > lb->start ) {
+		expect->malformed++;
+		line = lb->data + lb->start;
+		failfast("unterminated last line", outfd, line,
+				lb->len - lb->start);
+		checkline(line, lb->len - lb->start,
+				linehash(line, lb->len - lb->start),
+				expect, outfd);
+		flushout(outfd);
+	}
+}
+
+/* got new bytes at the end of the buffer, check the lines completed */
+static void checkchunk(struct expectdata *expect, int outfd, size_t got) {
+	struct linebuffer *lb = &expect->data;
+	struct scanstate *st = &lb->scan;
+	struct timespec before, after;
+	size_t linestart;
+	char *line, *q, *end, *limit;
+
+	if( print_stats )
+		clock_gettime(CLOCK_MONOTONIC, &before);
+	linestart = lb->start;
+	end = lb->data + lb->len + got;
+	while( true ) {
+		line = lb->data + linestart;
+		limit = ((size_t)(end - line) > linelimit)?line+linelimit:end;
+		q = (char*)scanline(line, limit, st);
+		if( q == limit ) {
+			if( (size_t)(limit - line) < linelimit )
+				break;
+			lb->overrun = true;
+			expect->overlong++;
+			failfast("overlong line", outfd, line, linelimit);
+			checkline(line, linelimit, linehash(line, linelimit),
+					expect, outfd);
+			linestart += linelimit;
+			scanstate_reset(st);
+			continue;
+		}
+		if( *q == '\0' ) {
+			/* continue with the same line */
 			expect->malformed++;
-			checkline(expect->buffer, expect->len, expect, outfd);
+			failfast("line with NUL byte", outfd, line, q - line);
+			*q = '0';
+			continue;
 		}
+		if( ! lb->overrun )
+			checkline(line, q-line+1,
+					scanstate_hash(st, line, q-line),
+					expect, outfd);
+		lb->overrun = false;
+		linestart = q + 1 - lb->data;
+		scanstate_reset(st);
+	}
+	lb->len += got;
+	if( print_stats ) {
+		clock_gettime(CLOCK_MONOTONIC, &after);
+		hotstats.checking += elapsed(&before, &after);
+	}
+	flushout(outfd);
+	dropconsumed(lb, linestart);
+}
+
+static bool readlinedata(int fd, struct expectdata *expect, int outfd) {
+	ssize_t got;
+
+	if( outfd == 1 && outfile_active )
+		got = fillcopy(fd, &expect->data);
+	else
+		got = fillbuffer(fd, &expect->data);
+	streamstats[outfd].reads++;
+	if( got > 0 )
+		streamstats[outfd].bytes += got;
+	if( got == 0 ) { /* End of file */
+		checkend(expect, outfd);
 		return true;
 	}
+	if( print_timing && !timing.output && got > 0 ) {
+		clock_gettime(CLOCK_MONOTONIC, &timing.firstoutput);
+		timing.output = true;
+	}
+	if( (line_timing || elapsed_prefix) && got > 0 )
+		clock_gettime(CLOCK_MONOTONIC, &arrival);
 	if( got < 0 ) {
 		fprintf(stderr, "%s: Error reading data: %s\n",
 				program_invocation_short_name,
 				strerror(errno));
 		return true;
 	}
-	linestart = 0;
-	for( i = expect->len ; i < (int)(expect->len+got) ; i++ ) {
-		if( expect->buffer[i] == '\n' ) {
-			if( ! expect->overrun )
-				checkline(expect->buffer+linestart, i-linestart+1,
-						expect, outfd);
-			expect->overrun = false;
-			linestart = i+1;
-		}
-		if( expect->buffer[i] == '\0' ) {
-			expect->malformed++;
-			expect->buffer[i] = '0';
+	checkchunk(expect, outfd, got);
+	return false;
+}
+
+/* copy to the end of the line buffer, checked unless only keeping */
+static void appendbuffer(struct expectdata *expect, int outfd, const char *data, size_t len, bool check) {
+	struct linebuffer *lb = &expect->data;
+	size_t n;
+
+	if( lb->readsize < len )
+		lb->readsize = len;
+	while( len > 0 ) {
+		if( !preparebuffer(lb) || lb->size == lb->len ) {
+			fputs("Out of memory!\n", stderr);
+			exit(TESTTOOL_ERROR_EXIT);
 		}
+		n = lb->size - lb->len;
+		if( n > len )
+			n = len;
+		memcpy(lb->data + lb->len, data, n);
+		if( check )
+			checkchunk(expect, outfd, n);
+		else
+			lb->len += n;
+		data += n;
+		len -= n;
 	}
-	expect->len += got;
-	if( linestart == 0 && expect->len == sizeof(expect->buffer) ) {
-		expect->overrun = true;
-		expect->overlong++;
-		checkline(expect->buffer, expect->len, expect, outfd);
-		expect->len = 0;
-	} else if( linestart == (int)expect->len )
-		expect->len = 0;
-	else {
-		expect->len -= linestart;
-		memmove(expect->buffer, expect->buffer+linestart, expect->len);
-	}
+}
+
+/* like readlinedata, but with what the reader thread read. The lines
+ * are checked where they are in the chunk, only a line not complete
+ * at either end of it goes through the line buffer */
+static bool takechunk(struct chunk *c) {
+	struct expectdata *expect = (c->stream == 1)?&outexpect:&errorexpect;
+	struct linebuffer *lb = &expect->data;
+	char *data = c->data, *buffer, *brk;
+	size_t left = c->len, size, n;
 
+	/* the read itself was counted by the reader thread */
+	streamstats[c->stream].reads++;
+	if( c->len == 0 ) {
+		if( c->error != 0 )
+			fprintf(stderr, "%s: Error reading data: %s\n",
+					program_invocation_short_name,
+					strerror(c->error));
+		else
+			checkend(expect, c->stream);
+		return true;
+	}
+	streamstats[c->stream].bytes += c->len;
+	iostats.bytes += c->len;
+	arrival = c->read;
+	if( print_timing && !timing.output ) {
+		timing.firstoutput = c->read;
+		timing.output = true;
+	}
+	if( c->stream == 1 && outfile_active ) {
+		if( !outfile_write(data, left) )
+			outfileerror();
+		outfile_written += left;
+	}
+	/* complete the line an earlier chunk ended in */
+	while( left > 0 && lb->len > lb->start ) {
+		brk = (char*)findbreak(data, data + left);
+		n = (brk < data + left)?(size_t)(brk - data) + 1:left;
+		appendbuffer(expect, c->stream, data, n, true);
+		data += n;
+		left -= n;
+	}
+	if( left == 0 )
+		return false;
+	/* the buffer is empty now, so check the rest in place */
+	buffer = lb->data;
+	size = lb->size;
+	lb->data = data;
+	lb->size = left;
+	lb->start = lb->len = 0;
+	checkchunk(expect, c->stream, left);
+	data = lb->data + lb->start;
+	n = lb->len - lb->start;
+	lb->data = buffer;
+	lb->size = size;
+	lb->start = lb->len = 0;
+	/* already scanned as far as lb->scan says */
+	appendbuffer(expect, c->stream, data, n, false);
 	return false;
 }
 
-static int start(const char **arguments) {
-	pid_t child,w;
-	int status;
-	int result = EXIT_SUCCESS;
-	int ofds[2];
-	int efds[2];
+/* watched counts the fds whose end we wait for, may be NULL */
+static bool watchfd(int ep, int fd, int *watched) {
+	struct epoll_event ev;
+
+	if( fd <= 0 )
+		return true;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	if( epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev) != 0 )
+		return false;
+	if( watched != NULL )
+		(*watched)++;
+	return true;
+}
+
+static void unwatchfd(int ep, int fd, int *watched) {
+	(void)epoll_ctl(ep, EPOLL_CTL_DEL, fd, NULL);
+	close(fd);
+	(*watched)--;
+}
+
+static void printtiming(void) {
+	char firstoutput[32] = "none";
+
+	if( timing.output )
+		snprintf(firstoutput, sizeof(firstoutput), "%.6f",
+				elapsed(&timing.spawn, &timing.firstoutput));
+	fprintf(stderr, "%s: timing: spawn=%.6f first-output=%s exit=%.6f\n",
+			program_invocation_short_name,
+			elapsed(&timing.spawn, &timing.started),
+			firstoutput,
+			elapsed(&timing.spawn, &timing.exited));
+}
+
+static double cputime(const struct rusage *u) {
+	return u->ru_utime.tv_sec + u->ru_utime.tv_usec / 1e6 +
+		u->ru_stime.tv_sec + u->ru_stime.tv_usec / 1e6;
+}
+
+static void printrusage(void) {
+	const struct rusage *u = &childusage;
+
+	fprintf(stderr, "%s: rusage: wall=%.6f user=%.6f sys=%.6f"
+			" maxrss_kb=%ld minflt=%ld majflt=%ld"
+			" nvcsw=%ld nivcsw=%ld\n",
+			program_invocation_short_name,
+			elapsed(&timing.spawn, &timing.exited),
+			u->ru_utime.tv_sec + u->ru_utime.tv_usec / 1e6,
+			u->ru_stime.tv_sec + u->ru_stime.tv_usec / 1e6,
+			u->ru_maxrss, u->ru_minflt, u->ru_majflt,
+			u->ru_nvcsw, u->ru_nivcsw);
+}
+
+/* returns false if the program used more than the rules allow */
+static bool checkbudget(void) {
+	double wall = elapsed(&timing.spawn, &timing.exited);
+	double cpu = cputime(&childusage);
+	uint64_t rss = (uint64_t)childusage.ru_maxrss * 1024;
+	bool ok = true;
+
+	if( budget.time != 0 && wall * 1e6 > budget.time ) {
+		fprintf(stderr, "%s: took %.3f seconds, more than maxtime %.3f\n",
+				program_invocation_short_name,
+				wall, budget.time / 1e6);
+		ok = false;
+	}
+	if( budget.cpu != 0 && cpu * 1e6 > budget.cpu ) {
+		fprintf(stderr, "%s: used %.3f seconds of CPU time, more than maxcpu %.3f\n",
+				program_invocation_short_name,
+				cpu, budget.cpu / 1e6);
+		ok = false;
+	}
+	if( budget.rss != 0 && rss > budget.rss ) {
+		fprintf(stderr, "%s: used %llu bytes of memory, more than maxrss %llu\n",
+				program_invocation_short_name,
+				(unsigned long long)rss,
+				(unsigned long long)budget.rss);
+		ok = false;
+	}
+	return ok;
+}
+
+/* The keys and their order are kept stable for scripts to parse:
+ * bytes reads writes waits stdin_splices syscalls/MB are the system
+ * calls (with those of the reader thread, if there was one; splices
+ * only happen for --stdin),
+ * then for stdout_ and stderr_: bytes reads lines expected ignored
+ * normal unexpected, then probes patternmatches probes/line
+ * check_seconds wait_seconds outfile_bytes control_bytes control_lines
+ * outfile_waits (times the outfile's writer thread fell behind)
+ * stdin_bytes (fed from --stdin through a pipe) reader_stalls (times
+ * the reader thread waited for the checking to catch up, as more than
+ * --queue-limit was read but not checked yet) */
+static void printstats(void) {
+	double mb = iostats.bytes / (1024.0*1024.0);
+	/* all together */
+	struct readeriostats reader;
+	unsigned long long lines;
+	int i;
+
+	reader_iostats(&reader);
+	reader.reads += iostats.reads;
+	reader.writes += iostats.writes;
+	reader.waits += iostats.waits;
+	fprintf(stderr, "%s: stats: bytes=%llu reads=%lu writes=%lu waits=%lu"
+			" stdin_splices=%lu syscalls/MB=%.1f",
+			program_invocation_short_name,
+			iostats.bytes, reader.reads, reader.writes,
+			reader.waits, iostats.stdin_splices,
+			(mb > 0)?(reader.reads+reader.writes+reader.waits
+				+iostats.stdin_splices)/mb:0.0);
+	for( i = 1 ; i <= 2 ; i++ ) {
+		const char *name = (i == 1)?"stdout":"stderr";
+
+		fprintf(stderr, " %s_bytes=%llu %s_reads=%llu %s_lines=%llu"
+				" %s_expected=%llu %s_ignored=%llu"
+				" %s_normal=%llu %s_unexpected=%llu",
+				name, streamstats[i].bytes,
+				name, streamstats[i].reads,
+				name, streamstats[i].lines,
+				name, streamstats[i].expected,
+				name, streamstats[i].ignored,
+				name, streamstats[i].normal,
+				name, streamstats[i].unexpected);
+	}
+	lines = streamstats[1].lines + streamstats[2].lines;
+	fprintf(stderr, " probes=%llu patternmatches=%llu probes/line=%.2f"
+			" check_seconds=%.6f wait_seconds=%.6f"
+			" outfile_bytes=%llu control_bytes=%llu"
+			" control_lines=%llu outfile_waits=%lu stdin_bytes=%llu"
+			" reader_stalls=%lu\n",
+			hotstats.probes, hotstats.patternmatches,
+			(lines > 0)?(double)hotstats.probes / lines:0.0,
+			hotstats.checking, hotstats.waiting,
+			outfile_written, hotstats.controlbytes,
+			hotstats.controllines, outfile_waits(),
+			streamstats[0].bytes, reader_stalls());
+}
+
+/* returns true if some expected line of l was not found */
+static bool reportmissed(const struct rulelist *l, int fd) {
+	bool missed = false;
+	uint32_t i;
+
+	for( i = 0 ; i < l->count ; i++ ) {
+		const struct imagerule *r = &l->rules[i];
+
+		if( l->found[i] <= 0 && variables[r->variable] >= r->varlimit ) {
+			fprintf(stderr, "%s: missed expected line(%d): %s\n",
+				program_invocation_short_name, fd,
+				ruleimage + r->text);
+			missed = true;
+		}
+	}
+	return missed;
+}
+
+#define SPAWN_STACK (256*1024)
+
+struct spawnargs {
+	const char **arguments;
+	const int *ofds, *efds, *cfds;
+	/* to become stdin, -1 to keep ours */
+	int ifd;
+	int commandfd;
+	int errorfd;
+	sigset_t mask;
+};
+
+/* what the child writes into the error pipe if it cannot exec */
+struct spawnerror {
+	const char *what;
+	int error;
+};
+
+static void spawnfailed(const struct spawnargs *a, const char *what) __attribute__ ((noreturn));
+static void spawnfailed(const struct spawnargs *a, const char *what) {
+	struct spawnerror err = { what, errno };
+	ssize_t w;
+
+	w = write(a->errorfd, &err, sizeof(err));
+	(void)w;
+	_exit(127);
+}
+
+/* so everything it starts can be killed at once */
+static inline bool ownprocessgroup(void) {
+	return failfast_signal != 0 || timeout != 0 || server_connection >= 0;
+}
+
+/* The program's own process group no longer gets the terminal's
+ * SIGINT and the like, so what kills us is passed on to it */
+static const int forwardedsignals[] = { SIGINT, SIGTERM, SIGHUP, SIGQUIT };
+#define FORWARDED (sizeof(forwardedsignals)/sizeof(forwardedsignals[0]))
+static volatile sig_atomic_t forwardgroup = 0;
+static struct sigaction forwardedactions[FORWARDED];
+
+static void forwardsignal(int sig) {
+	struct sigaction dfl;
+
+	if( forwardgroup > 0 )
+		(void)kill(-(pid_t)forwardgroup, sig);
+	/* and die of it as without the handler */
+	memset(&dfl, 0, sizeof(dfl));
+	dfl.sa_handler = SIG_DFL;
+	(void)sigaction(sig, &dfl, NULL);
+	(void)raise(sig);
+}
+
+/* exiting early (out of memory, ...) while it still runs */
+static void killgroupatexit(void) {
+	if( forwardgroup > 0 )
+		(void)kill(-(pid_t)forwardgroup, SIGTERM);
+}
+
+static void startforwarding(void) {
+	static bool registered = false;
+	struct sigaction sa;
+	size_t i;
+
+	if( !registered && atexit(killgroupatexit) == 0 )
+		registered = true;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = forwardsignal;
+	sigfillset(&sa.sa_mask);
+	for( i = 0 ; i < FORWARDED ; i++ )
+		(void)sigaction(forwardedsignals[i], &sa,
+				&forwardedactions[i]);
+}
+
+static void stopforwarding(void) {
+	size_t i;
+
+	forwardgroup = 0;
+	for( i = 0 ; i < FORWARDED ; i++ )
+		(void)sigaction(forwardedsignals[i], &forwardedactions[i],
+				NULL);
+}
+
+/* runs in the memory of the (suspended) parent until the exec,
+ * so must not change anything but its file descriptors */
+static int spawnchild(void *data) {
+	const struct spawnargs *a = data;
+	int i;
+
+	if( ownprocessgroup() )
+		(void)setpgid(0, 0);
+	if( a->cfds[0] > 0 )
+		close(a->cfds[0]);
+	close(a->ofds[0]);
+	close(a->efds[0]);
+	if( a->ifd > 0 ) {
+		if( dup2(a->ifd, 0) == -1 )
+			spawnfailed(a, "error dup'ing stdin");
+		close(a->ifd);
+	}
+	if( a->ofds[1] >= 0 && a->ofds[1] != 1 ) {
+		if( dup2(a->ofds[1], 1) == -1 )
+			spawnfailed(a, "error dup'ing pipe");
+		close(a->ofds[1]);
+	}
+	if( a->efds[1] >= 0 && a->efds[1] != 2 ) {
+		if( dup2(a->efds[1], 2) == -1 )
+			spawnfailed(a, "error dup'ing pipe");
+		close(a->efds[1]);
+	}
+	if( a->cfds[1] >= 0 && a->cfds[1] != a->commandfd ) {
+		if( dup2(a->cfds[1], a->commandfd) == -1 )
+			spawnfailed(a, "error dup'ing pipe");
+		close(a->cfds[1]);
+	}
+	/* only now, as they might prevent the above */
+	for( i = 0 ; limitnames[i].name != NULL ; i++ ) {
+		struct rlimit rl;
+
+		if( !limits[i].set )
+			continue;
+		rl.rlim_cur = rl.rlim_max = limits[i].value;
+		/* get SIGXCPU before being killed */
+		if( i == LIMIT_CPU )
+			rl.rlim_max++;
+		if( setrlimit(limitnames[i].resource, &rl) != 0 )
+			spawnfailed(a, "error setting limit");
+	}
+	sigprocmask(SIG_SETMASK, &a->mask, NULL);
+	execvp(a->arguments[0], (char**)a->arguments);
+	spawnfailed(a, NULL);
+}
+
+/* start the program without copying our page tables,
+ * returns -1 after reporting it if that is not possible */
+static pid_t spawn(const char **arguments, const int *ofds, const int *efds, const int *cfds, int ifd) {
+	struct spawnargs a;
+	struct spawnerror err;
+	sigset_t all;
+	int errorpipe[2], fd, e;
+	char *stack;
+	pid_t child;
+	ssize_t got;
+
+	if( pipe2(errorpipe, O_CLOEXEC) != 0 ) {
+		fprintf(stderr, "%s: error creating pipe: %s\n",
+				program_invocation_short_name,
+				strerror(errno));
+		return -1;
+	}
+	a.arguments = arguments;
+	a.ofds = ofds;
+	a.efds = efds;
+	a.cfds = cfds;
+	a.ifd = ifd;
+	a.commandfd = rules_fd();
+	/* it must not be overwritten by the redirections */
+	if( errorpipe[1] <= a.commandfd ) {
+		fd = fcntl(errorpipe[1], F_DUPFD_CLOEXEC, a.commandfd + 1);
+		close(errorpipe[1]);
+		errorpipe[1] = fd;
+	}
+	stack = mmap(NULL, SPAWN_STACK, PROT_READ|PROT_WRITE,
+			MAP_PRIVATE|MAP_ANONYMOUS|MAP_STACK, -1, 0);
+	if( errorpipe[1] < 0 || stack == MAP_FAILED ) {
+		fprintf(stderr, "%s: error preparing to start program: %s\n",
+				program_invocation_short_name,
+				strerror(errno));
+		if( stack != MAP_FAILED )
+			munmap(stack, SPAWN_STACK);
+		if( errorpipe[1] >= 0 )
+			close(errorpipe[1]);
+		close(errorpipe[0]);
+		return -1;
+	}
+	a.errorfd = errorpipe[1];
+	/* no handler may run in the child while it shares our memory */
+	sigfillset(&all);
+	sigprocmask(SIG_BLOCK, &all, &a.mask);
+	clock_gettime(CLOCK_MONOTONIC, &timing.spawn);
+	child = clone(spawnchild, stack + SPAWN_STACK,
+			CLONE_VM|CLONE_VFORK|SIGCHLD, &a);
+	e = errno;
+	clock_gettime(CLOCK_MONOTONIC, &timing.started);
+	/* before anything pending is delivered */
+	if( child > 0 && ownprocessgroup() )
+		forwardgroup = child;
+	sigprocmask(SIG_SETMASK, &a.mask, NULL);
+	munmap(stack, SPAWN_STACK);
+	close(errorpipe[1]);
+	if( child < 0 ) {
+		fprintf(stderr, "%s: error forking: %s\n",
+				program_invocation_short_name,
+				strerror(e));
+		close(errorpipe[0]);
+		return -1;
+	}
+	/* nothing to read if the exec succeeded */
+	do {
+		got = read(errorpipe[0], &err, sizeof(err));
+	} while( got < 0 && errno == EINTR );
+	close(errorpipe[0]);
+	if( got == sizeof(err) ) {
+		if( err.what != NULL )
+			fprintf(stderr, "%s: Could not start %s: %s: %s\n",
+					program_invocation_short_name,
+					arguments[0], err.what,
+					strerror(err.error));
+		else
+			fprintf(stderr, "%s: Could not start %s: %s\n",
+					program_invocation_short_name,
+					arguments[0], strerror(err.error));
+		(void)waitpid(child, NULL, 0);
+		return -1;
+	}
+	return child;
+}
+
+/* the program is in its own process group if it may be killed */
+static void killprogram(pid_t child, int sig) {
+	if( kill(-child, sig) != 0 )
+		(void)kill(child, sig);
+}
+
+static bool armtimer(int tfd, uint64_t us) {
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = us / 1000000;
+	its.it_value.tv_nsec = (us % 1000000) * 1000;
+	return timerfd_settime(tfd, 0, &its, NULL) == 0;
+}
+
+/* name the limit the program was stopped by, if it can be known */
+static void reportlimits(int status) {
+	bool failed;
+
+	if( WIFSIGNALED(status) && WTERMSIG(status) == SIGXCPU &&
+			limits[LIMIT_CPU].set )
+		fprintf(stderr, "%s: Program hit the CPU time limit of %llu seconds\n",
+				program_invocation_short_name,
+				(unsigned long long)limits[LIMIT_CPU].value);
+	if( WIFSIGNALED(status) && WTERMSIG(status) == SIGXFSZ &&
+			limits[LIMIT_FSIZE].set )
+		fprintf(stderr, "%s: Program hit the file size limit of %llu bytes\n",
+				program_invocation_short_name,
+				(unsigned long long)limits[LIMIT_FSIZE].value);
+	/* shells report children killed by a signal like this */
+	if( WIFEXITED(status) && WEXITSTATUS(status) == 128 + SIGXCPU &&
+			limits[LIMIT_CPU].set )
+		fprintf(stderr, "%s: Some child of the program probably hit the CPU time limit of %llu seconds\n",
+				program_invocation_short_name,
+				(unsigned long long)limits[LIMIT_CPU].value);
+	if( WIFEXITED(status) && WEXITSTATUS(status) == 128 + SIGXFSZ &&
+			limits[LIMIT_FSIZE].set )
+		fprintf(stderr, "%s: Some child of the program probably hit the file size limit of %llu bytes\n",
+				program_invocation_short_name,
+				(unsigned long long)limits[LIMIT_FSIZE].value);
+	/* those only make calls fail, so only give a hint */
+	failed = WIFSIGNALED(status) || (WIFEXITED(status) &&
+			WEXITSTATUS(status) != expected_returncode);
+	if( failed && limits[LIMIT_AS].set )
+		fprintf(stderr, "%s: Program failed with its address space limited to %llu bytes\n",
+				program_invocation_short_name,
+				(unsigned long long)limits[LIMIT_AS].value);
+	if( failed && limits[LIMIT_NOFILE].set )
+		fprintf(stderr, "%s: Program failed with its open files limited to %llu\n",
+				program_invocation_short_name,
+				(unsigned long long)limits[LIMIT_NOFILE].value);
+}
+
+/* stop the program after the first failure in fail-fast mode */
+static int killfailed(pid_t child, const char *program, int cfd, int efd, int ofd) {
+	pid_t w;
+	int status;
+
+	fprintf(stderr, "%s: %s in %s: %s\n",
+			program_invocation_short_name,
+			failfast_cause.what,
+			(failfast_cause.fd == 1)?"stdout":"stderr",
+			(failfast_cause.line != NULL)?failfast_cause.line:"");
+	free(failfast_cause.line);
+	failfast_cause.line = NULL;
+	killprogram(child, failfast_signal);
+	/* whatever does not die of the signal gets EPIPE */
+	if( cfd > 0 )
+		close(cfd);
+	if( efd > 0 )
+		close(efd);
+	if( ofd > 0 )
+		close(ofd);
+	w = wait4(child, &status, 0, &childusage);
+	clock_gettime(CLOCK_MONOTONIC, &timing.exited);
+	if( w == child && WIFSIGNALED(status)
+			&& WTERMSIG(status) != failfast_signal )
+		fprintf(stderr, "%s: Program %s killed by signal %d\n",
+				program_invocation_short_name,
+				program, (int)(WTERMSIG(status)));
+	fprintf(stderr, "%s: stopped %s early because of --fail-fast\n",
+			program_invocation_short_name, program);
+	return TESTTOOL_FAILFAST_EXIT;
+}
+
+/* --stdin or the stdin rule: childin is to become the program's
+ * stdin, if feed is not -1 it is a pipe to splice input into */
+static bool openinput(int *input, int *feed, int *childin) {
+	const char *name = (stdin_file != NULL)?stdin_file:rules_stdin;
+	struct stat st;
+	int fds[2];
+
+	*input = *feed = *childin = -1;
+	if( name == NULL )
+		return true;
+	*input = open(name, O_RDONLY|O_NOCTTY|O_CLOEXEC);
+	if( *input < 0 || fstat(*input, &st) != 0 ) {
+		fprintf(stderr, "%s: Cannot open %s: %s\n",
+				program_invocation_short_name,
+				name, strerror(errno));
+		if( *input >= 0 )
+			close(*input);
+		return false;
+	}
+	/* nothing to copy, the program can seek or mmap it itself */
+	if( stdin_direct && S_ISREG(st.st_mode) ) {
+		*childin = *input;
+		*input = -1;
+		return true;
+	}
+	if( pipe2(fds, O_CLOEXEC) != 0 ) {
+		fprintf(stderr, "%s: error creating pipe: %s\n",
+				program_invocation_short_name,
+				strerror(errno));
+		close(*input);
+		return false;
+	}
+	(void)fcntl(fds[1], F_SETPIPE_SZ, PIPE_CAPACITY);
+	(void)fcntl(fds[1], F_SETFL, O_NONBLOCK);
+	/* a fifo or other generator might not have data all the time */
+	if( !S_ISREG(st.st_mode) )
+		(void)fcntl(*input, F_SETFL, O_NONBLOCK);
+	*childin = fds[0];
+	*feed = fds[1];
+	return true;
+}
+
+/* edge triggered, as the pipe is writable most of the time while the
+ * input might have nothing, a regular file is always readable */
+static bool watchinput(int ep, int input, int feed) {
+	struct epoll_event ev;
+	struct stat st;
+
+	if( feed < 0 )
+		return true;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLOUT|EPOLLET;
+	ev.data.fd = feed;
+	if( epoll_ctl(ep, EPOLL_CTL_ADD, feed, &ev) != 0 )
+		return false;
+	if( fstat(input, &st) != 0 || S_ISREG(st.st_mode) )
+		return true;
+	ev.events = EPOLLIN|EPOLLET;
+	ev.data.fd = input;
+	return epoll_ctl(ep, EPOLL_CTL_ADD, input, &ev) == 0;
+}
+
+static void stopinput(int ep, int *input, int *feed) {
+	if( *feed < 0 )
+		return;
+	(void)epoll_ctl(ep, EPOLL_CTL_DEL, *feed, NULL);
+	(void)epoll_ctl(ep, EPOLL_CTL_DEL, *input, NULL);
+	close(*feed);
+	close(*input);
+	*feed = *input = -1;
+}
+
+/* move as much as possible (for the edge triggering) from input into
+ * the program's stdin, true if done */
+static bool feedinput(int input, int feed) {
+	ssize_t moved;
+
+	while( true ) {
+		moved = splice(input, NULL, feed, NULL, PIPE_CAPACITY,
+				SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+		iostats.stdin_splices++;
+		if( moved > 0 ) {
+			streamstats[0].bytes += moved;
+			continue;
+		}
+		if( moved == 0 )
+			return true;
+		if( errno == EINTR )
+			continue;
+		if( errno == EAGAIN )
+			return false;
+		/* the program closed its stdin */
+		if( errno == EPIPE )
+			return true;
+		fprintf(stderr, "%s: Error feeding stdin: %s\n",
+				program_invocation_short_name,
+				strerror(errno));
+		return true;
+	}
+}
+
+static int start(const char **arguments) {
+	pid_t child,w;
+	int status;
+	int result = EXIT_SUCCESS;
+	int ofds[2];
+	int efds[2];
 	int cfds[2] = {-1, -1};
-	int e;
-	struct linecheck *p;
+	int e, ep, watched = 0;
+	/* 1: TERM sent, 2: KILL sent, 3: given up waiting,
+	 * also used to stop the program if a --server client went away */
+	int tfd = -1, timeoutstage = 0;
+	bool clientgone = false, needtimer;
+	/* the program's stdin, fed from input through feed */
+	int input, feed, childin;
+	struct sigaction ignore, oldpipe;
+	bool pipeignored = false, pipelined;
 
+	if( use_sanitizer && !setsanitizeroptions() )
+		return TESTTOOL_ERROR_EXIT;
 	if( pipe(ofds) != 0 ) {
 		fprintf(stderr, "%s: error creating pipe: %s\n",
 				program_invocation_short_name,
@@ -346,6 +1996,10 @@ static int start(const char **arguments) {
 				strerror(errno));
 		return TESTTOOL_ERROR_EXIT;
 	}
+	/* fewer wakeups if the child can write more at once,
+	 * not being allowed to is no problem */
+	(void)fcntl(ofds[0], F_SETPIPE_SZ, PIPE_CAPACITY);
+	(void)fcntl(efds[0], F_SETPIPE_SZ, PIPE_CAPACITY);
 	if( use_debugger && (debugger == NULL || command_fd >= 0) ) {
 		if( pipe(cfds) != 0 ) {
 			fprintf(stderr, "%s: error creating pipe: %s\n",
@@ -363,53 +2017,70 @@ static int start(const char **arguments) {
 		}
 	}
 
-	child = fork();
-	if( child == 0 ) {
-		/*if( outfile_fd >= 0 )
-			close(outfile_fd);*/
+	if( !openinput(&input, &feed, &childin) ) {
 		if( cfds[0] > 0 )
 			close(cfds[0]);
-		close(ofds[0]);
+		close(cfds[1]);
 		close(efds[0]);
-		if( ofds[1] >= 0 && ofds[1] != 1 ) {
-			if( dup2(ofds[1],1) == -1 ) {
-				perror("TESTTOOL: error dup'ing pipe: ");
-				raise(SIGUSR2);
-				exit(EXIT_FAILURE);
-			}
-			close(ofds[1]);
-		}
-		if( efds[1] >= 0 && efds[1] != 2 ) {
-			if( dup2(efds[1],2) == -1 ) {
-				perror("TESTTOOL: error dup'ing pipe: ");
-				raise(SIGUSR2);
-				exit(EXIT_FAILURE);
-			}
-			close(efds[1]);
-		}
-		if( command_fd < 0 )
-			command_fd = 3;
-		if( cfds[1] >= 0 && cfds[1] != command_fd ) {
-			if( dup2(cfds[1],command_fd) == -1 ) {
-				perror("TESTTOOL: error dup'ing pipe: ");
-				raise(SIGUSR2);
-				exit(EXIT_FAILURE);
-			}
-			close(cfds[1]);
-		}
-		execvp(arguments[0],(char**)arguments);
-		perror("TESTTOOL: error starting program: ");
-		raise(SIGUSR2);
-		exit(EXIT_FAILURE);
+		close(efds[1]);
+		close(ofds[0]);
+		close(ofds[1]);
+		return TESTTOOL_ERROR_EXIT;
 	}
-	e = errno;
+	child = spawn(arguments, ofds, efds, cfds, childin);
+	if( childin >= 0 )
+		close(childin);
 	close(cfds[1]);
 	close(efds[1]);
 	close(ofds[1]);
 	if( child < 0 ) {
-		fprintf(stderr, "%s: error forking: %s\n",
+		if( cfds[0] > 0 )
+			close(cfds[0]);
+		close(efds[0]);
+		close(ofds[0]);
+		if( feed >= 0 ) {
+			close(feed);
+			close(input);
+		}
+		return TESTTOOL_ERROR_EXIT;
+	}
+	/* a program not reading all its input is not our problem */
+	if( feed >= 0 ) {
+		memset(&ignore, 0, sizeof(ignore));
+		ignore.sa_handler = SIG_IGN;
+		pipeignored = sigaction(SIGPIPE, &ignore, &oldpipe) == 0;
+	}
+	needtimer = timeout != 0 || server_connection >= 0;
+	if( needtimer ) {
+		tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC|TFD_NONBLOCK);
+		if( tfd >= 0 && timeout != 0 && !armtimer(tfd, timeout) ) {
+			close(tfd);
+			tfd = -1;
+		}
+	}
+	/* without the thread both are read here as they become readable */
+	pipelined = pipeline && reader_start(ofds[0], efds[0], queuelimit);
+	if( pipelined )
+		watched += 2;
+	ep = epoll_create1(EPOLL_CLOEXEC);
+	if( ep < 0 || !watchfd(ep, cfds[0], &watched)
+			|| (pipelined && !watchfd(ep, reader_eventfd(), NULL))
+			|| (!pipelined && !watchfd(ep, efds[0], &watched))
+			|| (!pipelined && !watchfd(ep, ofds[0], &watched))
+			|| (needtimer && (tfd < 0 || !watchfd(ep, tfd, NULL)))
+			/* the client sends nothing more, readable means gone */
+			|| (server_connection >= 0 &&
+				!watchfd(ep, server_connection, NULL))
+			|| !watchinput(ep, input, feed) ) {
+		fprintf(stderr, "%s: error setting up epoll: %s\n",
 				program_invocation_short_name,
-				strerror(e));
+				strerror(errno));
+		stopinput(ep, &input, &feed);
+		reader_stop();
+		if( tfd >= 0 )
+			close(tfd);
+		if( ep >= 0 )
+			close(ep);
 		if( cfds[0] > 0 )
 			close(cfds[0]);
 		close(efds[0]);
@@ -417,26 +2088,27 @@ static int start(const char **arguments) {
 		return TESTTOOL_ERROR_EXIT;
 	}
 	/* read data */
-	while( true ) {
-		fd_set readfds;
-		int max = cfds[0];
-		FD_ZERO(&readfds);
-		if( cfds[0] > 0 )
-			FD_SET(cfds[0], &readfds);
-		if( efds[0] > 0 )
-			FD_SET(efds[0], &readfds);
-		if( efds[0] > max )
-			max = efds[0];
-		if( ofds[0] > 0 )
-			FD_SET(ofds[0], &readfds);
-		if( ofds[0] > max )
-			max = ofds[0];
-		if( max == -1 )
-			break;
-		e = select(max+1, &readfds, NULL, NULL, NULL);
-		if( e < 0 ) {
+	while( watched > 0 && failfast_cause.what == NULL && timeoutstage < 3 ) {
+		struct epoll_event events[8];
+		struct timespec waitstart, waitend;
+		int k, n;
+
+		if( print_stats )
+			clock_gettime(CLOCK_MONOTONIC, &waitstart);
+		n = epoll_wait(ep, events, 8, -1);
+		iostats.waits++;
+		if( print_stats ) {
+			clock_gettime(CLOCK_MONOTONIC, &waitend);
+			hotstats.waiting += elapsed(&waitstart, &waitend);
+		}
+		if( n < 0 ) {
 			e = errno;
 			if( e != EINTR ) {
+				stopinput(ep, &input, &feed);
+				reader_stop();
+				close(ep);
+				if( tfd >= 0 )
+					close(tfd);
 				if( cfds[0] > 0 )
 					close(cfds[0]);
 				if( efds[0] > 0 )
@@ -448,28 +2120,93 @@ static int start(const char **arguments) {
 						strerror(e));
 				return TESTTOOL_ERROR_EXIT;
 			}
-		} else {
-			if( cfds[0] > 0 && FD_ISSET(cfds[0],&readfds) ) {
+			continue;
+		}
+		for( k = 0 ; k < n ; k++ ) {
+			int fd = events[k].data.fd;
+
+			if( fd == cfds[0] && valgrind_xml ) {
+				if( readvgxml(cfds[0]) ) {
+					unwatchfd(ep, cfds[0], &watched);
+					cfds[0] = -1;
+				}
+			} else if( fd == cfds[0] ) {
 				if( readcontroldata(cfds[0], &result, child) ) {
-					close(cfds[0]);
+					unwatchfd(ep, cfds[0], &watched);
 					cfds[0] = -1;
 				}
+			} else if( pipelined && fd == reader_eventfd() ) {
+				struct chunk *c;
+				uint64_t count;
 
-			}
-			if( efds[0] > 0 && FD_ISSET(efds[0],&readfds) ) {
+				(void)read(fd, &count, sizeof(count));
+				iostats.reads++;
+				while( failfast_cause.what == NULL &&
+						(c = reader_take()) != NULL ) {
+					if( takechunk(c) )
+						watched--;
+					reader_release(c);
+				}
+			} else if( fd == efds[0] ) {
 				if( readlinedata(efds[0], &errorexpect, 2) ) {
-					close(efds[0]);
+					unwatchfd(ep, efds[0], &watched);
 					efds[0] = -1;
 				}
-			}
-			if( ofds[0] > 0 && FD_ISSET(ofds[0],&readfds) ) {
+			} else if( fd == ofds[0] ) {
 				if( readlinedata(ofds[0], &outexpect, 1) ) {
-					close(ofds[0]);
+					unwatchfd(ep, ofds[0], &watched);
 					ofds[0] = -1;
 				}
+			} else if( feed >= 0 && (fd == feed || fd == input) ) {
+				if( feedinput(input, feed) )
+					stopinput(ep, &input, &feed);
+			} else if( server_connection >= 0 &&
+					fd == server_connection ) {
+				(void)epoll_ctl(ep, EPOLL_CTL_DEL, fd, NULL);
+				clientgone = true;
+				if( timeoutstage == 0 ) {
+					timeoutstage = 1;
+					killprogram(child, SIGTERM);
+					(void)armtimer(tfd, TIMEOUT_GRACE);
+				}
+			} else if( fd == tfd ) {
+				uint64_t expirations;
+
+				if( read(tfd, &expirations, sizeof(expirations)) < 0 )
+					continue;
+				timeoutstage++;
+				if( timeoutstage < 3 ) {
+					killprogram(child, (timeoutstage == 1)?
+							SIGTERM:SIGKILL);
+					(void)armtimer(tfd, TIMEOUT_GRACE);
+				}
 			}
+			if( failfast_cause.what != NULL )
+				break;
 		}
 	}
+	stopinput(ep, &input, &feed);
+	reader_stop();
+	close(ep);
+	if( tfd >= 0 )
+		close(tfd);
+	if( pipeignored )
+		(void)sigaction(SIGPIPE, &oldpipe, NULL);
+	if( clientgone )
+		fprintf(stderr, "%s: the client went away, stopped %s\n",
+				program_invocation_short_name, arguments[0]);
+	else if( timeoutstage > 0 )
+		fprintf(stderr, "%s: %s did not finish within the timeout of %.3f seconds\n",
+				program_invocation_short_name,
+				arguments[0], timeout / 1e6);
+	if( timeoutstage > 0 ) {
+		if( timeoutstage >= 3 )
+			fprintf(stderr, "%s: still not all output closed after KILL, giving up\n",
+					program_invocation_short_name);
+		result = EXIT_FAILURE;
+	}
+	if( failfast_cause.what != NULL )
+		return killfailed(child, arguments[0], cfds[0], efds[0], ofds[0]);
 	if( outexpect.unexpected > 0 || errorexpect.unexpected > 0 ) {
 		fprintf(stderr,
 			"%s: %lu unexpected lines in stdout, %lu in stderr\n",
@@ -495,27 +2232,30 @@ static int start(const char **arguments) {
 			(unsigned long)errorexpect.malformed);
 		result = EXIT_FAILURE;
 	}
-	for( p = errorexpect.expect; p != NULL ; p = p->next ) {
-		if( p->found <= 0 && variables[p->variable] >= p->varlimit ) {
-			fprintf(stderr, "%s: missed expected line(2): %s\n",
-				program_invocation_short_name, p->line);
-			result = EXIT_FAILURE;
-		}
-	}
-	for( p = outexpect.expect; p != NULL ; p = p->next ) {
-		if( p->found <= 0 && variables[p->variable] >= p->varlimit ) {
-			fprintf(stderr, "%s: missed expected line(1): %s\n",
-				program_invocation_short_name, p->line);
-			result = EXIT_FAILURE;
-		}
-	}
+	if( reportmissed(&errorexpect.expect, 2) )
+		result = EXIT_FAILURE;
+	if( reportmissed(&errorexpect.expectpatterns, 2) )
+		result = EXIT_FAILURE;
+	if( reportmissed(&outexpect.expect, 1) )
+		result = EXIT_FAILURE;
+	if( reportmissed(&outexpect.expectpatterns, 1) )
+		result = EXIT_FAILURE;
+	if( valgrind_xml && use_debugger && !vgsummary() )
+		result = EXIT_FAILURE;
 	if( cfds[0] > 0 )
 		close(cfds[0]);
 	if( efds[0] > 0 )
 		close(efds[0]);
 	if( ofds[0] > 0 )
 		close(ofds[0]);
-	w = waitpid(child, &status, 0);
+	w = wait4(child, &status, 0, &childusage);
+	clock_gettime(CLOCK_MONOTONIC, &timing.exited);
+	if( w == child && !checkbudget() )
+		result = EXIT_FAILURE;
+	if( w == child )
+		reportlimits(status);
+	if( use_sanitizer && !sanitizerreports(true) )
+		result = EXIT_FAILURE;
 	if( WIFEXITED(status) ) {
 		if( WEXITSTATUS(status) != expected_returncode ) {
 			fprintf(stderr, "%s: got returncode %d"
@@ -527,12 +2267,6 @@ static int start(const char **arguments) {
 		} else {
 			return result;
 		}
-	} else if( WIFSIGNALED(status) && WTERMSIG(status) == SIGUSR2) {
-		fprintf(stderr, "%s: Could not start %s\n",
-				program_invocation_short_name,
-				arguments[0]);
-
-		return TESTTOOL_ERROR_EXIT;
 	} else if( WIFSIGNALED(status) ) {
 		fprintf(stderr, "%s: Program %s killed by signal %d\n",
 				program_invocation_short_name,
@@ -547,37 +2281,207 @@ static int start(const char **arguments) {
 	}
 }
 
+struct linecheck {
+	struct linecheck *next;
+	char *line;
+	size_t len;
+	int varlimit;
+	unsigned char variable;
+	unsigned char kind;
+};
+
 static enum {
 	AT_stderr,
 	AT_stdout,
 } addto = AT_stderr;
 
-static bool readruleline(const char *buffer, size_t len) {
-	struct linecheck *n;
-	struct linecheck **next;
+/* rules as parsed, indexed by AT_*, before they get compiled */
+static struct {
+	struct linecheck *expect, *ignore;
+	struct linecheck *expectpatterns, *ignorepatterns;
+} parsedrules[2];
+/* the arguments of the 'valgrind' rules */
+static struct linecheck *parsedvalgrind = NULL;
+/* the argument of the 'stdin' rule */
+static struct linecheck *parsedstdin = NULL;
+static int8_t rules_ignoreunknown[2] = { -1, -1 };
+static int rules_returncode = -1;
+static int rules_failfast = 0;
+static struct {
+	uint64_t time, cpu, rss;
+} rules_budget;
+static uint64_t rules_timeout = 0;
+
+static const struct {
+	const char *name;
+	int signal;
+} signalnames[] = {
+	{"HUP", SIGHUP}, {"INT", SIGINT}, {"QUIT", SIGQUIT},
+	{"ABRT", SIGABRT}, {"KILL", SIGKILL}, {"USR1", SIGUSR1},
+	{"USR2", SIGUSR2}, {"ALRM", SIGALRM}, {"TERM", SIGTERM},
+	{NULL, 0}
+};
+
+/* a signal number or name (with or without SIG) */
+static int parsesignal(const char *s) {
 	char *e;
-	char variable = 0;
-	int limit = INT_MIN;
+	long l;
+	int i;
 
-	if( len <= 0 || buffer[0] == '#' )
-		return true;
+	if( *s >= '0' && *s <= '9' ) {
+		l = strtol(s, &e, 10);
+		if( *e != '\0' || l <= 0 || l >= NSIG || l > UINT8_MAX )
+			return 0;
+		return l;
+	}
+	if( strncmp(s, "SIG", 3) == 0 )
+		s += 3;
+	for( i = 0 ; signalnames[i].name != NULL ; i++ ) {
+		if( strcmp(s, signalnames[i].name) == 0 )
+			return signalnames[i].signal;
+	}
+	return 0;
+}
 
-	if( addto == AT_stdout )
-		next = &outexpect.ignore;
-	else
-		next = &errorexpect.ignore;
-	switch( buffer[0] ) {
-		case 'r':
-			buffer++;len--;
-			if( buffer[0] == 'e' && len > 0) {
-				buffer++;len--;
-				if( buffer[0] == 't' && len > 0) {
-					buffer++;len--;
-					if( buffer[0] == 'u' && len > 0) {
-						buffer++;len--;
-						if( buffer[0] == 'r' && len > 0) {
-							buffer++;len--;
-							if( buffer[0] == 'n' && len > 0) {
+/* a number with an optional k, M or G suffix */
+static bool parsesize(const char *s, size_t *size) {
+	unsigned long long v;
+	char *e;
+
+	if( *s < '0' || *s > '9' )
+		return false;
+	errno = 0;
+	v = strtoull(s, &e, 10);
+	if( errno != 0 )
+		return false;
+	switch( *e ) {
+		case 'G':
+			v *= 1024;
+			/* fall through */
+		case 'M':
+			v *= 1024;
+			/* fall through */
+		case 'k':
+			v *= 1024;
+			e++;
+	}
+	if( *e != '\0' || v > SIZE_MAX/4 )
+		return false;
+	*size = v;
+	return true;
+}
+
+/* seconds, possibly with a fraction, as microseconds */
+static bool parseseconds(const char *s, uint64_t *us) {
+	double d;
+	char *e;
+
+	if( *s < '0' || *s > '9' )
+		return false;
+	d = strtod(s, &e);
+	while( *e == ' ' || *e == '\t' )
+		e++;
+	if( *e != '\0' || d <= 0 || d > 1e9 )
+		return false;
+	*us = d * 1e6;
+	return *us > 0;
+}
+
+static void freevgrule(struct vgrule *r) {
+	free(r->kind);
+	free(r->function);
+	r->kind = r->function = NULL;
+}
+
+/* "allow KIND N", "allowbytes KIND SIZE" or "suppress KIND FUNCTION" */
+static bool parsevgrule(const char *text, struct vgrule *r) {
+	char word[16], kind[128], arg[256], extra;
+	size_t size;
+	char *e;
+
+	memset(r, 0, sizeof(*r));
+	if( sscanf(text, "%15s %127s %255s %c", word, kind, arg, &extra) != 3 )
+		return false;
+	if( strcmp(word, "allow") == 0 ) {
+		r->type = VR_ALLOW;
+		if( arg[0] < '0' || arg[0] > '9' )
+			return false;
+		r->value = strtoull(arg, &e, 10);
+		if( *e != '\0' )
+			return false;
+	} else if( strcmp(word, "allowbytes") == 0 ) {
+		r->type = VR_ALLOWBYTES;
+		if( !parsesize(arg, &size) )
+			return false;
+		r->value = size;
+	} else if( strcmp(word, "suppress") == 0 ) {
+		r->type = VR_SUPPRESS;
+		r->function = strdup(arg);
+		if( r->function == NULL )
+			return false;
+	} else
+		return false;
+	r->kind = strdup(kind);
+	if( r->kind == NULL ) {
+		freevgrule(r);
+		return false;
+	}
+	return true;
+}
+
+static void freevgrules(void) {
+	size_t i;
+
+	for( i = 0 ; i < vgrulecount ; i++ )
+		freevgrule(&vgrules[i]);
+	free(vgrules);
+	vgrules = NULL;
+	vgrulecount = 0;
+}
+
+static bool usevgrules(const char *image, const struct rulelist *l) {
+	uint32_t i;
+
+	if( l->count == 0 )
+		return true;
+	vgrules = calloc(l->count, sizeof(struct vgrule));
+	if( vgrules == NULL )
+		return false;
+	for( i = 0 ; i < l->count ; i++ ) {
+		if( !parsevgrule(image + l->rules[i].text, &vgrules[i]) ) {
+			freevgrules();
+			return false;
+		}
+		vgrulecount++;
+	}
+	return true;
+}
+
+static bool readruleline(const char *buffer, size_t len) {
+	struct linecheck *n;
+	struct linecheck **next;
+	char *e;
+	char variable = 0;
+	int limit = INT_MIN;
+	enum patternkind kind = 0;
+	const char *error;
+
+	if( len <= 0 || buffer[0] == '#' )
+		return true;
+
+	next = &parsedrules[addto].ignore;
+	switch( buffer[0] ) {
+		case 'r':
+			buffer++;len--;
+			if( buffer[0] == 'e' && len > 0) {
+				buffer++;len--;
+				if( buffer[0] == 't' && len > 0) {
+					buffer++;len--;
+					if( buffer[0] == 'u' && len > 0) {
+						buffer++;len--;
+						if( buffer[0] == 'r' && len > 0) {
+							buffer++;len--;
+							if( buffer[0] == 'n' && len > 0) {
 								buffer++;len--;
 								if( buffer[0] == 's' && 
 									len > 0) {
@@ -591,7 +2495,7 @@ static bool readruleline(const char *buffer, size_t len) {
 			if( buffer[0] == ' ' && len > 0 ) {
 				buffer++;len--;
 			}
-			expected_returncode = strtol(buffer, &e, 0);
+			rules_returncode = (unsigned char)strtol(buffer, &e, 0);
 			while( *e == ' ' || *e == '\t' ) 
 				e++;
 			if( *e != '\0' ) {
@@ -601,6 +2505,28 @@ static bool readruleline(const char *buffer, size_t len) {
 			}
 			return true;
 		case 's':
+			if( len > 6 && strncmp(buffer, "stdin ", 6) == 0 ) {
+				buffer += 6; len -= 6;
+				while( len > 0 && buffer[0] == ' ' ) {
+					buffer++;len--;
+				}
+				if( len == 0 ) {
+					fputs("stdin rule without a file\n", stderr);
+					return false;
+				}
+				/* the last one counts */
+				if( parsedstdin == NULL )
+					parsedstdin = calloc(1,
+						sizeof(struct linecheck));
+				if( parsedstdin == NULL )
+					return false;
+				free(parsedstdin->line);
+				parsedstdin->line = strndup(buffer, len);
+				if( parsedstdin->line == NULL )
+					return false;
+				parsedstdin->len = len;
+				return true;
+			}
 			if( len > 7 || (len == 7 && buffer[6] != '*')) {
 				fputs("Too long rule starting with s\n",
 						stderr);
@@ -609,16 +2535,86 @@ static bool readruleline(const char *buffer, size_t len) {
 			if( len >= 6 ) {
 				if( strncmp(buffer, "stderr", 6) == 0 ) {
 					addto = AT_stderr;
-					errorexpect.ignoreunknown = len == 7;
+					rules_ignoreunknown[AT_stderr] = len == 7;
 					return true;
 				} else if( strncmp(buffer, "stdout", 6) == 0 ) {
 					addto = AT_stdout;
-					outexpect.ignoreunknown = len == 7;
+					rules_ignoreunknown[AT_stdout] = len == 7;
 					return true;
 				}
 			}
 			fputs("Unparseable s-rule\n", stderr);
 			return false;
+		case 'm':
+			if( strncmp(buffer, "maxtime ", 8) == 0 ) {
+				if( parseseconds(buffer + 8, &rules_budget.time) )
+					return true;
+			} else if( strncmp(buffer, "maxcpu ", 7) == 0 ) {
+				if( parseseconds(buffer + 7, &rules_budget.cpu) )
+					return true;
+			} else if( strncmp(buffer, "maxrss ", 7) == 0 ) {
+				size_t rss;
+
+				if( parsesize(buffer + 7, &rss) && rss > 0 ) {
+					rules_budget.rss = rss;
+					return true;
+				}
+			}
+			fprintf(stderr, "%s: Unparseable m-rule: %s\n",
+					program_invocation_short_name, buffer);
+			return false;
+		case 'v': {
+			struct vgrule r;
+
+			if( strncmp(buffer, "valgrind ", 9) != 0 ||
+					!parsevgrule(buffer + 9, &r) ) {
+				fprintf(stderr, "%s: Unparseable v-rule: %s\n",
+						program_invocation_short_name, buffer);
+				return false;
+			}
+			freevgrule(&r);
+			n = calloc(1, sizeof(struct linecheck));
+			if( n == NULL )
+				return false;
+			n->line = strdup(buffer + 9);
+			if( n->line == NULL ) {
+				free(n);
+				return false;
+			}
+			n->len = len - 9;
+			n->next = parsedvalgrind;
+			parsedvalgrind = n;
+			return true;
+		}
+		case 't':
+			if( strncmp(buffer, "timeout ", 8) != 0 ||
+					!parseseconds(buffer + 8, &rules_timeout) ) {
+				fprintf(stderr, "%s: Unparseable t-rule: %s\n",
+						program_invocation_short_name, buffer);
+				return false;
+			}
+			return true;
+		case 'f':
+			if( strncmp(buffer, "failfast", 8) != 0 ||
+					(len > 8 && buffer[8] != ' ') ) {
+				fputs("Unparseable f-rule\n", stderr);
+				return false;
+			}
+			buffer += 8; len -= 8;
+			while( len > 0 && buffer[0] == ' ' ) {
+				buffer++;len--;
+			}
+			if( len == 0 )
+				rules_failfast = SIGTERM;
+			else
+				rules_failfast = parsesignal(buffer);
+			if( rules_failfast == 0 ) {
+				fprintf(stderr, "%s: Unknown signal in failfast rule: %s\n",
+						program_invocation_short_name,
+						buffer);
+				return false;
+			}
+			return true;
 	};
 	if( buffer[0] == '-') {
 		int sign;
@@ -644,19 +2640,31 @@ static bool readruleline(const char *buffer, size_t len) {
 	}
 	if( len > 0 && buffer[0] == '*') {
 		buffer++;len--;
-		if( addto == AT_stdout )
-			next = &outexpect.expect;
+		next = &parsedrules[addto].expect;
+	}
+	if( len > 1 && (buffer[0] == '?' || buffer[0] == '~') &&
+			buffer[1] == '=' ) {
+		kind = (buffer[0] == '?')?PK_GLOB:PK_REGEX;
+		buffer++;len--;
+		if( next == &parsedrules[addto].expect )
+			next = &parsedrules[addto].expectpatterns;
 		else
-			next = &errorexpect.expect;
-		assert(buffer[0] == '=');
+			next = &parsedrules[addto].ignorepatterns;
 	}
 	if( len > 0 && buffer[0] == '=') {
 		buffer++;len--;
+		if( kind != 0 && !pattern_check(kind, buffer, len, &error) ) {
+			fprintf(stderr, "%s: %s in pattern: %s\n",
+					program_invocation_short_name,
+					error, buffer);
+			return false;
+		}
 		n = calloc(1,sizeof(struct linecheck));
 		if( n == NULL )
 			return false;
 		n->variable = variable;
 		n->varlimit = limit;
+		n->kind = kind;
 		n->line = strndup(buffer, len);
 		assert( n->line != NULL);
 		n->len = len;
@@ -671,37 +2679,35 @@ static bool readruleline(const char *buffer, size_t len) {
 }
 
 static bool read_rules(void) {
-	char buffer[2000];
-	size_t len = 0;
+	struct linebuffer lb = { NULL, 0, 0, 0, 0, false, { HASH_SEED, 0 } };
 	ssize_t got;
-	int fd = (command_fd < 0)?3:command_fd;
-	int linestart = 0;
-	int i;
-
-	while( (got = read(fd, buffer+len, sizeof(buffer)-len)) > 0) {
+	int fd = rules_fd();
+	size_t linestart;
+	char *p, *q, *end;
 
-		for( i = len ; i < (int)(len+got) ; i++ ) {
-			if( buffer[i] == '\n' || buffer[i] == '\0' ) {
-				buffer[i] = '\0';
-				if( !readruleline(buffer+linestart,i-linestart))
-					return false;
-				linestart = i+1;
+	while( (got = fillbuffer(fd, &lb)) > 0) {
+		linestart = lb.start;
+		end = lb.data + lb.len + got;
+		for( p = lb.data + lb.len ; (q = (char*)findbreak(p, end)) < end ;
+				p = q + 1 ) {
+			*q = '\0';
+			if( !readruleline(lb.data+linestart,
+						q-lb.data-linestart)) {
+				free(lb.data);
+				return false;
 			}
+			linestart = q + 1 - lb.data;
 		}
-		len += got;
-		if( linestart > 0 ) {
-			len -= linestart;
-			if( len > 0 )
-				memmove(buffer, buffer+linestart, len);
-			linestart = 0;
-		}
+		lb.len += got;
+		dropconsumed(&lb, linestart);
 	}
+	free(lb.data);
 	if( got < 0 ) {
 		fprintf(stderr,
 			"Error reading rules from file-descriptor %d: %s\n",
 			fd, strerror(errno));
 		return false;
-	} else if( len > 0 ) {
+	} else if( lb.len > lb.start ) {
 		fprintf(stderr,
 			"Unterminated line at end of rules\n");
 		return false;
@@ -709,152 +2715,1719 @@ static bool read_rules(void) {
 	return true;
 }
 
-static const struct option longopts[] = {
-	{"debugger",		optional_argument,	NULL,	'd'},
-	{"help",		no_argument,		NULL,	'h'},
-	{"version",		no_argument,		NULL,	'v'},
-	{"silent",		no_argument,		NULL,	's'},
-	{"echo",		no_argument,		NULL,	'e'},
-	{"annotate",		no_argument,		NULL,	'a'},
-	{"rules",		no_argument,		NULL,	'r'},
-	{"outfile",		required_argument,	NULL,	'o'},
-	{"variable",		required_argument,	NULL,	'D'},
-	{"checkstdout",		no_argument,		NULL,	'C'},
-	{"ignoreunexpected",	no_argument,		NULL,	'i'},
-	{NULL,			0,			NULL,	0}
-};
+/* the same for rules already read, data[len] must be writeable */
+static bool parseruletext(char *data, size_t len) {
+	char *p, *q, *end = data + len;
 
-int main(int argc, char *argv[]) {
-	int c;
-	const char **arguments;
-	int argumentcount;
-	int status;
+	for( p = data ; (q = (char*)findbreak(p, end)) < end ; p = q + 1 ) {
+		*q = '\0';
+		if( !readruleline(p, q - p) )
+			return false;
+	}
+	if( p < end ) {
+		*end = '\0';
+		fprintf(stderr,
+			"Unterminated line at end of rules\n");
+		return false;
+	}
+	return true;
+}
 
-	if( argc <= 1 )
-		usage(TESTTOOL_ERROR_EXIT);
+static void freelinechecks(struct linecheck **list) {
+	struct linecheck *p;
 
-	opterr = 0;
-	while( (c = getopt_long(argc, argv, "+hvseariCD:o:d::", longopts, NULL)) != -1 ) {
-		if( c == 'd' ) {
-			use_debugger = true;
-			if( optarg != NULL ) {
-				debugger = strdup(optarg);
-				if( debugger == NULL ) {
-					fputs("Out of memory!\n", stderr);
-					exit(TESTTOOL_ERROR_EXIT);
-				}
-			} else
-				debugger = NULL;
-			break;
-		}
-		switch( c ) {
-			case '?':
-				fprintf(stderr,
-					"%s: Unexpected option '%c'!\n",
-					program_invocation_short_name, optopt);
-				exit(TESTTOOL_ERROR_EXIT);
-			case 'h':
-				usage(EXIT_SUCCESS);
-			case 'v':
-				printf("%s version %s\n", PACKAGE, VERSION);
-				exit(EXIT_SUCCESS);
-			case 's':
-				silent = true;
-				break;
-			case 'e':
-				echo = true;
-				break;
-			case 'a':
-				annotate = true;
-				break;
-			case 'r':
-				readrules = true;
-				break;
-			case 'o':
-				free(outfile);
-				outfile = strdup(optarg);
-				if( outfile == NULL ) {
-					fputs("Out of memory!\n", stderr);
-					exit(TESTTOOL_ERROR_EXIT);
-				}
-				break;
-			case 'C':
-				outexpect.ignoreunknown = false;
-				break;
-			case 'i':
-				ignoreunexpected = true;
-				break;
-			case 'D':
-				if( optarg[0] < 'a' || optarg[0] > 'z' ) {
-					fprintf(stderr,
-							"%s: No variable-name found in '%s'!\n",
-							program_invocation_short_name, optarg);
-					exit(TESTTOOL_ERROR_EXIT);
-				}
-				if( optarg[1] != '=' ) {
-					fprintf(stderr,
-							"%s: Missing '=' in '%s'!\n",
-							program_invocation_short_name, optarg);
-					exit(TESTTOOL_ERROR_EXIT);
-				}
-				variables[optarg[0]-'a'+1] = atoi(optarg+2);
-				break;
-			default:
-				fprintf(stderr,
-					"%s: Unexpected getopt_long return '%c'!\n",
-					program_invocation_short_name, c);
-				exit(TESTTOOL_ERROR_EXIT);
-		}
+	while( (p = *list) != NULL ) {
+		*list = p->next;
+		free(p->line);
+		free(p);
 	}
+}
 
-	if( optind >= argc ) {
-		fprintf(stderr, "%s: no program to start specified!\n",
-				program_invocation_short_name);
-		free(debugger);
-		free(outfile);
-		exit(TESTTOOL_ERROR_EXIT);
+static void freeparsedrules(void) {
+	int i;
+
+	for( i = 0 ; i < 2 ; i++ ) {
+		freelinechecks(&parsedrules[i].expect);
+		freelinechecks(&parsedrules[i].ignore);
+		freelinechecks(&parsedrules[i].expectpatterns);
+		freelinechecks(&parsedrules[i].ignorepatterns);
 	}
+	freelinechecks(&parsedvalgrind);
+	freelinechecks(&parsedstdin);
+}
 
-	if( readrules ) {
-		if( !read_rules() ) {
-			free(debugger);
-			free(outfile);
-			exit(TESTTOOL_ERROR_EXIT);
+static inline size_t align8(size_t s) {
+	return (s + 7) & ~(size_t)7;
+}
+
+/* pack the parsed rules into an image, lists are kept in order */
+static char *compilerules(const struct stat *source, size_t *imagesize) {
+	struct linecheck *lists[RS_COUNT];
+	uint32_t counts[RS_COUNT], slotcounts[RS_COUNT];
+	struct imageheader *h;
+	struct linecheck *p;
+	size_t size, textsize = 0, text;
+	char *image;
+	int s;
+
+	lists[RS_stderr_expect] = parsedrules[AT_stderr].expect;
+	lists[RS_stderr_ignore] = parsedrules[AT_stderr].ignore;
+	lists[RS_stdout_expect] = parsedrules[AT_stdout].expect;
+	lists[RS_stdout_ignore] = parsedrules[AT_stdout].ignore;
+	lists[RS_stderr_expectpatterns] = parsedrules[AT_stderr].expectpatterns;
+	lists[RS_stderr_ignorepatterns] = parsedrules[AT_stderr].ignorepatterns;
+	lists[RS_stdout_expectpatterns] = parsedrules[AT_stdout].expectpatterns;
+	lists[RS_stdout_ignorepatterns] = parsedrules[AT_stdout].ignorepatterns;
+	lists[RS_valgrind] = parsedvalgrind;
+	lists[RS_stdin] = parsedstdin;
+
+	size = align8(sizeof(struct imageheader));
+	for( s = 0 ; s < RS_COUNT ; s++ ) {
+		counts[s] = 0;
+		for( p = lists[s] ; p != NULL ; p = p->next ) {
+			counts[s]++;
+			textsize += p->len + 1;
+		}
+		slotcounts[s] = 0;
+		if( counts[s] > 0 && s < RS_FIRSTPATTERNS ) {
+			slotcounts[s] = 16;
+			while( slotcounts[s] < 2*counts[s] )
+				slotcounts[s] *= 2;
 		}
+		size += counts[s] * sizeof(struct imagerule);
+		size += align8(slotcounts[s] * sizeof(uint32_t));
 	}
+	text = size;
+	size = align8(size + textsize);
 
-	if( outfile != NULL ) {
-		outfile_fd = open(outfile, O_CREAT|O_TRUNC|O_NOFOLLOW|O_WRONLY, 0666);
-		if( outfile_fd < 0 ) {
-			fprintf(stderr,"%s: Error opening file %s: %s\n",
-					program_invocation_short_name,
-					outfile, strerror(errno));
-			free(debugger);
-			free(outfile);
-			exit(TESTTOOL_ERROR_EXIT);
-		}
+	image = calloc(1, size);
+	if( image == NULL )
+		return NULL;
+	h = (struct imageheader*)image;
+	memcpy(h->magic, RULEIMAGE_MAGIC, 8);
+	h->version = RULEIMAGE_VERSION;
+	h->byteorder = RULEIMAGE_BYTEORDER;
+	h->size = size;
+	if( source != NULL ) {
+		h->sourcesize = source->st_size;
+		h->sourcemtime = source->st_mtim.tv_sec;
+		h->sourcemtimensec = source->st_mtim.tv_nsec;
 	}
+	h->returncode = rules_returncode;
+	h->failfast = rules_failfast;
+	h->maxtime = rules_budget.time;
+	h->maxcpu = rules_budget.cpu;
+	h->maxrss = rules_budget.rss;
+	h->timeout = rules_timeout;
+	h->ignoreunknown[AT_stderr] = rules_ignoreunknown[AT_stderr];
+	h->ignoreunknown[AT_stdout] = rules_ignoreunknown[AT_stdout];
 
-	arguments = createarguments(&argumentcount, argv+optind, argc-optind);
+	size = align8(sizeof(struct imageheader));
+	for( s = 0 ; s < RS_COUNT ; s++ ) {
+		struct imagerule *rules = (struct imagerule*)(image + size);
+		uint32_t *slots, i = 0, j, n;
 
-	if( echo ) {
-		int i;
-		for( i = 0; i+1 < argumentcount; i++,putchar(' ') ) {
-			putchar('\'');
-			assert(arguments[i] != NULL);
-			fputs(arguments[i], stdout);
-			putchar('\'');
+		h->sections[s].rules = size;
+		h->sections[s].count = counts[s];
+		size += counts[s] * sizeof(struct imagerule);
+		h->sections[s].slots = size;
+		h->sections[s].mask = (slotcounts[s] > 0)?slotcounts[s] - 1:0;
+		slots = (uint32_t*)(image + size);
+		size += align8(slotcounts[s] * sizeof(uint32_t));
+
+		for( p = lists[s] ; p != NULL ; p = p->next, i++ ) {
+			struct imagerule *r = &rules[i];
+
+			memcpy(image + text, p->line, p->len);
+			r->text = text;
+			r->len = p->len;
+			r->hash = linehash(p->line, p->len);
+			r->varlimit = p->varlimit;
+			r->variable = p->variable;
+			r->kind = p->kind;
+			text += p->len + 1;
+			if( s >= RS_FIRSTPATTERNS ) {
+				r->hash = 0;
+				continue;
+			}
+
+			j = r->hash & h->sections[s].mask;
+			while( (n = slots[j]) != 0 ) {
+				if( rules[n-1].len == r->len &&
+						rules[n-1].hash == r->hash &&
+						memcmp(image + rules[n-1].text,
+							p->line, p->len) == 0 )
+					break;
+				j = (j + 1) & h->sections[s].mask;
+			}
+			if( n == 0 ) {
+				slots[j] = i + 1;
+				continue;
+			}
+			/* keep the list order within a chain */
+			while( rules[n-1].same != 0 )
+				n = rules[n-1].same;
+			rules[n-1].same = i + 1;
 		}
-		putchar('\n');
 	}
+	*imagesize = h->size;
+	return image;
+}
 
-	status = start(arguments);
-
-	if( outfile_fd >= 0 )
-		close(outfile_fd);
+static bool checksection(const char *image, size_t size, const struct imagesection *section, int s) {
+	const struct imagerule *rules;
+	const uint32_t *slots;
+	uint32_t i;
 
-	free(arguments);
-	free(debugger);
+	if( section->count == 0 )
+		return true;
+	if( s >= RS_FIRSTPATTERNS ) {
+		if( section->rules % 8 != 0 || section->rules > size ||
+				section->count > (size - section->rules) /
+					sizeof(struct imagerule) )
+			return false;
+		rules = (const struct imagerule*)(image + section->rules);
+		for( i = 0 ; i < section->count ; i++ ) {
+			if( rules[i].text >= size ||
+					rules[i].len >= size - rules[i].text ||
+					image[rules[i].text + rules[i].len] != '\0'
+					|| (s >= RS_valgrind && rules[i].kind != 0)
+					|| (s == RS_stdin && section->count > 1)
+					|| (s < RS_valgrind &&
+					    rules[i].kind != PK_GLOB &&
+					    rules[i].kind != PK_REGEX)
+					|| rules[i].variable > 'z'-'a'+1 )
+				return false;
+		}
+		return true;
+	}
+	if( section->rules % 8 != 0 || section->slots % 4 != 0 ||
+			section->count >= SLOT_INACTIVE ||
+			section->rules > size || section->slots > size ||
+			section->count > (size - section->rules) /
+				sizeof(struct imagerule) ||
+			(section->mask & (section->mask + 1)) != 0 ||
+			section->mask >= (size - section->slots) /
+				sizeof(uint32_t) )
+		return false;
+	rules = (const struct imagerule*)(image + section->rules);
+	slots = (const uint32_t*)(image + section->slots);
+	for( i = 0 ; i <= section->mask ; i++ ) {
+		if( slots[i] > section->count )
+			return false;
+	}
+	for( i = 0 ; i < section->count ; i++ ) {
+		if( rules[i].text >= size || rules[i].len >= size - rules[i].text
+				|| image[rules[i].text + rules[i].len] != '\0'
+				|| rules[i].same > section->count
+				|| rules[i].kind != 0
+				|| rules[i].variable > 'z'-'a'+1 )
+			return false;
+	}
+	return true;
+}
+
+static void freepatterns(void) {
+	patternset_free(errorexpect.expectpatterns.patterns);
+	patternset_free(errorexpect.ignorepatterns.patterns);
+	patternset_free(outexpect.expectpatterns.patterns);
+	patternset_free(outexpect.ignorepatterns.patterns);
+	errorexpect.expectpatterns.patterns = NULL;
+	errorexpect.ignorepatterns.patterns = NULL;
+	outexpect.expectpatterns.patterns = NULL;
+	outexpect.ignorepatterns.patterns = NULL;
+}
+
+static inline bool active(const struct imagerule *r) {
+	return variables[r->variable] >= r->varlimit;
+}
+
+/* does some rule of the list depend on a variable not set high enough? */
+static bool hasinactive(const struct rulelist *l) {
+	uint32_t i;
+
+	for( i = 0 ; i < l->count ; i++ ) {
+		if( !active(&l->rules[i]) )
+			return true;
+	}
+	return false;
+}
+
+/* combine the patterns of a section into one automaton, if map is not
+ * NULL only those of active rules, storing their numbers in map */
+static bool usepatterns(const char *image, struct rulelist *l, uint32_t *map) {
+	const char *error;
+	uint32_t i, n = 0;
+
+	if( l->count == 0 )
+		return true;
+	l->patterns = patternset_new();
+	if( l->patterns == NULL )
+		return false;
+	for( i = 0 ; i < l->count ; i++ ) {
+		if( map != NULL && !active(&l->rules[i]) )
+			continue;
+		if( !patternset_add(l->patterns, l->rules[i].kind,
+					image + l->rules[i].text,
+					l->rules[i].len, &error) )
+			return false;
+		if( map != NULL )
+			map[n] = i;
+		n++;
+	}
+	l->map = map;
+	return true;
+}
+
+/* let every slot of l point to the first active rule of its chain */
+static void specializeslots(struct rulelist *l, uint32_t *slots) {
+	uint32_t i, n, m;
+
+	for( i = 0 ; i <= l->mask ; i++ ) {
+		n = l->slots[i];
+		m = n;
+		while( m != 0 && !active(&l->rules[m-1]) )
+			m = l->rules[m-1].same;
+		if( n != 0 && m == 0 )
+			m = n | SLOT_INACTIVE;
+		slots[i] = m;
+	}
+	l->slots = slots;
+}
+
+/* make the rules in image the ones to check against */
+static bool userules(const char *image, size_t size) {
+	const struct imageheader *h = (const struct imageheader*)image;
+	struct rulelist *lists[RS_COUNT];
+	bool specialize[RS_COUNT];
+	size_t total = 0, extra = 0, *found;
+	uint32_t *next;
+	int s;
+
+	if( size < sizeof(struct imageheader) ||
+			memcmp(h->magic, RULEIMAGE_MAGIC, 8) != 0 ||
+			h->version != RULEIMAGE_VERSION ||
+			h->byteorder != RULEIMAGE_BYTEORDER ||
+			h->size != size )
+		return false;
+	for( s = 0 ; s < RS_COUNT ; s++ ) {
+		if( !checksection(image, size, &h->sections[s], s) )
+			return false;
+	}
+
+	lists[RS_stderr_expect] = &errorexpect.expect;
+	lists[RS_stderr_ignore] = &errorexpect.ignore;
+	lists[RS_stdout_expect] = &outexpect.expect;
+	lists[RS_stdout_ignore] = &outexpect.ignore;
+	lists[RS_stderr_expectpatterns] = &errorexpect.expectpatterns;
+	lists[RS_stderr_ignorepatterns] = &errorexpect.ignorepatterns;
+	lists[RS_stdout_expectpatterns] = &outexpect.expectpatterns;
+	lists[RS_stdout_ignorepatterns] = &outexpect.ignorepatterns;
+	lists[RS_valgrind] = &valgrindrules;
+	lists[RS_stdin] = &stdinrules;
+	/* the variables are known by now, so expected rules whose
+	 * condition does not hold can be dropped once here instead
+	 * of being skipped for every line */
+	for( s = 0 ; s < RS_COUNT ; s++ ) {
+		lists[s]->rules = (const struct imagerule*)
+			(image + h->sections[s].rules);
+		lists[s]->slots = (const uint32_t*)
+			(image + h->sections[s].slots);
+		lists[s]->count = h->sections[s].count;
+		lists[s]->mask = h->sections[s].mask;
+		lists[s]->map = NULL;
+		total += h->sections[s].count;
+		specialize[s] = (s == RS_stderr_expect ||
+				s == RS_stdout_expect ||
+				s == RS_stderr_expectpatterns ||
+				s == RS_stdout_expectpatterns) &&
+			hasinactive(lists[s]);
+		if( specialize[s] && s >= RS_FIRSTPATTERNS )
+			extra += lists[s]->count;
+		else if( specialize[s] )
+			extra += lists[s]->mask + 1;
+	}
+	rulearena = calloc(1, (total + 1) * sizeof(size_t) +
+			extra * sizeof(uint32_t));
+	if( rulearena == NULL )
+		return false;
+	found = rulearena;
+	next = (uint32_t*)(found + total + 1);
+	total = 0;
+	for( s = 0 ; s < RS_COUNT ; s++ ) {
+		lists[s]->found = found + total;
+		total += lists[s]->count;
+		if( s < RS_FIRSTPATTERNS ) {
+			if( specialize[s] ) {
+				specializeslots(lists[s], next);
+				next += lists[s]->mask + 1;
+			}
+		} else if( s < RS_valgrind ) {
+			if( !usepatterns(image, lists[s],
+					specialize[s]?next:NULL) ) {
+				freepatterns();
+				free(rulearena);
+				rulearena = NULL;
+				return false;
+			}
+			if( specialize[s] )
+				next += lists[s]->count;
+		}
+	}
+	if( !usevgrules(image, &valgrindrules) ) {
+		freepatterns();
+		free(rulearena);
+		rulearena = NULL;
+		return false;
+	}
+	if( h->returncode >= 0 && !returncode_given )
+		expected_returncode = h->returncode;
+	/* the command line takes precedence */
+	if( h->failfast != 0 && failfast_signal == 0 )
+		failfast_signal = h->failfast;
+	budget.time = h->maxtime;
+	budget.cpu = h->maxcpu;
+	budget.rss = h->maxrss;
+	if( h->timeout != 0 && timeout == 0 )
+		timeout = h->timeout;
+	if( h->ignoreunknown[AT_stderr] >= 0 )
+		errorexpect.ignoreunknown = h->ignoreunknown[AT_stderr];
+	if( h->ignoreunknown[AT_stdout] >= 0 )
+		outexpect.ignoreunknown = h->ignoreunknown[AT_stdout];
+	rules_stdin = (stdinrules.count > 0)?
+		image + stdinrules.rules[0].text:NULL;
+	ruleimage = image;
+	ruleimage_size = size;
+	return true;
+}
+
+static void freerules(void) {
+	freepatterns();
+	freevgrules();
+	if( ruleimage_mapped )
+		munmap((void*)ruleimage, ruleimage_size);
+	else
+		free((void*)ruleimage);
+	ruleimage = NULL;
+	rules_stdin = NULL;
+	free(rulearena);
+	rulearena = NULL;
+}
+
+/* name of the compiled rules next to the file open as fd */
+static char *rulescachename(int fd) {
+	char link[40], target[PATH_MAX];
+	ssize_t got;
+	char *name;
+
+	snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+	got = readlink(link, target, sizeof(target) - 1);
+	if( got <= 0 || target[0] != '/' )
+		return NULL;
+	name = malloc(got + sizeof(RULEIMAGE_SUFFIX));
+	if( name == NULL )
+		return NULL;
+	memcpy(name, target, got);
+	memcpy(name + got, RULEIMAGE_SUFFIX, sizeof(RULEIMAGE_SUFFIX));
+	return name;
+}
+
+/* use the compiled rules next to the rules file, if they are current */
+static bool loadrulecache(int fd) {
+	const struct imageheader *h;
+	struct stat source, st;
+	char *name;
+	void *image;
+	int cfd;
+
+	if( fstat(fd, &source) != 0 || !S_ISREG(source.st_mode) )
+		return false;
+	name = rulescachename(fd);
+	if( name == NULL )
+		return false;
+	cfd = open(name, O_RDONLY|O_NOCTTY);
+	free(name);
+	if( cfd < 0 )
+		return false;
+	if( fstat(cfd, &st) != 0 || st.st_size < (off_t)sizeof(struct imageheader) ) {
+		close(cfd);
+		return false;
+	}
+	image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, cfd, 0);
+	close(cfd);
+	if( image == MAP_FAILED )
+		return false;
+	h = image;
+	if( h->sourcesize != (uint64_t)source.st_size ||
+			h->sourcemtime != source.st_mtim.tv_sec ||
+			h->sourcemtimensec != source.st_mtim.tv_nsec ||
+			!userules(image, st.st_size) ) {
+		munmap(image, st.st_size);
+		return false;
+	}
+	ruleimage_mapped = true;
+	return true;
+}
+
+static bool parserules(void) {
+	struct stat st;
+	char *image;
+	size_t size;
+
+	if( !read_rules() )
+		return false;
+	image = compilerules(fstat(rules_fd(), &st) == 0 ? &st : NULL, &size);
+	freeparsedrules();
+	if( image == NULL ) {
+		fputs("Out of memory!\n", stderr);
+		return false;
+	}
+	if( !userules(image, size) ) {
+		free(image);
+		fputs("Out of memory!\n", stderr);
+		return false;
+	}
+	return true;
+}
+
+/* --compile-rules: write the compiled rules and do nothing else */
+static int writecompiledrules(const char *filename) {
+	struct stat st;
+	char *image, *name, *tmpname;
+	size_t size, done = 0;
+	ssize_t written;
+	int fd = rules_fd();
+	int ofd;
+
+	if( fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ) {
+		fprintf(stderr, "%s: --compile-rules needs a regular file as rules file-descriptor %d\n",
+				program_invocation_short_name, fd);
+		return TESTTOOL_ERROR_EXIT;
+	}
+	if( filename != NULL )
+		name = strdup(filename);
+	else
+		name = rulescachename(fd);
+	if( name == NULL ) {
+		fprintf(stderr, "%s: Could not determine name of rules file!\n",
+				program_invocation_short_name);
+		return TESTTOOL_ERROR_EXIT;
+	}
+	if( !read_rules() ) {
+		free(name);
+		return TESTTOOL_ERROR_EXIT;
+	}
+	image = compilerules(&st, &size);
+	freeparsedrules();
+	tmpname = malloc(strlen(name) + 5);
+	if( image == NULL || tmpname == NULL ) {
+		fputs("Out of memory!\n", stderr);
+		free(image);
+		free(tmpname);
+		free(name);
+		return TESTTOOL_ERROR_EXIT;
+	}
+	strcpy(tmpname, name);
+	strcat(tmpname, ".new");
+	ofd = open(tmpname, O_CREAT|O_TRUNC|O_NOFOLLOW|O_WRONLY, 0666);
+	if( ofd < 0 ) {
+		fprintf(stderr, "%s: Error opening file %s: %s\n",
+				program_invocation_short_name,
+				tmpname, strerror(errno));
+		free(image);
+		free(tmpname);
+		free(name);
+		return TESTTOOL_ERROR_EXIT;
+	}
+	while( done < size ) {
+		written = write(ofd, image + done, size - done);
+		if( written <= 0 )
+			break;
+		done += written;
+	}
+	if( done < size || close(ofd) != 0 || rename(tmpname, name) != 0 ) {
+		fprintf(stderr, "%s: Error writing %s: %s\n",
+				program_invocation_short_name,
+				name, strerror(errno));
+		unlink(tmpname);
+		free(image);
+		free(tmpname);
+		free(name);
+		return TESTTOOL_ERROR_EXIT;
+	}
+	free(image);
+	free(tmpname);
+	free(name);
+	return EXIT_SUCCESS;
+}
+
+/* compiled rules kept by the server, most recently used first */
+#define RULESCACHE_MAX 64
+static struct cachedrules {
+	struct cachedrules *next;
+	uint64_t hash;
+	char *text;
+	size_t len;
+	char *image;
+	size_t imagesize;
+} *rulescache = NULL;
+
+static void resetparsedrules(void) {
+	addto = AT_stderr;
+	rules_ignoreunknown[AT_stderr] = -1;
+	rules_ignoreunknown[AT_stdout] = -1;
+	rules_returncode = -1;
+	rules_failfast = 0;
+	memset(&rules_budget, 0, sizeof(rules_budget));
+	rules_timeout = 0;
+}
+
+/* the compiled image for the given rules, errors are reported to stderr */
+static const char *cachedrules(const char *text, size_t len, size_t *imagesize) {
+	struct cachedrules **pp, *c;
+	uint64_t hash = linehash(text, len);
+	int count = 0;
+	char *copy;
+	bool ok;
+
+	for( pp = &rulescache ; (c = *pp) != NULL ; pp = &c->next ) {
+		if( c->hash == hash && c->len == len &&
+				memcmp(c->text, text, len) == 0 ) {
+			*pp = c->next;
+			c->next = rulescache;
+			rulescache = c;
+			*imagesize = c->imagesize;
+			return c->image;
+		}
+		count++;
+	}
+	c = calloc(1, sizeof(struct cachedrules));
+	copy = malloc(len + 1);
+	if( c == NULL || copy == NULL ) {
+		free(c);
+		free(copy);
+		fputs("Out of memory!\n", stderr);
+		return NULL;
+	}
+	memcpy(copy, text, len);
+	resetparsedrules();
+	ok = parseruletext(copy, len);
+	if( ok )
+		c->image = compilerules(NULL, &c->imagesize);
+	freeparsedrules();
+	if( !ok || c->image == NULL ) {
+		if( ok )
+			fputs("Out of memory!\n", stderr);
+		free(copy);
+		free(c);
+		return NULL;
+	}
+	/* keep the text unmodified for comparing */
+	memcpy(copy, text, len);
+	c->text = copy;
+	c->len = len;
+	c->hash = hash;
+	c->next = rulescache;
+	rulescache = c;
+	if( count >= RULESCACHE_MAX ) {
+		for( pp = &rulescache ; (*pp)->next != NULL ; pp = &(*pp)->next )
+			;
+		free((*pp)->text);
+		free((*pp)->image);
+		free(*pp);
+		*pp = NULL;
+	}
+	*imagesize = c->imagesize;
+	return c->image;
+}
+
+/* read everything from fd, returns NULL with errno set on errors */
+static char *readall(int fd, size_t *len) {
+	size_t size = 65536, got = 0;
+	char *data = malloc(size), *n;
+	ssize_t r;
+
+	while( data != NULL ) {
+		if( got == size ) {
+			n = realloc(data, 2 * size);
+			if( n == NULL )
+				break;
+			data = n;
+			size *= 2;
+		}
+		r = read(fd, data + got, size - got);
+		if( r < 0 && errno == EINTR )
+			continue;
+		if( r < 0 )
+			break;
+		if( r == 0 ) {
+			*len = got;
+			return data;
+		}
+		got += r;
+	}
+	free(data);
+	return NULL;
+}
+
+/* hand the job over to a running --server,
+ * returns -1 if there is none to do it ourselves */
+/* -1 if there is no server, then the rules already read are
+ * returned in *readtext (to be freed) */
+static int runclient(const char *path, int argc, char *argv[], char **readtext, size_t *readlen) {
+	char *rules = NULL, *cwd;
+	size_t ruleslen = 0;
+	int sock, status;
+
+	/* before connecting, the server only waits so long for the job */
+	if( readrules ) {
+		rules = readall(rules_fd(), &ruleslen);
+		if( rules == NULL ) {
+			fprintf(stderr,
+				"Error reading rules from file-descriptor %d: %s\n",
+				rules_fd(), strerror(errno));
+			return TESTTOOL_ERROR_EXIT;
+		}
+	}
+	sock = job_connect(path);
+	if( sock < 0 ) {
+		*readtext = rules;
+		*readlen = ruleslen;
+		return -1;
+	}
+	cwd = getcwd(NULL, 0);
+	if( cwd == NULL || !job_send(sock, argv, argc, environ, cwd,
+				rules, ruleslen, readrules) ) {
+		fprintf(stderr, "%s: Error sending job to server %s: %s\n",
+				program_invocation_short_name, path,
+				strerror(errno));
+		free(cwd);
+		free(rules);
+		close(sock);
+		return TESTTOOL_ERROR_EXIT;
+	}
+	free(cwd);
+	free(rules);
+	status = job_receivestatus(sock);
+	close(sock);
+	if( status < 0 ) {
+		fprintf(stderr, "%s: Lost connection to server %s\n",
+				program_invocation_short_name, path);
+		return TESTTOOL_ERROR_EXIT;
+	}
+	return status;
+}
+
+/* RESOURCE=VALUE as given to --limit */
+static bool parselimit(const char *s) {
+	const char *v = strchr(s, '=');
+	size_t value;
+	char *e;
+	int i;
+
+	if( v == NULL )
+		return false;
+	for( i = 0 ; limitnames[i].name != NULL ; i++ ) {
+		if( strlen(limitnames[i].name) == (size_t)(v - s) &&
+				strncmp(limitnames[i].name, s, v - s) == 0 )
+			break;
+	}
+	if( limitnames[i].name == NULL )
+		return false;
+	v++;
+	if( limitnames[i].size ) {
+		if( !parsesize(v, &value) )
+			return false;
+	} else {
+		if( *v < '0' || *v > '9' )
+			return false;
+		errno = 0;
+		value = strtoull(v, &e, 10);
+		if( errno != 0 || *e != '\0' )
+			return false;
+	}
+	limits[i].set = true;
+	limits[i].value = value;
+	return true;
+}
+
+/* a positive number, 0 for the number of processors */
+static bool parsejobs(const char *s, unsigned int *jobs) {
+	unsigned long n;
+	long cpus;
+	char *e;
+
+	if( *s < '0' || *s > '9' )
+		return false;
+	n = strtoul(s, &e, 10);
+	if( *e != '\0' || n > 4096 )
+		return false;
+	if( n == 0 ) {
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		n = (cpus > 0)?cpus:1;
+	}
+	*jobs = n;
+	return true;
+}
+
+/* a number from 1 to 4096 */
+static bool parseweight(const char *s, unsigned int *weight) {
+	unsigned long n;
+	char *e;
+
+	if( *s < '0' || *s > '9' )
+		return false;
+	n = strtoul(s, &e, 10);
+	if( *e != '\0' || n == 0 || n > 4096 )
+		return false;
+	*weight = n;
+	return true;
+}
+
+static void addname(struct namelist *list, const char *name) {
+	char **n;
+
+	n = realloc(list->names, (list->count + 1) * sizeof(char*));
+	if( n == NULL ) {
+		fputs("Out of memory!\n", stderr);
+		exit(TESTTOOL_ERROR_EXIT);
+	}
+	list->names = n;
+	n[list->count] = strdup(name);
+	if( n[list->count] == NULL ) {
+		fputs("Out of memory!\n", stderr);
+		exit(TESTTOOL_ERROR_EXIT);
+	}
+	list->count++;
+}
+
+static const struct option longopts[] = {
+	{"debugger",		optional_argument,	NULL,	'd'},
+	{"help",		no_argument,		NULL,	'h'},
+	{"version",		no_argument,		NULL,	'v'},
+	{"silent",		no_argument,		NULL,	's'},
+	{"echo",		no_argument,		NULL,	'e'},
+	{"annotate",		no_argument,		NULL,	'a'},
+	{"rules",		no_argument,		NULL,	'r'},
+	{"compile-rules",	optional_argument,	NULL,	'R'},
+	{"outfile",		required_argument,	NULL,	'o'},
+	{"outfile-compression",	required_argument,	NULL,	'z'},
+	{"variable",		required_argument,	NULL,	'D'},
+	{"checkstdout",		no_argument,		NULL,	'C'},
+	{"ignoreunexpected",	no_argument,		NULL,	'i'},
+	{"stats",		no_argument,		NULL,	'S'},
+	{"buffer-limit",	required_argument,	NULL,	'B'},
+	{"fail-fast",		optional_argument,	NULL,	'F'},
+	{"server",		required_argument,	NULL,	'L'},
+	{"timing",		no_argument,		NULL,	'T'},
+	{"rusage",		no_argument,		NULL,	'U'},
+	{"valgrind-xml",	no_argument,		NULL,	'X'},
+	{"sanitizer",		no_argument,		NULL,	'Z'},
+	{"batch",		required_argument,	NULL,	'M'},
+	{"jobs",		required_argument,	NULL,	'j'},
+	{"debugger-weight",	required_argument,	NULL,	'W'},
+	{"stdin",		required_argument,	NULL,	'n'},
+	{"stdin-direct",	no_argument,		NULL,	'Y'},
+	{"cache",		required_argument,	NULL,	'c'},
+	{"no-cache",		no_argument,		NULL,	'N'},
+	{"cache-env",		required_argument,	NULL,	'E'},
+	{"cache-input",		required_argument,	NULL,	'I'},
+	{"no-pipeline",		no_argument,		NULL,	'P'},
+	{"queue-limit",		required_argument,	NULL,	'Q'},
+	{"line-timing",		no_argument,		NULL,	'G'},
+	{"elapsed",		no_argument,		NULL,	'K'},
+	{"timeout",		required_argument,	NULL,	't'},
+	{"limit",		required_argument,	NULL,	'l'},
+	{NULL,			0,			NULL,	0}
+};
+
+static void parseoptions(int argc, char *argv[]) {
+	int c;
+
+	opterr = 0;
+	while( (c = getopt_long(argc, argv, "+hvseariCSTUXZNYPGKB:Q:D:o:z:d::R::F::L:M:j:W:n:c:E:I:t:l:", longopts, NULL)) != -1 ) {
+		if( c == 'd' ) {
+			use_debugger = true;
+			if( optarg != NULL ) {
+				debugger = strdup(optarg);
+				if( debugger == NULL ) {
+					fputs("Out of memory!\n", stderr);
+					exit(TESTTOOL_ERROR_EXIT);
+				}
+			} else
+				debugger = NULL;
+			break;
+		}
+		switch( c ) {
+			case '?':
+				fprintf(stderr,
+					"%s: Unexpected option '%c'!\n",
+					program_invocation_short_name, optopt);
+				exit(TESTTOOL_ERROR_EXIT);
+			case 'h':
+				usage(EXIT_SUCCESS);
+			case 'v':
+				printf("%s version %s\n", PACKAGE, VERSION);
+				exit(EXIT_SUCCESS);
+			case 's':
+				silent = true;
+				break;
+			case 'e':
+				echo = true;
+				break;
+			case 'a':
+				annotate = true;
+				break;
+			case 'r':
+				readrules = true;
+				break;
+			case 'R':
+				compile_rules = true;
+				free(compiledfile);
+				compiledfile = NULL;
+				if( optarg != NULL ) {
+					compiledfile = strdup(optarg);
+					if( compiledfile == NULL ) {
+						fputs("Out of memory!\n", stderr);
+						exit(TESTTOOL_ERROR_EXIT);
+					}
+				}
+				break;
+			case 'o':
+				free(outfile);
+				outfile = strdup(optarg);
+				if( outfile == NULL ) {
+					fputs("Out of memory!\n", stderr);
+					exit(TESTTOOL_ERROR_EXIT);
+				}
+				break;
+			case 'z':
+				if( !outfile_parsecompression(optarg,
+						&outfile_compression) ) {
+					fprintf(stderr,
+							"%s: Unsupported compression '%s'!\n",
+							program_invocation_short_name, optarg);
+					exit(TESTTOOL_ERROR_EXIT);
+				}
+				break;
+			case 'C':
+				outexpect.ignoreunknown = false;
+				break;
+			case 'i':
+				ignoreunexpected = true;
+				break;
+			case 'S':
+				print_stats = true;
+				break;
+			case 'T':
+				print_timing = true;
+				break;
+			case 'U':
+				print_rusage = true;
+				break;
+			case 'X':
+				valgrind_xml = true;
+				break;
+			case 'Z':
+				use_sanitizer = true;
+				break;
+			case 'n':
+				free(stdin_file);
+				stdin_file = strdup(optarg);
+				if( stdin_file == NULL ) {
+					fputs("Out of memory!\n", stderr);
+					exit(TESTTOOL_ERROR_EXIT);
+				}
+				break;
+			case 'Y':
+				stdin_direct = true;
+				break;
+			case 'P':
+				pipeline = false;
+				break;
+			case 'Q':
+				if( !parsesize(optarg, &queuelimit) ) {
+					fprintf(stderr,
+							"%s: Invalid size '%s'!\n",
+							program_invocation_short_name, optarg);
+					exit(TESTTOOL_ERROR_EXIT);
+				}
+				break;
+			case 'G':
+				line_timing = true;
+				break;
+			case 'K':
+				elapsed_prefix = true;
+				break;
+			case 'c':
+				free(cache_dir);
+				cache_dir = strdup(optarg);
+				if( cache_dir == NULL ) {
+					fputs("Out of memory!\n", stderr);
+					exit(TESTTOOL_ERROR_EXIT);
+				}
+				break;
+			case 'N':
+				no_cache = true;
+				break;
+			case 'E':
+				addname(&cache_env, optarg);
+				break;
+			case 'I':
+				addname(&cache_inputs, optarg);
+				break;
+			case 't':
+				if( !parseseconds(optarg, &timeout) ) {
+					fprintf(stderr,
+							"%s: Invalid timeout '%s'!\n",
+							program_invocation_short_name, optarg);
+					exit(TESTTOOL_ERROR_EXIT);
+				}
+				break;
+			case 'l':
+				if( !parselimit(optarg) ) {
+					fprintf(stderr,
+							"%s: Invalid limit '%s'!\n",
+							program_invocation_short_name, optarg);
+					exit(TESTTOOL_ERROR_EXIT);
+				}
+				break;
+			case 'B':
+				if( !parsesize(optarg, &linelimit) ||
+						linelimit == 0 ) {
+					fprintf(stderr,
+							"%s: Invalid size '%s'!\n",
+							program_invocation_short_name, optarg);
+					exit(TESTTOOL_ERROR_EXIT);
+				}
+				break;
+			case 'M':
+				free(batch_manifest);
+				batch_manifest = strdup(optarg);
+				if( batch_manifest == NULL ) {
+					fputs("Out of memory!\n", stderr);
+					exit(TESTTOOL_ERROR_EXIT);
+				}
+				break;
+			case 'j':
+				if( !parsejobs(optarg, &batch_jobs) ) {
+					fprintf(stderr,
+							"%s: Invalid number of jobs '%s'!\n",
+							program_invocation_short_name, optarg);
+					exit(TESTTOOL_ERROR_EXIT);
+				}
+				break;
+			case 'W':
+				if( !parseweight(optarg, &debugger_weight) ) {
+					fprintf(stderr,
+							"%s: Invalid weight '%s'!\n",
+							program_invocation_short_name, optarg);
+					exit(TESTTOOL_ERROR_EXIT);
+				}
+				break;
+			case 'L':
+				free(server_socket);
+				server_socket = strdup(optarg);
+				if( server_socket == NULL ) {
+					fputs("Out of memory!\n", stderr);
+					exit(TESTTOOL_ERROR_EXIT);
+				}
+				break;
+			case 'F':
+				if( optarg == NULL )
+					failfast_signal = SIGTERM;
+				else
+					failfast_signal = parsesignal(optarg);
+				if( failfast_signal == 0 ) {
+					fprintf(stderr,
+							"%s: Unknown signal '%s'!\n",
+							program_invocation_short_name, optarg);
+					exit(TESTTOOL_ERROR_EXIT);
+				}
+				break;
+			case 'D':
+				if( optarg[0] < 'a' || optarg[0] > 'z' ) {
+					fprintf(stderr,
+							"%s: No variable-name found in '%s'!\n",
+							program_invocation_short_name, optarg);
+					exit(TESTTOOL_ERROR_EXIT);
+				}
+				if( optarg[1] != '=' ) {
+					fprintf(stderr,
+							"%s: Missing '=' in '%s'!\n",
+							program_invocation_short_name, optarg);
+					exit(TESTTOOL_ERROR_EXIT);
+				}
+				variables[optarg[0]-'a'+1] = atoi(optarg+2);
+				break;
+			default:
+				fprintf(stderr,
+					"%s: Unexpected getopt_long return '%c'!\n",
+					program_invocation_short_name, c);
+				exit(TESTTOOL_ERROR_EXIT);
+		}
+	}
+}
+
+static void releaseslots(void) {
+	jobserver_release();
+}
+
+/* with make's jobserver, let a run with --debugger take that many
+ * job slots in total, so not too many of them run at the same time */
+static void takedebuggerslots(void) {
+	unsigned int weight = debugger_weight, slots;
+	const char *w;
+
+	if( weight == 0 ) {
+		w = getenv("TESTTOOL_DEBUGGER_WEIGHT");
+		if( w == NULL )
+			return;
+		if( !parseweight(w, &weight) ) {
+			fprintf(stderr, "%s: ignoring invalid TESTTOOL_DEBUGGER_WEIGHT '%s'\n",
+					program_invocation_short_name, w);
+			return;
+		}
+	}
+	if( weight <= 1 || !jobserver_open(getenv("MAKEFLAGS")) )
+		return;
+	/* more than make has would never be available */
+	slots = jobserver_slots();
+	if( slots > 0 && weight > slots )
+		weight = slots;
+	/* also given back if exiting somewhere within start */
+	atexit(releaseslots);
+	/* all other slots might be held by others doing the same */
+	if( jobserver_acquire(weight - 1, 5000) )
+		return;
+	if( errno == ETIMEDOUT )
+		fprintf(stderr, "%s: got only %u of %u job slots from make, running anyway\n",
+				program_invocation_short_name,
+				jobserver_held() + 1, weight);
+	else
+		fprintf(stderr, "%s: could not get %u job slots from make: %s\n",
+				program_invocation_short_name,
+				weight - 1, strerror(errno));
+}
+
+/* everything deciding the outcome of a run: testtool's arguments
+ * (so also the options and variables), the programs they start, the
+ * rules (but not when their file was changed), the working directory,
+ * the file for stdin and whatever is listed with --cache-env and
+ * --cache-input */
+/* false if the outcome depends on something that cannot be hashed */
+static bool computecachekey(int argc, char *argv[], char key[CACHEKEY_HEXSIZE]) {
+	struct cachekey k;
+	struct imageheader h;
+	struct stat st;
+	const char *value, *input;
+	char *cwd;
+	size_t i;
+	int a;
+
+	cachekey_init(&k);
+	cachekey_addstring(&k, PACKAGE " " VERSION);
+	/* the version alone does not change with every build */
+	cachekey_addfile(&k, "/proc/self/exe");
+	cwd = getcwd(NULL, 0);
+	cachekey_addstring(&k, (cwd != NULL)?cwd:"");
+	free(cwd);
+	cachekey_add(&k, &argc, sizeof(argc));
+	for( a = 1 ; a < argc ; a++ )
+		cachekey_addstring(&k, argv[a]);
+	cachekey_addprogram(&k, argv[optind]);
+	if( use_debugger )
+		cachekey_addprogram(&k, (debugger != NULL)?debugger:"valgrind");
+	for( i = 0 ; i < cache_env.count ; i++ ) {
+		value = getenv(cache_env.names[i]);
+		cachekey_addstring(&k, cache_env.names[i]);
+		cachekey_add(&k, (value != NULL)?"=":"-", 1);
+		if( value != NULL )
+			cachekey_addstring(&k, value);
+	}
+	for( i = 0 ; i < cache_inputs.count ; i++ )
+		cachekey_addfile(&k, cache_inputs.names[i]);
+	input = (stdin_file != NULL)?stdin_file:rules_stdin;
+	if( input != NULL ) {
+		/* a fifo gives something else each time */
+		if( stat(input, &st) != 0 || !S_ISREG(st.st_mode) )
+			return false;
+		cachekey_addfile(&k, input);
+	} else if( !cachekey_addinput(&k, 0) )
+		return false;
+	if( ruleimage != NULL ) {
+		memcpy(&h, ruleimage, sizeof(h));
+		h.sourcesize = 0;
+		h.sourcemtime = 0;
+		h.sourcemtimensec = 0;
+		cachekey_add(&k, &h, sizeof(h));
+		cachekey_add(&k, ruleimage + sizeof(h),
+				ruleimage_size - sizeof(h));
+	}
+	cachekey_finish(&k, key);
+	return true;
+}
+
+/* so a replay also shows what testtool itself said about the run */
+static ssize_t writestderr(void *cookie, const char *data, size_t len) {
+	struct iovec iov;
+	size_t left = len;
+	ssize_t written;
+
+	(void)cookie;
+	iov.iov_base = (char*)data;
+	iov.iov_len = len;
+	cache_record(2, &iov, 1);
+	while( left > 0 ) {
+		written = write(2, data, left);
+		if( written < 0 && errno == EINTR )
+			continue;
+		if( written <= 0 )
+			return -1;
+		data += written;
+		left -= written;
+	}
+	return len;
+}
+
+static bool recordstderr(void) {
+	static const cookie_io_functions_t io = { .write = writestderr };
+	FILE *f;
+
+	f = fopencookie(NULL, "w", io);
+	if( f == NULL )
+		return false;
+	/* in order with the program's stderr echoed by flushout */
+	setvbuf(f, NULL, _IONBF, 0);
+	fflush(stderr);
+	realstderr = stderr;
+	stderr = f;
+	return true;
+}
+
+static void stoprecordingstderr(void) {
+	if( realstderr == NULL )
+		return;
+	fclose(stderr);
+	stderr = realstderr;
+	realstderr = NULL;
+}
+
+static int runtest(int argc, char *argv[], const char *image, size_t imagesize) {
+	const char **arguments;
+	int argumentcount;
+	int status;
+	const char *server, *cachedir;
+	char cachekey[CACHEKEY_HEXSIZE];
+
+	if( compile_rules ) {
+		status = writecompiledrules(compiledfile);
+		free(compiledfile);
+		free(debugger);
+		free(outfile);
+		exit(status);
+	}
+
+	if( optind >= argc ) {
+		fprintf(stderr, "%s: no program to start specified!\n",
+				program_invocation_short_name);
+		free(debugger);
+		free(outfile);
+		exit(TESTTOOL_ERROR_EXIT);
+	}
+
+	server = getenv("TESTTOOL_SERVER");
+	if( !server_worker && server != NULL && server[0] != '\0' ) {
+		char *text = NULL;
+		size_t len = 0;
+
+		/* without a server do it ourselves */
+		status = runclient(server, argc, argv, &text, &len);
+		if( status >= 0 ) {
+			free(debugger);
+			free(outfile);
+			return status;
+		}
+		/* with the rules it has already read */
+		if( text != NULL ) {
+			image = cachedrules(text, len, &imagesize);
+			free(text);
+			if( image == NULL ) {
+				free(debugger);
+				free(outfile);
+				exit(TESTTOOL_ERROR_EXIT);
+			}
+		}
+	}
+
+	if( readrules && image != NULL ) {
+		if( image == NULL || !userules(image, imagesize) ) {
+			fputs("Out of memory!\n", stderr);
+			free(debugger);
+			free(outfile);
+			exit(TESTTOOL_ERROR_EXIT);
+		}
+	} else if( readrules ) {
+		if( !loadrulecache(rules_fd()) && !parserules() ) {
+			free(debugger);
+			free(outfile);
+			exit(TESTTOOL_ERROR_EXIT);
+		}
+	}
+
+	arguments = createarguments(&argumentcount, argv+optind, argc-optind);
+
+	if( echo ) {
+		int i;
+		for( i = 0; i+1 < argumentcount; i++,putchar(' ') ) {
+			putchar('\'');
+			assert(arguments[i] != NULL);
+			fputs(arguments[i], stdout);
+			putchar('\'');
+		}
+		putchar('\n');
+	}
+
+	cachedir = (cache_dir != NULL)?cache_dir:getenv("TESTTOOL_CACHE");
+	if( no_cache || (cachedir != NULL && cachedir[0] == '\0') )
+		cachedir = NULL;
+	if( cachedir != NULL && !computecachekey(argc, argv, cachekey) )
+		cachedir = NULL;
+	if( cachedir != NULL ) {
+		fflush(stdout);
+		if( cache_replay(cachedir, cachekey, outfile) ) {
+			freerules();
+			free(arguments);
+			free(debugger);
+			free(outfile);
+			return EXIT_SUCCESS;
+		}
+		/* without our messages the replay would not be the same */
+		cache_recording = recordstderr();
+	}
+
+	if( outfile != NULL ) {
+		if( !outfile_open(outfile, outfile_compression) ) {
+			fprintf(stderr,"%s: Error opening file %s: %s\n",
+					program_invocation_short_name,
+					outfile, strerror(errno));
+			free(arguments);
+			free(debugger);
+			free(outfile);
+			exit(TESTTOOL_ERROR_EXIT);
+		}
+		outfile_active = true;
+		atexit(finishoutfileatexit);
+	}
+
+	/* a --server job's environment is not about our file descriptors */
+	if( use_debugger && server_connection < 0 )
+		takedebuggerslots();
+	if( ownprocessgroup() )
+		startforwarding();
+	status = start(arguments);
+	if( ownprocessgroup() )
+		stopforwarding();
+	/* the program is done (or could not be started) */
+	jobserver_release();
+	/* left over if start failed early */
+	(void)sanitizerreports(false);
+	if( !finishoutfile() )
+		status = TESTTOOL_ERROR_EXIT;
+	if( print_stats )
+		printstats();
+	if( print_timing && status != TESTTOOL_ERROR_EXIT )
+		printtiming();
+	if( line_timing && status != TESTTOOL_ERROR_EXIT )
+		linetiming_report(&timing.spawn);
+	if( print_rusage && status != TESTTOOL_ERROR_EXIT )
+		printrusage();
+	if( cache_recording ) {
+		cache_recording = false;
+		stoprecordingstderr();
+		/* only passing runs, failing ones are to be looked at */
+		if( status == EXIT_SUCCESS &&
+				!cache_store(cachedir, cachekey, outfile) )
+			fprintf(stderr, "%s: Cannot store result in %s: %s\n",
+					program_invocation_short_name,
+					cachedir, strerror(errno));
+		cache_free();
+	}
+
+	freerules();
+	free(arguments);
+	free(debugger);
 	free(outfile);
 	return status;
 }
+
+static void sendexitstatus(int status, void *privdata) {
+	(void)privdata;
+	fflush(stdout);
+	fflush(stderr);
+	if( server_connection >= 0 )
+		(void)job_sendstatus(server_connection, status);
+}
+
+/* runs in a forked worker, so it may change everything */
+static int runjob(struct job *job, const char *image, size_t imagesize) {
+	int i;
+
+	server_worker = true;
+	free(server_socket);
+	server_socket = NULL;
+	for( i = 0 ; i < 3 ; i++ ) {
+		if( dup2(job->fds[i], i) < 0 )
+			return TESTTOOL_ERROR_EXIT;
+		close(job->fds[i]);
+		job->fds[i] = -1;
+	}
+	if( chdir(job->cwd) != 0 ) {
+		fprintf(stderr, "%s: Cannot change into %s: %s\n",
+				program_invocation_short_name,
+				job->cwd, strerror(errno));
+		return TESTTOOL_ERROR_EXIT;
+	}
+	environ = job->env;
+	optind = 0;
+	parseoptions(job->argc, job->argv);
+	if( server_socket != NULL ) {
+		fprintf(stderr, "%s: --server does not start a program!\n",
+				program_invocation_short_name);
+		return TESTTOOL_ERROR_EXIT;
+	}
+	return runtest(job->argc, job->argv, image, imagesize);
+}
+
+/* clients send all of a job right after connecting */
+#define JOB_RECEIVE_TIMEOUT 2000
+
+static void servejob(int sock, int connection) {
+	struct job job;
+	const char *image = NULL;
+	size_t imagesize = 0;
+	int saved;
+	pid_t pid;
+
+	if( !job_receive(connection, &job, JOB_RECEIVE_TIMEOUT) ) {
+		if( errno != 0 )
+			fprintf(stderr, "%s: Error receiving job: %s\n",
+					program_invocation_short_name,
+					strerror(errno));
+		return;
+	}
+	if( job.hasrules ) {
+		/* errors in the rules are for the client to see */
+		fflush(stderr);
+		saved = dup(2);
+		if( saved >= 0 )
+			(void)dup2(job.fds[2], 2);
+		image = cachedrules(job.rules, job.ruleslen, &imagesize);
+		fflush(stderr);
+		if( saved >= 0 ) {
+			(void)dup2(saved, 2);
+			close(saved);
+		}
+		if( image == NULL ) {
+			(void)job_sendstatus(connection, TESTTOOL_ERROR_EXIT);
+			job_done(&job);
+			return;
+		}
+	}
+	fflush(stdout);
+	fflush(stderr);
+	pid = fork();
+	if( pid == 0 ) {
+		close(sock);
+		server_connection = connection;
+		on_exit(sendexitstatus, NULL);
+		exit(runjob(&job, image, imagesize));
+	}
+	if( pid < 0 ) {
+		fprintf(stderr, "%s: error forking: %s\n",
+				program_invocation_short_name,
+				strerror(errno));
+		(void)job_sendstatus(connection, TESTTOOL_ERROR_EXIT);
+	}
+	job_done(&job);
+}
+
+static int serve(const char *path) {
+	int sock, connection, e;
+
+	sock = job_listen(path);
+	if( sock < 0 ) {
+		fprintf(stderr, "%s: Cannot listen on %s: %s\n",
+				program_invocation_short_name,
+				path, strerror(errno));
+		return TESTTOOL_ERROR_EXIT;
+	}
+	while( true ) {
+		connection = job_accept(sock);
+		e = errno;
+		/* collect finished workers */
+		while( waitpid(-1, NULL, WNOHANG) > 0 )
+			;
+		if( connection < 0 ) {
+			if( e == EINTR || e == ECONNABORTED )
+				continue;
+			if( e == EPERM ) {
+				fprintf(stderr, "%s: Refused job from another user\n",
+						program_invocation_short_name);
+				continue;
+			}
+			fprintf(stderr, "%s: Error accepting jobs: %s\n",
+					program_invocation_short_name,
+					strerror(e));
+			close(sock);
+			return TESTTOOL_ERROR_EXIT;
+		}
+		servejob(sock, connection);
+		close(connection);
+	}
+}
+
+/* --batch: every test of the manifest is run in a forked worker like
+ * a job of a --server, with its output collected in a memfd */
+struct batchrun {
+	pid_t pid;
+	const struct batchtest *test;
+	int output;
+	struct timespec started;
+};
+
+/* runs in the forked worker, so it may change everything */
+static int runbatchtest(const struct batchtest *t, const char *image, size_t imagesize) {
+	char **argv;
+	int argc = 0, i;
+
+	server_worker = true;
+	free(batch_manifest);
+	batch_manifest = NULL;
+	argv = calloc(t->optioncount + t->argcount + 3, sizeof(char*));
+	if( argv == NULL ) {
+		fputs("Out of memory!\n", stderr);
+		return TESTTOOL_ERROR_EXIT;
+	}
+	argv[argc++] = program_invocation_name;
+	for( i = 0 ; i < t->optioncount ; i++ )
+		argv[argc++] = t->options[i];
+	if( t->rules != NULL )
+		argv[argc++] = (char*)"--rules";
+	for( i = 0 ; i < t->argcount ; i++ )
+		argv[argc++] = t->args[i];
+	optind = 0;
+	parseoptions(argc, argv);
+	if( server_socket != NULL || batch_manifest != NULL ) {
+		fprintf(stderr, "%s: --server or --batch within a batch!\n",
+				program_invocation_short_name);
+		return TESTTOOL_ERROR_EXIT;
+	}
+	if( readrules && image == NULL ) {
+		fprintf(stderr, "%s: --rules without a 'rules' line!\n",
+				program_invocation_short_name);
+		return TESTTOOL_ERROR_EXIT;
+	}
+	if( t->returncode >= 0 ) {
+		expected_returncode = t->returncode;
+		returncode_given = true;
+	}
+	return runtest(argc, argv, image, imagesize);
+}
+
+/* returns false if the test could not be started, errors are
+ * written into its output */
+static bool startbatchtest(const struct batchtest *t, struct batchrun *r) {
+	const char *image = NULL;
+	size_t imagesize = 0, ruleslen;
+	char *rules;
+	int fd, null;
+
+	r->test = t;
+	r->pid = -1;
+	clock_gettime(CLOCK_MONOTONIC, &r->started);
+	r->output = memfd_create(t->name, MFD_CLOEXEC);
+	if( r->output < 0 ) {
+		fprintf(stderr, "%s: error creating memfd: %s\n",
+				program_invocation_short_name,
+				strerror(errno));
+		return false;
+	}
+	if( t->rules != NULL ) {
+		fd = open(t->rules, O_RDONLY|O_NOCTTY|O_CLOEXEC);
+		rules = NULL;
+		if( fd >= 0 ) {
+			rules = readall(fd, &ruleslen);
+			close(fd);
+		}
+		if( rules == NULL ) {
+			dprintf(r->output, "%s: Cannot read rules from %s: %s\n",
+					program_invocation_short_name,
+					t->rules, strerror(errno));
+			return false;
+		}
+		/* errors in the rules are part of the test's output */
+		fflush(stderr);
+		fd = dup(2);
+		if( fd >= 0 )
+			(void)dup2(r->output, 2);
+		image = cachedrules(rules, ruleslen, &imagesize);
+		fflush(stderr);
+		if( fd >= 0 ) {
+			(void)dup2(fd, 2);
+			close(fd);
+		}
+		free(rules);
+		if( image == NULL )
+			return false;
+	}
+	fflush(stdout);
+	fflush(stderr);
+	r->pid = fork();
+	if( r->pid == 0 ) {
+		jobserver_forget();
+		null = open("/dev/null", O_RDONLY|O_NOCTTY);
+		if( null < 0 || dup2(null, 0) < 0 ||
+				dup2(r->output, 1) < 0 ||
+				dup2(r->output, 2) < 0 )
+			_exit(TESTTOOL_ERROR_EXIT);
+		close(null);
+		exit(runbatchtest(t, image, imagesize));
+	}
+	if( r->pid < 0 ) {
+		dprintf(r->output, "%s: error forking: %s\n",
+				program_invocation_short_name,
+				strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+/* print the result, with the output if the test failed */
+static bool reportbatchtest(struct batchrun *r, int status) {
+	struct timespec now;
+	char buffer[65536], result[32];
+	ssize_t got;
+	bool ok;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ok = r->pid > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+	if( r->pid < 0 )
+		strcpy(result, "not started");
+	else if( WIFEXITED(status) )
+		snprintf(result, sizeof(result), "exit %d",
+				WEXITSTATUS(status));
+	else
+		snprintf(result, sizeof(result), "signal %d",
+				WIFSIGNALED(status)?WTERMSIG(status):0);
+	printf("%s %s (%s, %.3f seconds)\n", ok?"PASS":"FAIL",
+			r->test->name, result, elapsed(&r->started, &now));
+	if( !ok && r->output >= 0 && lseek(r->output, 0, SEEK_SET) == 0 ) {
+		while( (got = read(r->output, buffer, sizeof(buffer))) > 0 )
+			fwrite(buffer, 1, got, stdout);
+	}
+	fflush(stdout);
+	if( r->output >= 0 )
+		close(r->output);
+	r->output = -1;
+	r->pid = 0;
+	r->test = NULL;
+	return ok;
+}
+
+static int runbatch(const char *manifest, unsigned int jobs) {
+	struct batchtest *tests, *t;
+	struct batchrun *runs;
+	struct timespec started, now;
+	unsigned int running = 0, count = 0, failed = 0, i;
+	bool usejobserver;
+	int status;
+	pid_t pid;
+
+	if( !batch_read(manifest, &tests) )
+		return TESTTOOL_ERROR_EXIT;
+	runs = calloc(jobs, sizeof(struct batchrun));
+	if( runs == NULL ) {
+		fputs("Out of memory!\n", stderr);
+		batch_free(tests);
+		return TESTTOOL_ERROR_EXIT;
+	}
+	/* one test runs in our own job slot, all others need a token */
+	usejobserver = jobs > 1 && jobserver_open(getenv("MAKEFLAGS"));
+	clock_gettime(CLOCK_MONOTONIC, &started);
+	t = tests;
+	while( t != NULL || running > 0 ) {
+		/* fill all free slots */
+		for( i = 0 ; i < jobs && t != NULL ; i++ ) {
+			if( runs[i].test != NULL )
+				continue;
+			if( usejobserver && running > jobserver_held() &&
+					!jobserver_tryacquire() )
+				break;
+			count++;
+			if( startbatchtest(t, &runs[i]) )
+				running++;
+			else if( !reportbatchtest(&runs[i], 0) )
+				failed++;
+			t = t->next;
+		}
+		if( running == 0 )
+			continue;
+		pid = waitpid(-1, &status, 0);
+		if( pid < 0 ) {
+			if( errno == EINTR )
+				continue;
+			fprintf(stderr, "%s: error waiting for tests: %s\n",
+					program_invocation_short_name,
+					strerror(errno));
+			break;
+		}
+		for( i = 0 ; i < jobs ; i++ ) {
+			if( runs[i].test == NULL || runs[i].pid != pid )
+				continue;
+			running--;
+			if( !reportbatchtest(&runs[i], status) )
+				failed++;
+			break;
+		}
+		while( jobserver_held() > 0 && jobserver_held() >= running )
+			jobserver_releaseone();
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	printf("%s: batch: %u tests, %u passed, %u failed in %.3f seconds\n",
+			program_invocation_short_name,
+			count, count - failed, failed,
+			elapsed(&started, &now));
+	free(runs);
+	batch_free(tests);
+	jobserver_release();
+	if( running > 0 )
+		return TESTTOOL_ERROR_EXIT;
+	return (failed > 0)?EXIT_FAILURE:EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[]) {
+	if( argc <= 1 )
+		usage(TESTTOOL_ERROR_EXIT);
+
+	scan_init();
+
+	parseoptions(argc, argv);
+	if( server_socket != NULL ) {
+		if( optind < argc ) {
+			fprintf(stderr, "%s: --server does not start a program!\n",
+					program_invocation_short_name);
+			exit(TESTTOOL_ERROR_EXIT);
+		}
+		return serve(server_socket);
+	}
+	if( batch_manifest != NULL ) {
+		if( optind < argc ) {
+			fprintf(stderr, "%s: --batch takes the programs from the manifest!\n",
+					program_invocation_short_name);
+			exit(TESTTOOL_ERROR_EXIT);
+		}
+		return runbatch(batch_manifest, batch_jobs);
+	}
+	return runtest(argc, argv, NULL, 0);
+}
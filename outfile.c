@@ -0,0 +1,408 @@
+/*  This file is part of "testtool"
+ *  Copyright (C) 2006 Bernhard R. Link
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+#include <config.h>
+
+#include <sys/types.h>
+#include <sys/eventfd.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "outfile.h"
+
+/* must be a power of two */
+#define RING_SIZE (8*1024*1024)
+/* at most this much is given to write or the compressor at once,
+ * so the main loop gets room again early */
+#define CHUNK_SIZE (256*1024)
+
+/* The main loop only advances head, the thread only tail. Whoever
+ * finds nothing to do says so in its sleeping flag and waits on its
+ * eventfd, the other side looks at the flag after every step. */
+static struct {
+	char *data;
+	_Atomic size_t head, tail;
+	atomic_bool producersleeping, consumersleeping;
+	atomic_bool closing;
+	/* errno of the thread's failure, 0 if none */
+	atomic_int error;
+	int wakeproducer, wakeconsumer;
+} ring = {
+	.data = NULL, .wakeproducer = -1, .wakeconsumer = -1
+};
+static pthread_t writer;
+static int fd = -1;
+static enum outfile_compression compression;
+static unsigned long waits = 0;
+/* compressed data waiting to be written */
+static unsigned char *compressed = NULL;
+#ifdef HAVE_LIBZ
+static z_stream gz;
+#endif
+#ifdef HAVE_ZSTD
+static ZSTD_CCtx *zstd = NULL;
+static size_t compressedsize;
+#endif
+
+bool outfile_parsecompression(const char *name, enum outfile_compression *c) {
+	if( strcmp(name, "auto") == 0 )
+		*c = OC_AUTO;
+	else if( strcmp(name, "none") == 0 )
+		*c = OC_NONE;
+#ifdef HAVE_LIBZ
+	else if( strcmp(name, "gzip") == 0 )
+		*c = OC_GZIP;
+#endif
+#ifdef HAVE_ZSTD
+	else if( strcmp(name, "zstd") == 0 )
+		*c = OC_ZSTD;
+#endif
+	else
+		return false;
+	return true;
+}
+
+static bool endswith(const char *s, const char *suffix) {
+	size_t l = strlen(s), sl = strlen(suffix);
+
+	return l > sl && strcmp(s + l - sl, suffix) == 0;
+}
+
+static void wake(int efd, atomic_bool *sleeping) {
+	static const uint64_t one = 1;
+
+	if( atomic_exchange(sleeping, false) )
+		(void)write(efd, &one, sizeof(one));
+}
+
+static void sleepon(int efd, atomic_bool *sleeping) {
+	uint64_t count;
+
+	(void)read(efd, &count, sizeof(count));
+	atomic_store(sleeping, false);
+}
+
+static bool writeall(const void *data, size_t len) {
+	const char *p = data;
+	ssize_t written;
+
+	while( len > 0 ) {
+		written = write(fd, p, len);
+		if( written < 0 && errno == EINTR )
+			continue;
+		if( written <= 0 ) {
+			if( written == 0 )
+				errno = EIO;
+			return false;
+		}
+		p += written;
+		len -= written;
+	}
+	return true;
+}
+
+#ifdef HAVE_LIBZ
+static bool gzipdata(const char *data, size_t len, bool finish) {
+	int r;
+
+	gz.next_in = (Bytef*)data;
+	gz.avail_in = len;
+	do {
+		gz.next_out = compressed;
+		gz.avail_out = CHUNK_SIZE;
+		r = deflate(&gz, finish?Z_FINISH:Z_NO_FLUSH);
+		if( r == Z_STREAM_ERROR ) {
+			errno = EIO;
+			return false;
+		}
+		if( !writeall(compressed, CHUNK_SIZE - gz.avail_out) )
+			return false;
+	} while( gz.avail_out == 0 || (finish && r != Z_STREAM_END) );
+	return true;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+static bool zstddata(const char *data, size_t len, bool finish) {
+	ZSTD_inBuffer in = { data, len, 0 };
+	ZSTD_outBuffer out;
+	size_t left;
+
+	do {
+		out.dst = compressed;
+		out.size = compressedsize;
+		out.pos = 0;
+		left = ZSTD_compressStream2(zstd, &out, &in,
+				finish?ZSTD_e_end:ZSTD_e_continue);
+		if( ZSTD_isError(left) ) {
+			errno = EIO;
+			return false;
+		}
+		if( !writeall(compressed, out.pos) )
+			return false;
+	} while( in.pos < in.size || (finish && left != 0) );
+	return true;
+}
+#endif
+
+static bool emit(const char *data, size_t len, bool finish) {
+	switch( compression ) {
+#ifdef HAVE_LIBZ
+		case OC_GZIP:
+			return gzipdata(data, len, finish);
+#endif
+#ifdef HAVE_ZSTD
+		case OC_ZSTD:
+			return zstddata(data, len, finish);
+#endif
+		default:
+			return writeall(data, len);
+	}
+}
+
+static void *writerthread(void *privdata) {
+	size_t head, tail, len, offset;
+
+	(void)privdata;
+	tail = atomic_load_explicit(&ring.tail, memory_order_relaxed);
+	while( true ) {
+		head = atomic_load(&ring.head);
+		if( head == tail ) {
+			if( atomic_load(&ring.closing) )
+				break;
+			atomic_store(&ring.consumersleeping, true);
+			/* look again, the main loop might have missed it */
+			if( atomic_load(&ring.head) == tail &&
+					!atomic_load(&ring.closing) )
+				sleepon(ring.wakeconsumer,
+						&ring.consumersleeping);
+			else
+				atomic_store(&ring.consumersleeping, false);
+			continue;
+		}
+		offset = tail & (RING_SIZE - 1);
+		len = head - tail;
+		if( len > RING_SIZE - offset )
+			len = RING_SIZE - offset;
+		if( len > CHUNK_SIZE )
+			len = CHUNK_SIZE;
+		if( !emit(ring.data + offset, len, false) )
+			goto failed;
+		tail += len;
+		atomic_store(&ring.tail, tail);
+		wake(ring.wakeproducer, &ring.producersleeping);
+	}
+	if( compression != OC_NONE && !emit(NULL, 0, true) )
+		goto failed;
+	return NULL;
+failed:
+	atomic_store(&ring.error, errno);
+	wake(ring.wakeproducer, &ring.producersleeping);
+	return NULL;
+}
+
+static bool startcompression(void) {
+	switch( compression ) {
+#ifdef HAVE_LIBZ
+		case OC_GZIP:
+			compressed = malloc(CHUNK_SIZE);
+			if( compressed == NULL )
+				return false;
+			memset(&gz, 0, sizeof(gz));
+			/* 16+: with gzip header, fast as it has to keep
+			 * up with the program */
+			if( deflateInit2(&gz, Z_BEST_SPEED, Z_DEFLATED,
+					16 + MAX_WBITS, 8,
+					Z_DEFAULT_STRATEGY) != Z_OK ) {
+				errno = ENOMEM;
+				return false;
+			}
+			return true;
+#endif
+#ifdef HAVE_ZSTD
+		case OC_ZSTD:
+			compressedsize = ZSTD_CStreamOutSize();
+			compressed = malloc(compressedsize);
+			zstd = ZSTD_createCCtx();
+			if( compressed == NULL || zstd == NULL ) {
+				errno = ENOMEM;
+				return false;
+			}
+			return true;
+#endif
+		case OC_NONE:
+			return true;
+		default:
+			errno = ENOTSUP;
+			return false;
+	}
+}
+
+static void endcompression(void) {
+#ifdef HAVE_LIBZ
+	if( compression == OC_GZIP )
+		(void)deflateEnd(&gz);
+#endif
+#ifdef HAVE_ZSTD
+	ZSTD_freeCCtx(zstd);
+	zstd = NULL;
+#endif
+	free(compressed);
+	compressed = NULL;
+}
+
+static void cleanup(void) {
+	int e = errno;
+
+	endcompression();
+	free(ring.data);
+	ring.data = NULL;
+	if( ring.wakeproducer >= 0 )
+		close(ring.wakeproducer);
+	if( ring.wakeconsumer >= 0 )
+		close(ring.wakeconsumer);
+	ring.wakeproducer = ring.wakeconsumer = -1;
+	if( fd >= 0 )
+		close(fd);
+	fd = -1;
+	errno = e;
+}
+
+bool outfile_open(const char *filename, enum outfile_compression c) {
+	int r;
+
+	/* only what is compiled in, a name alone is no reason to fail */
+#ifdef HAVE_LIBZ
+	if( c == OC_AUTO && endswith(filename, ".gz") )
+		c = OC_GZIP;
+#endif
+#ifdef HAVE_ZSTD
+	if( c == OC_AUTO && endswith(filename, ".zst") )
+		c = OC_ZSTD;
+#endif
+	if( c == OC_AUTO )
+		c = OC_NONE;
+	compression = c;
+	fd = open(filename, O_CREAT|O_TRUNC|O_NOFOLLOW|O_WRONLY|O_CLOEXEC,
+			0666);
+	if( fd < 0 )
+		return false;
+	atomic_init(&ring.head, 0);
+	atomic_init(&ring.tail, 0);
+	atomic_init(&ring.producersleeping, false);
+	atomic_init(&ring.consumersleeping, false);
+	atomic_init(&ring.closing, false);
+	atomic_init(&ring.error, 0);
+	ring.data = malloc(RING_SIZE);
+	ring.wakeproducer = eventfd(0, EFD_CLOEXEC);
+	ring.wakeconsumer = eventfd(0, EFD_CLOEXEC);
+	if( ring.data == NULL )
+		errno = ENOMEM;
+	if( ring.data == NULL || ring.wakeproducer < 0 ||
+			ring.wakeconsumer < 0 || !startcompression() ) {
+		cleanup();
+		return false;
+	}
+	r = pthread_create(&writer, NULL, writerthread, NULL);
+	if( r != 0 ) {
+		cleanup();
+		errno = r;
+		return false;
+	}
+	return true;
+}
+
+static bool failed(void) {
+	int e = atomic_load(&ring.error);
+
+	if( e == 0 )
+		return false;
+	errno = e;
+	return true;
+}
+
+bool outfile_write(const char *data, size_t len) {
+	size_t head, tail, offset, room, n;
+	char *p, *end;
+
+	head = atomic_load_explicit(&ring.head, memory_order_relaxed);
+	while( len > 0 ) {
+		if( failed() )
+			return false;
+		tail = atomic_load(&ring.tail);
+		room = RING_SIZE - (head - tail);
+		if( room == 0 ) {
+			atomic_store(&ring.producersleeping, true);
+			if( atomic_load(&ring.tail) == tail && !failed() ) {
+				waits++;
+				sleepon(ring.wakeproducer,
+						&ring.producersleeping);
+			} else
+				atomic_store(&ring.producersleeping, false);
+			continue;
+		}
+		offset = head & (RING_SIZE - 1);
+		n = len;
+		if( n > room )
+			n = room;
+		if( n > RING_SIZE - offset )
+			n = RING_SIZE - offset;
+		memcpy(ring.data + offset, data, n);
+		/* the outfile always got NUL characters replaced */
+		p = ring.data + offset;
+		end = p + n;
+		while( (p = memchr(p, '\0', end - p)) != NULL )
+			*(p++) = '0';
+		data += n;
+		len -= n;
+		head += n;
+		atomic_store(&ring.head, head);
+		wake(ring.wakeconsumer, &ring.consumersleeping);
+	}
+	return true;
+}
+
+bool outfile_close(void) {
+	bool ok;
+
+	if( fd < 0 )
+		return true;
+	atomic_store(&ring.closing, true);
+	wake(ring.wakeconsumer, &ring.consumersleeping);
+	(void)pthread_join(writer, NULL);
+	ok = !failed();
+	if( close(fd) != 0 && ok )
+		ok = false;
+	fd = -1;
+	cleanup();
+	return ok;
+}
+
+unsigned long outfile_waits(void) {
+	return waits;
+}
@@ -0,0 +1,31 @@
+#ifndef TESTTOOL_OUTFILE_H
+#define TESTTOOL_OUTFILE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Writing of --outfile in a thread of its own, so a slow disk does
+ * not keep the main loop from draining the program's pipes.
+ * The main loop copies into a ring buffer, the thread takes from it
+ * (optionally compressing) and writes it. Only if the ring is full
+ * does outfile_write wait for the thread. */
+
+enum outfile_compression { OC_AUTO, OC_NONE, OC_GZIP, OC_ZSTD };
+
+/* name as for --outfile-compression, false if unknown or not
+ * compiled in */
+bool outfile_parsecompression(const char *, enum outfile_compression *);
+/* creates the file and starts the thread, false (errno set) on
+ * errors. OC_AUTO looks at the file's extension, if that names a
+ * compression not compiled in the file is written uncompressed */
+bool outfile_open(const char *filename, enum outfile_compression);
+/* NUL characters are replaced by '0' in the copy,
+ * false if the thread had an error (errno set) */
+bool outfile_write(const char *data, size_t len);
+/* waits for the thread to write everything and closes the file,
+ * false (errno set) on errors */
+bool outfile_close(void);
+/* how often outfile_write had to wait for the ring to have room */
+unsigned long outfile_waits(void);
+
+#endif
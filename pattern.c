@@ -0,0 +1,765 @@
+/*  This file is part of "testtool"
+ *  Copyright (C) 2006 Bernhard R. Link
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+#include <config.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pattern.h"
+
+/* All patterns are translated into one Thompson NFA. The DFA states
+ * (sets of NFA states) are only created when a line needs them, and
+ * all are thrown away again if there get too many. */
+
+enum nfatype { N_CHAR, N_SPLIT, N_EPS, N_MATCH };
+
+struct nfastate {
+	unsigned char type;
+	int out, out1;
+	/* N_CHAR: index of the byte set, N_MATCH: number of the pattern */
+	uint32_t arg;
+};
+
+struct byteset {
+	uint64_t bits[4];
+};
+
+#define DFA_UNKNOWN (-2)
+#define DFA_DEAD (-1)
+#define DFA_MAXSTATES 4096
+
+struct dfastate {
+	/* sorted N_CHAR and N_MATCH states, in setpool */
+	uint32_t set, setlen;
+	/* numbers of the patterns matching, in acceptpool */
+	uint32_t accept, acceptlen;
+	uint64_t hash;
+};
+
+struct patternset {
+	struct nfastate *states;
+	size_t nstates, statesalloc;
+	struct byteset *sets;
+	size_t nsets, setsalloc;
+	int *starts;
+	size_t nstarts, startsalloc;
+	uint32_t npatterns;
+
+	/* everything below is rebuilt when patterns are added */
+	bool compiled;
+	unsigned char classes[256];
+	unsigned char classrep[256];
+	int nclasses;
+	int start;
+	struct dfastate *dstates;
+	size_t ndstates, dstatesalloc;
+	int32_t *trans;
+	size_t transalloc;
+	uint32_t *setpool;
+	size_t setpoolsize, setpoolalloc;
+	uint32_t *acceptpool;
+	size_t acceptpoolsize, acceptpoolalloc;
+	int32_t *table;
+	size_t tablemask;
+
+	/* scratch space */
+	int *stack;
+	size_t stackalloc;
+	uint32_t *work;
+	size_t nwork, workalloc;
+	uint32_t *mark;
+	size_t markalloc;
+	uint32_t generation;
+};
+
+static bool grow(void *pp, size_t *alloc, size_t need, size_t size) {
+	void **p = pp;
+	size_t n;
+	void *q;
+
+	if( need <= *alloc )
+		return true;
+	n = (*alloc > 0)?*alloc:16;
+	while( n < need )
+		n *= 2;
+	q = realloc(*p, n * size);
+	if( q == NULL )
+		return false;
+	*p = q;
+	*alloc = n;
+	return true;
+}
+
+struct patternset *patternset_new(void) {
+	return calloc(1, sizeof(struct patternset));
+}
+
+static void forgetdfa(struct patternset *ps) {
+	free(ps->dstates);
+	free(ps->trans);
+	free(ps->setpool);
+	free(ps->acceptpool);
+	free(ps->table);
+	ps->dstates = NULL; ps->ndstates = ps->dstatesalloc = 0;
+	ps->trans = NULL; ps->transalloc = 0;
+	ps->setpool = NULL; ps->setpoolsize = ps->setpoolalloc = 0;
+	ps->acceptpool = NULL; ps->acceptpoolsize = ps->acceptpoolalloc = 0;
+	ps->table = NULL; ps->tablemask = 0;
+	ps->compiled = false;
+}
+
+void patternset_free(struct patternset *ps) {
+	if( ps == NULL )
+		return;
+	forgetdfa(ps);
+	free(ps->states);
+	free(ps->sets);
+	free(ps->starts);
+	free(ps->stack);
+	free(ps->work);
+	free(ps->mark);
+	free(ps);
+}
+
+/*** building the NFA ***/
+
+struct fragment {
+	int start, end;
+};
+
+struct parser {
+	struct patternset *ps;
+	const char *p, *end, *begin;
+	enum patternkind kind;
+	const char *error;
+	int depth;
+};
+
+static int newstate(struct parser *pp, enum nfatype type, int out, int out1, uint32_t arg) {
+	struct patternset *ps = pp->ps;
+
+	if( !grow(&ps->states, &ps->statesalloc, ps->nstates + 1,
+				sizeof(struct nfastate)) ) {
+		pp->error = "Out of memory";
+		return -1;
+	}
+	ps->states[ps->nstates].type = type;
+	ps->states[ps->nstates].out = out;
+	ps->states[ps->nstates].out1 = out1;
+	ps->states[ps->nstates].arg = arg;
+	return ps->nstates++;
+}
+
+static inline void setbit(struct byteset *s, unsigned char c) {
+	s->bits[c >> 6] |= 1ULL << (c & 63);
+}
+
+static inline bool hasbit(const struct byteset *s, unsigned char c) {
+	return (s->bits[c >> 6] >> (c & 63)) & 1;
+}
+
+static int addset(struct parser *pp, const struct byteset *set) {
+	struct patternset *ps = pp->ps;
+	size_t i;
+
+	for( i = 0 ; i < ps->nsets ; i++ ) {
+		if( memcmp(&ps->sets[i], set, sizeof(*set)) == 0 )
+			return i;
+	}
+	if( !grow(&ps->sets, &ps->setsalloc, ps->nsets + 1,
+				sizeof(struct byteset)) ) {
+		pp->error = "Out of memory";
+		return -1;
+	}
+	ps->sets[ps->nsets] = *set;
+	return ps->nsets++;
+}
+
+static bool setfragment(struct parser *pp, const struct byteset *set, struct fragment *f) {
+	int s;
+
+	s = addset(pp, set);
+	if( s < 0 )
+		return false;
+	f->end = newstate(pp, N_EPS, -1, -1, 0);
+	if( f->end < 0 )
+		return false;
+	f->start = newstate(pp, N_CHAR, f->end, -1, s);
+	return f->start >= 0;
+}
+
+static bool charfragment(struct parser *pp, unsigned char c, struct fragment *f) {
+	struct byteset set;
+
+	memset(&set, 0, sizeof(set));
+	setbit(&set, c);
+	return setfragment(pp, &set, f);
+}
+
+static bool anyfragment(struct parser *pp, struct fragment *f) {
+	struct byteset set;
+
+	memset(&set, 0xff, sizeof(set));
+	return setfragment(pp, &set, f);
+}
+
+static bool emptyfragment(struct parser *pp, struct fragment *f) {
+	f->start = f->end = newstate(pp, N_EPS, -1, -1, 0);
+	return f->start >= 0;
+}
+
+static void concat(struct parser *pp, struct fragment *a, const struct fragment *b) {
+	pp->ps->states[a->end].out = b->start;
+	a->end = b->end;
+}
+
+enum repeat { R_STAR, R_PLUS, R_QUEST };
+
+static bool repeat(struct parser *pp, struct fragment *f, enum repeat r) {
+	int s, e;
+
+	e = newstate(pp, N_EPS, -1, -1, 0);
+	if( e < 0 )
+		return false;
+	s = newstate(pp, N_SPLIT, f->start, e, 0);
+	if( s < 0 )
+		return false;
+	switch( r ) {
+		case R_STAR:
+			pp->ps->states[f->end].out = s;
+			f->start = s;
+			break;
+		case R_PLUS:
+			pp->ps->states[f->end].out = s;
+			break;
+		case R_QUEST:
+			pp->ps->states[f->end].out = e;
+			f->start = s;
+			break;
+	}
+	f->end = e;
+	return true;
+}
+
+static bool alternative(struct parser *pp, struct fragment *a, const struct fragment *b) {
+	int s, e;
+
+	e = newstate(pp, N_EPS, -1, -1, 0);
+	if( e < 0 )
+		return false;
+	s = newstate(pp, N_SPLIT, a->start, b->start, 0);
+	if( s < 0 )
+		return false;
+	pp->ps->states[a->end].out = e;
+	pp->ps->states[b->end].out = e;
+	a->start = s;
+	a->end = e;
+	return true;
+}
+
+static void addclass(struct byteset *set, char class) {
+	int c;
+
+	for( c = 0 ; c < 256 ; c++ ) {
+		if( (class == 'd' && c >= '0' && c <= '9') ||
+				(class == 's' && (c == ' ' || c == '\t' ||
+						  c == '\r' || c == '\f' ||
+						  c == '\v')) ||
+				(class == 'w' && ((c >= '0' && c <= '9') ||
+						  (c >= 'a' && c <= 'z') ||
+						  (c >= 'A' && c <= 'Z') ||
+						  c == '_')) )
+			setbit(set, c);
+	}
+}
+
+/* [...], the '[' is already consumed */
+static bool bracket(struct parser *pp, struct fragment *f) {
+	struct byteset set;
+	bool negate = false, first = true;
+	unsigned char c, d;
+	int i;
+
+	memset(&set, 0, sizeof(set));
+	if( pp->p < pp->end && (*pp->p == '^' ||
+				(pp->kind == PK_GLOB && *pp->p == '!')) ) {
+		negate = true;
+		pp->p++;
+	}
+	while( true ) {
+		if( pp->p >= pp->end ) {
+			pp->error = "Missing ']'";
+			return false;
+		}
+		c = *(pp->p++);
+		if( c == ']' && !first )
+			break;
+		first = false;
+		if( c == '\\' && pp->p < pp->end ) {
+			c = *(pp->p++);
+			if( pp->kind == PK_REGEX &&
+					(c == 'd' || c == 's' || c == 'w') ) {
+				addclass(&set, c);
+				continue;
+			}
+		}
+		d = c;
+		if( pp->p + 1 < pp->end && pp->p[0] == '-' && pp->p[1] != ']' ) {
+			d = pp->p[1];
+			pp->p += 2;
+			if( d == '\\' && pp->p < pp->end )
+				d = *(pp->p++);
+			if( d < c ) {
+				pp->error = "Invalid range";
+				return false;
+			}
+		}
+		for( i = c ; i <= d ; i++ )
+			setbit(&set, i);
+	}
+	if( negate ) {
+		for( i = 0 ; i < 4 ; i++ )
+			set.bits[i] = ~set.bits[i];
+	}
+	return setfragment(pp, &set, f);
+}
+
+static bool globpattern(struct parser *pp, struct fragment *f) {
+	struct fragment n;
+	unsigned char c;
+
+	if( !emptyfragment(pp, f) )
+		return false;
+	while( pp->p < pp->end ) {
+		c = *(pp->p++);
+		if( c == '*' ) {
+			if( !anyfragment(pp, &n) || !repeat(pp, &n, R_STAR) )
+				return false;
+		} else if( c == '?' ) {
+			if( !anyfragment(pp, &n) )
+				return false;
+		} else if( c == '[' ) {
+			if( !bracket(pp, &n) )
+				return false;
+		} else {
+			if( c == '\\' && pp->p < pp->end )
+				c = *(pp->p++);
+			if( !charfragment(pp, c, &n) )
+				return false;
+		}
+		concat(pp, f, &n);
+	}
+	return true;
+}
+
+static bool regexalternatives(struct parser *pp, struct fragment *f);
+
+static bool regexatom(struct parser *pp, struct fragment *f) {
+	unsigned char c = *(pp->p++);
+	struct byteset set;
+
+	switch( c ) {
+		case '(':
+			if( ++pp->depth > 100 ) {
+				pp->error = "Too deeply nested";
+				return false;
+			}
+			if( !regexalternatives(pp, f) )
+				return false;
+			pp->depth--;
+			if( pp->p >= pp->end || *pp->p != ')' ) {
+				pp->error = "Missing ')'";
+				return false;
+			}
+			pp->p++;
+			return true;
+		case ')':
+			pp->error = "Unmatched ')'";
+			return false;
+		case '*': case '+': case '?':
+			pp->error = "Nothing to repeat";
+			return false;
+		case '.':
+			return anyfragment(pp, f);
+		case '[':
+			return bracket(pp, f);
+		case '^':
+			if( pp->p - 1 != pp->begin ) {
+				pp->error = "'^' only allowed at the start";
+				return false;
+			}
+			return emptyfragment(pp, f);
+		case '$':
+			if( pp->p != pp->end ) {
+				pp->error = "'$' only allowed at the end";
+				return false;
+			}
+			return emptyfragment(pp, f);
+		case '\\':
+			if( pp->p >= pp->end ) {
+				pp->error = "Trailing '\\'";
+				return false;
+			}
+			c = *(pp->p++);
+			if( c == 'd' || c == 's' || c == 'w' ) {
+				memset(&set, 0, sizeof(set));
+				addclass(&set, c);
+				return setfragment(pp, &set, f);
+			}
+			if( c == 't' )
+				c = '\t';
+			/* fall through */
+		default:
+			return charfragment(pp, c, f);
+	}
+}
+
+static bool regexsequence(struct parser *pp, struct fragment *f) {
+	struct fragment n;
+
+	if( !emptyfragment(pp, f) )
+		return false;
+	while( pp->p < pp->end && *pp->p != '|' && *pp->p != ')' ) {
+		if( !regexatom(pp, &n) )
+			return false;
+		while( pp->p < pp->end ) {
+			enum repeat r;
+
+			if( *pp->p == '*' )
+				r = R_STAR;
+			else if( *pp->p == '+' )
+				r = R_PLUS;
+			else if( *pp->p == '?' )
+				r = R_QUEST;
+			else
+				break;
+			pp->p++;
+			if( !repeat(pp, &n, r) )
+				return false;
+		}
+		concat(pp, f, &n);
+	}
+	return true;
+}
+
+static bool regexalternatives(struct parser *pp, struct fragment *f) {
+	struct fragment n;
+
+	if( !regexsequence(pp, f) )
+		return false;
+	while( pp->p < pp->end && *pp->p == '|' ) {
+		pp->p++;
+		if( !regexsequence(pp, &n) || !alternative(pp, f, &n) )
+			return false;
+	}
+	return true;
+}
+
+static bool parsepattern(struct parser *pp, struct fragment *f) {
+	if( pp->kind == PK_GLOB )
+		return globpattern(pp, f);
+	if( !regexalternatives(pp, f) )
+		return false;
+	if( pp->p < pp->end ) {
+		pp->error = "Unmatched ')'";
+		return false;
+	}
+	return true;
+}
+
+bool patternset_add(struct patternset *ps, enum patternkind kind, const char *pattern, size_t len, const char **error) {
+	struct parser pp;
+	struct fragment f;
+	int m;
+
+	memset(&pp, 0, sizeof(pp));
+	pp.ps = ps;
+	pp.p = pp.begin = pattern;
+	pp.end = pattern + len;
+	pp.kind = kind;
+	if( !parsepattern(&pp, &f) ) {
+		*error = pp.error;
+		return false;
+	}
+	m = newstate(&pp, N_MATCH, -1, -1, ps->npatterns);
+	if( m < 0 || !grow(&ps->starts, &ps->startsalloc, ps->nstarts + 1,
+				sizeof(int)) ) {
+		*error = "Out of memory";
+		return false;
+	}
+	ps->states[f.end].out = m;
+	ps->starts[ps->nstarts++] = f.start;
+	ps->npatterns++;
+	forgetdfa(ps);
+	return true;
+}
+
+bool pattern_check(enum patternkind kind, const char *pattern, size_t len, const char **error) {
+	struct patternset *ps = patternset_new();
+	bool r;
+
+	if( ps == NULL ) {
+		*error = "Out of memory";
+		return false;
+	}
+	r = patternset_add(ps, kind, pattern, len, error);
+	patternset_free(ps);
+	return r;
+}
+
+/*** the lazily built DFA ***/
+
+/* bytes no set distinguishes share one column of the transition table */
+static void computeclasses(struct patternset *ps) {
+	int map[512];
+	size_t s;
+	int c, n;
+
+	memset(ps->classes, 0, sizeof(ps->classes));
+	ps->nclasses = 1;
+	for( s = 0 ; s < ps->nsets ; s++ ) {
+		for( c = 0 ; c < 2*ps->nclasses ; c++ )
+			map[c] = -1;
+		n = 0;
+		for( c = 0 ; c < 256 ; c++ ) {
+			int k = 2*ps->classes[c] + hasbit(&ps->sets[s], c);
+
+			if( map[k] < 0 )
+				map[k] = n++;
+			ps->classes[c] = map[k];
+		}
+		ps->nclasses = n;
+	}
+	for( c = 255 ; c >= 0 ; c-- )
+		ps->classrep[ps->classes[c]] = c;
+}
+
+static int comparestates(const void *a, const void *b) {
+	uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+
+	return (x > y) - (x < y);
+}
+
+/* add the closure of state to work */
+static bool closure(struct patternset *ps, int state) {
+	size_t sp = 0;
+
+	/* every state is pushed at most once per incoming edge */
+	if( !grow(&ps->stack, &ps->stackalloc, 2*ps->nstates + 1, sizeof(int)) )
+		return false;
+	ps->stack[sp++] = state;
+	while( sp > 0 ) {
+		int s = ps->stack[--sp];
+		const struct nfastate *n;
+
+		if( s < 0 || ps->mark[s] == ps->generation )
+			continue;
+		ps->mark[s] = ps->generation;
+		n = &ps->states[s];
+		switch( n->type ) {
+			case N_SPLIT:
+				ps->stack[sp++] = n->out1;
+				/* fall through */
+			case N_EPS:
+				ps->stack[sp++] = n->out;
+				break;
+			case N_CHAR:
+			case N_MATCH:
+				ps->work[ps->nwork++] = s;
+				break;
+		}
+	}
+	return true;
+}
+
+static void startwork(struct patternset *ps) {
+	ps->nwork = 0;
+	if( ++ps->generation == 0 ) {
+		memset(ps->mark, 0, ps->markalloc * sizeof(uint32_t));
+		ps->generation = 1;
+	}
+}
+
+static uint64_t hashwork(const uint32_t *w, size_t n) {
+	uint64_t h = 0xcbf29ce484222325ULL;
+	size_t i;
+
+	for( i = 0 ; i < n ; i++ ) {
+		h ^= w[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+static bool rehash(struct patternset *ps) {
+	size_t size = (ps->tablemask + 1) * 2, i, j;
+	int32_t *t;
+
+	if( size < 64 )
+		size = 64;
+	t = malloc(size * sizeof(int32_t));
+	if( t == NULL )
+		return false;
+	for( i = 0 ; i < size ; i++ )
+		t[i] = -1;
+	for( i = 0 ; i < ps->ndstates ; i++ ) {
+		j = ps->dstates[i].hash & (size - 1);
+		while( t[j] >= 0 )
+			j = (j + 1) & (size - 1);
+		t[j] = i;
+	}
+	free(ps->table);
+	ps->table = t;
+	ps->tablemask = size - 1;
+	return true;
+}
+
+/* the DFA state for the NFA states in work, -3 if out of memory */
+static int32_t workstate(struct patternset *ps) {
+	struct dfastate *d;
+	uint64_t h;
+	size_t i, j;
+	int c;
+
+	if( ps->nwork == 0 )
+		return DFA_DEAD;
+	qsort(ps->work, ps->nwork, sizeof(uint32_t), comparestates);
+	h = hashwork(ps->work, ps->nwork);
+	if( ps->table != NULL ) {
+		j = h & ps->tablemask;
+		while( ps->table[j] >= 0 ) {
+			d = &ps->dstates[ps->table[j]];
+			if( d->hash == h && d->setlen == ps->nwork &&
+					memcmp(ps->setpool + d->set, ps->work,
+						ps->nwork * sizeof(uint32_t)) == 0 )
+				return ps->table[j];
+			j = (j + 1) & ps->tablemask;
+		}
+	}
+	if( 2*(ps->ndstates + 1) > ps->tablemask + 1 && !rehash(ps) )
+		return -3;
+	if( !grow(&ps->dstates, &ps->dstatesalloc, ps->ndstates + 1,
+				sizeof(struct dfastate)) ||
+			!grow(&ps->trans, &ps->transalloc,
+				(ps->ndstates + 1) * ps->nclasses,
+				sizeof(int32_t)) ||
+			!grow(&ps->setpool, &ps->setpoolalloc,
+				ps->setpoolsize + ps->nwork,
+				sizeof(uint32_t)) ||
+			!grow(&ps->acceptpool, &ps->acceptpoolalloc,
+				ps->acceptpoolsize + ps->nwork,
+				sizeof(uint32_t)) )
+		return -3;
+	d = &ps->dstates[ps->ndstates];
+	d->hash = h;
+	d->set = ps->setpoolsize;
+	d->setlen = ps->nwork;
+	memcpy(ps->setpool + d->set, ps->work, ps->nwork * sizeof(uint32_t));
+	ps->setpoolsize += ps->nwork;
+	/* as patterns are built one after the other, the match states
+	 * are sorted by pattern number, too */
+	d->accept = ps->acceptpoolsize;
+	d->acceptlen = 0;
+	for( i = 0 ; i < ps->nwork ; i++ ) {
+		const struct nfastate *n = &ps->states[ps->work[i]];
+
+		if( n->type == N_MATCH )
+			ps->acceptpool[d->accept + d->acceptlen++] = n->arg;
+	}
+	ps->acceptpoolsize += d->acceptlen;
+	for( c = 0 ; c < ps->nclasses ; c++ )
+		ps->trans[ps->ndstates * ps->nclasses + c] = DFA_UNKNOWN;
+	j = h & ps->tablemask;
+	while( ps->table[j] >= 0 )
+		j = (j + 1) & ps->tablemask;
+	ps->table[j] = ps->ndstates;
+	return ps->ndstates++;
+}
+
+static bool startdfa(struct patternset *ps) {
+	size_t i;
+
+	forgetdfa(ps);
+	computeclasses(ps);
+	if( !grow(&ps->work, &ps->workalloc, ps->nstates, sizeof(uint32_t)) ||
+			!grow(&ps->mark, &ps->markalloc, ps->nstates,
+				sizeof(uint32_t)) )
+		return false;
+	memset(ps->mark, 0, ps->markalloc * sizeof(uint32_t));
+	ps->generation = 0;
+	startwork(ps);
+	for( i = 0 ; i < ps->nstarts ; i++ ) {
+		if( !closure(ps, ps->starts[i]) )
+			return false;
+	}
+	ps->start = workstate(ps);
+	if( ps->start == -3 )
+		return false;
+	ps->compiled = true;
+	return true;
+}
+
+static int32_t computetransition(struct patternset *ps, int32_t state, int class) {
+	unsigned char c = ps->classrep[class];
+	uint32_t set = ps->dstates[state].set;
+	uint32_t setlen = ps->dstates[state].setlen;
+	int32_t next;
+	uint32_t i;
+
+	startwork(ps);
+	for( i = 0 ; i < setlen ; i++ ) {
+		const struct nfastate *n = &ps->states[ps->setpool[set + i]];
+
+		if( n->type == N_CHAR && hasbit(&ps->sets[n->arg], c) &&
+				!closure(ps, n->out) )
+			return -3;
+	}
+	next = workstate(ps);
+	if( next != -3 )
+		ps->trans[state * ps->nclasses + class] = next;
+	return next;
+}
+
+int patternset_match(struct patternset *ps, const char *line, size_t len, const uint32_t **matches) {
+	const unsigned char *p = (const unsigned char*)line;
+	const unsigned char *end = p + len;
+	int32_t s, t;
+
+	if( ps->npatterns == 0 )
+		return 0;
+	if( !ps->compiled || ps->ndstates > DFA_MAXSTATES ) {
+		if( !startdfa(ps) )
+			return -1;
+	}
+	s = ps->start;
+	while( p < end && s >= 0 ) {
+		int class = ps->classes[*(p++)];
+
+		t = ps->trans[s * ps->nclasses + class];
+		if( t == DFA_UNKNOWN ) {
+			t = computetransition(ps, s, class);
+			if( t == -3 )
+				return -1;
+		}
+		s = t;
+	}
+	if( s < 0 )
+		return 0;
+	*matches = ps->acceptpool + ps->dstates[s].accept;
+	return ps->dstates[s].acceptlen;
+}
@@ -0,0 +1,29 @@
+#ifndef TESTTOOL_PATTERN_H
+#define TESTTOOL_PATTERN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* A set of patterns, each matching whole lines, that are all looked
+ * for at once by a single automaton built lazily while matching. */
+
+enum patternkind { PK_GLOB = 1, PK_REGEX = 2 };
+
+struct patternset;
+
+struct patternset *patternset_new(void);
+void patternset_free(struct patternset *);
+
+/* add a pattern, it gets the next number (starting with 0).
+ * returns false with *error set if it is invalid or memory ran out */
+bool patternset_add(struct patternset *, enum patternkind, const char *pattern, size_t len, const char **error);
+
+/* check if pattern is valid without adding it anywhere */
+bool pattern_check(enum patternkind, const char *pattern, size_t len, const char **error);
+
+/* returns how many patterns match the line (-1 if out of memory),
+ * *matches is set to their numbers in increasing order */
+int patternset_match(struct patternset *, const char *line, size_t len, const uint32_t **matches);
+
+#endif
@@ -0,0 +1,281 @@
+/*  This file is part of "testtool"
+ *  Copyright (C) 2006 Bernhard R. Link
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+#include <config.h>
+
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "reader.h"
+
+/* the most read at once, as much as a pipe can hold */
+#define READ_SIZE (1024*1024)
+
+static pthread_t thread;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t room = PTHREAD_COND_INITIALIZER;
+/* all below protected by lock */
+static struct chunk *first = NULL, **last = &first;
+static size_t queued = 0;
+static bool stopping = false;
+static unsigned long stalls = 0;
+/* written to when the queue stops being empty */
+static int queuefd = -1;
+/* written to by reader_stop */
+static int stopfd = -1;
+static int fds[3] = { -1, -1, -1 };
+/* if more is waiting to be checked, let the program wait instead,
+ * 0 for no limit */
+static size_t limit;
+/* the thread's own system calls, only looked at after it ended */
+static struct readeriostats syscalls;
+
+static void queue(struct chunk *c) {
+	static const uint64_t one = 1;
+	bool wasempty;
+
+	c->next = NULL;
+	pthread_mutex_lock(&lock);
+	wasempty = first == NULL;
+	*last = c;
+	last = &c->next;
+	queued += c->len;
+	pthread_mutex_unlock(&lock);
+	/* the main loop takes all there is when woken */
+	if( wasempty ) {
+		(void)write(queuefd, &one, sizeof(one));
+		syscalls.writes++;
+	}
+}
+
+/* false if stopping */
+static bool waitforroom(void) {
+	bool ok;
+
+	pthread_mutex_lock(&lock);
+	if( limit != 0 && queued >= limit && !stopping )
+		stalls++;
+	while( limit != 0 && queued >= limit && !stopping )
+		pthread_cond_wait(&room, &lock);
+	ok = !stopping;
+	pthread_mutex_unlock(&lock);
+	return ok;
+}
+
+static void queueend(int stream, int error) {
+	struct chunk *c;
+
+	while( (c = malloc(sizeof(struct chunk))) == NULL )
+		usleep(10000);
+	clock_gettime(CLOCK_MONOTONIC, &c->read);
+	c->stream = stream;
+	c->len = 0;
+	c->error = error;
+	queue(c);
+}
+
+/* read into the chunk itself, so the matcher can check the lines
+ * where they are. spare is kept for the next read if there was no
+ * data. true at the end of the stream */
+static bool readstream(int stream, struct chunk **spare) {
+	struct chunk *c = *spare, *n;
+	ssize_t got;
+
+	if( c == NULL ) {
+		c = malloc(sizeof(struct chunk) + READ_SIZE);
+		if( c == NULL ) {
+			/* the data would be lost, so this is the end */
+			queueend(stream, ENOMEM);
+			return true;
+		}
+		*spare = c;
+	}
+	do {
+		got = read(fds[stream], c->data, READ_SIZE);
+		syscalls.reads++;
+	} while( got < 0 && errno == EINTR );
+	if( got < 0 && errno == EAGAIN )
+		return false;
+	if( got <= 0 ) {
+		queueend(stream, (got < 0)?errno:0);
+		return true;
+	}
+	*spare = NULL;
+	/* do not keep much more than was read while queued */
+	if( (size_t)got < READ_SIZE - READ_SIZE/4 ) {
+		n = realloc(c, sizeof(struct chunk) + got);
+		if( n != NULL )
+			c = n;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &c->read);
+	c->stream = stream;
+	c->len = got;
+	c->error = 0;
+	queue(c);
+	return false;
+}
+
+static void *readerthread(void *privdata) {
+	struct epoll_event ev, events[3];
+	bool reading[3] = { false, false, false };
+	struct chunk *spare = NULL;
+	int ep, streams = 0, i, n, s, e;
+
+	(void)privdata;
+	ep = epoll_create1(EPOLL_CLOEXEC);
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = 0;
+	if( ep < 0 ||
+			epoll_ctl(ep, EPOLL_CTL_ADD, stopfd, &ev) != 0 ) {
+		/* let the main loop see the end of both */
+		e = errno;
+		queueend(1, e);
+		queueend(2, e);
+		if( ep >= 0 )
+			close(ep);
+		return NULL;
+	}
+	for( s = 1 ; s <= 2 ; s++ ) {
+		ev.data.fd = s;
+		reading[s] = epoll_ctl(ep, EPOLL_CTL_ADD, fds[s], &ev) == 0;
+		if( reading[s] )
+			streams++;
+		else
+			queueend(s, errno);
+	}
+	while( streams > 0 ) {
+		n = epoll_wait(ep, events, 3, -1);
+		syscalls.waits++;
+		if( n < 0 && errno == EINTR )
+			continue;
+		if( n < 0 ) {
+			e = errno;
+			for( s = 1 ; s <= 2 ; s++ ) {
+				if( reading[s] )
+					queueend(s, e);
+			}
+			break;
+		}
+		for( i = 0 ; i < n ; i++ ) {
+			s = events[i].data.fd;
+			if( s == 0 || !waitforroom() )
+				goto stopped;
+			if( readstream(s, &spare) ) {
+				(void)epoll_ctl(ep, EPOLL_CTL_DEL, fds[s], NULL);
+				reading[s] = false;
+				streams--;
+			}
+		}
+	}
+stopped:
+	close(ep);
+	free(spare);
+	return NULL;
+}
+
+bool reader_start(int ofd, int efd, size_t queuelimit) {
+	int r;
+
+	limit = queuelimit;
+	fds[1] = ofd;
+	fds[2] = efd;
+	stopping = false;
+	memset(&syscalls, 0, sizeof(syscalls));
+	queuefd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+	stopfd = eventfd(0, EFD_CLOEXEC);
+	if( queuefd < 0 || stopfd < 0 ) {
+		r = errno;
+		if( queuefd >= 0 )
+			close(queuefd);
+		if( stopfd >= 0 )
+			close(stopfd);
+		queuefd = stopfd = -1;
+		errno = r;
+		return false;
+	}
+	r = pthread_create(&thread, NULL, readerthread, NULL);
+	if( r != 0 ) {
+		close(queuefd);
+		close(stopfd);
+		queuefd = stopfd = -1;
+		errno = r;
+		return false;
+	}
+	return true;
+}
+
+int reader_eventfd(void) {
+	return queuefd;
+}
+
+struct chunk *reader_take(void) {
+	struct chunk *c;
+
+	pthread_mutex_lock(&lock);
+	c = first;
+	if( c != NULL ) {
+		first = c->next;
+		if( first == NULL )
+			last = &first;
+	}
+	pthread_mutex_unlock(&lock);
+	return c;
+}
+
+void reader_release(struct chunk *c) {
+	pthread_mutex_lock(&lock);
+	queued -= c->len;
+	if( queued < limit )
+		pthread_cond_signal(&room);
+	pthread_mutex_unlock(&lock);
+	free(c);
+}
+
+void reader_stop(void) {
+	static const uint64_t one = 1;
+	struct chunk *c;
+
+	if( queuefd < 0 )
+		return;
+	pthread_mutex_lock(&lock);
+	stopping = true;
+	pthread_cond_signal(&room);
+	pthread_mutex_unlock(&lock);
+	(void)write(stopfd, &one, sizeof(one));
+	(void)pthread_join(thread, NULL);
+	while( (c = reader_take()) != NULL )
+		reader_release(c);
+	close(queuefd);
+	close(stopfd);
+	queuefd = stopfd = -1;
+	fds[1] = fds[2] = -1;
+}
+
+unsigned long reader_stalls(void) {
+	return stalls;
+}
+
+void reader_iostats(struct readeriostats *stats) {
+	*stats = syscalls;
+}
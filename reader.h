@@ -0,0 +1,48 @@
+#ifndef TESTTOOL_READER_H
+#define TESTTOOL_READER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+/* Draining of the program's stdout and stderr in a thread of its own,
+ * so the program does not have to wait while lines are checked.
+ * What is read is queued as chunks in the order it was read, until
+ * the queue holds more than the limit given to reader_start. Only
+ * then does the thread wait (and the program with it, once its pipe
+ * is full), which is counted as a stall. */
+
+struct chunk {
+	struct chunk *next;
+	/* 1 for stdout, 2 for stderr */
+	int stream;
+	/* 0 at the end of the stream, then error is 0 or an errno */
+	size_t len;
+	int error;
+	/* when it was read */
+	struct timespec read;
+	char data[];
+};
+
+/* the file descriptors stay open, but must not be read elsewhere
+ * until reader_stop. queuelimit is in bytes, 0 for none.
+ * false (errno set) if the thread did not start */
+bool reader_start(int ofd, int efd, size_t queuelimit);
+/* readable when chunks were queued */
+int reader_eventfd(void);
+/* the next chunk, NULL if there is none right now. Its data is read
+ * into it directly and may be changed by the taker */
+struct chunk *reader_take(void);
+void reader_release(struct chunk *);
+/* stops reading (if not already at the end of both), chunks not
+ * taken yet are dropped */
+void reader_stop(void);
+/* how often the thread found the queue full */
+unsigned long reader_stalls(void);
+/* the system calls the thread made, valid after reader_stop */
+struct readeriostats {
+	unsigned long reads, writes, waits;
+};
+void reader_iostats(struct readeriostats *);
+
+#endif
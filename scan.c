@@ -0,0 +1,194 @@
+/*  This file is part of "testtool"
+ *  Copyright (C) 2006 Bernhard R. Link
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+#include <config.h>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+#include "scan.h"
+
+/* Looking for '\n' and '\0' at the same time. The scalar version
+ * checks a word at a time: a byte of w is zero if it was a '\0',
+ * a byte of w ^ NEWLINES is zero if it was a '\n'. */
+
+#define ONES 0x0101010101010101ULL
+#define HIGHS 0x8080808080808080ULL
+#define NEWLINES (ONES * '\n')
+
+static inline uint64_t hasbreak(uint64_t w) {
+	uint64_t n = w ^ NEWLINES;
+
+	return ((w - ONES) & ~w & HIGHS) | ((n - ONES) & ~n & HIGHS);
+}
+
+/* add the complete words in [*hp, q) to h */
+static inline uint64_t hash_upto(uint64_t h, const char **hp, const char *q) {
+	const char *p = *hp;
+
+	while( q - p >= 8 ) {
+		h = hash_mix(h, hash_word(p));
+		p += 8;
+	}
+	*hp = p;
+	return h;
+}
+
+static inline const char *bytescan(const char *p, const char *end) {
+	while( p < end && *p != '\n' && *p != '\0' )
+		p++;
+	return p;
+}
+
+static const char *scanline_scalar(const char *line, const char *end, struct scanstate *st) {
+	const char *p = line + st->done, *q;
+	uint64_t h = st->h;
+
+	while( end - p >= 8 ) {
+		uint64_t w = hash_word(p);
+
+		if( hasbreak(w) != 0 )
+			break;
+		h = hash_mix(h, w);
+		p += 8;
+	}
+	q = bytescan(p, end);
+	st->h = hash_upto(h, &p, q);
+	st->done = p - line;
+	return q;
+}
+
+static const char *findbreak_scalar(const char *p, const char *end) {
+	while( end - p >= 8 ) {
+		if( hasbreak(hash_word(p)) != 0 )
+			break;
+		p += 8;
+	}
+	return bytescan(p, end);
+}
+
+#ifdef SCAN_X86
+
+__attribute__ ((target("sse2")))
+static inline int breakmask16(const char *p) {
+	__m128i v = _mm_loadu_si128((const __m128i*)p);
+
+	return _mm_movemask_epi8(_mm_or_si128(
+			_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')),
+			_mm_cmpeq_epi8(v, _mm_setzero_si128())));
+}
+
+__attribute__ ((target("sse2")))
+static const char *scanline_sse2(const char *line, const char *end, struct scanstate *st) {
+	const char *p = line + st->done, *q = end;
+	uint64_t h = st->h;
+
+	while( end - p >= 16 ) {
+		int m = breakmask16(p);
+
+		if( m != 0 ) {
+			q = p + __builtin_ctz(m);
+			break;
+		}
+		h = hash_mix(h, hash_word(p));
+		h = hash_mix(h, hash_word(p + 8));
+		p += 16;
+	}
+	if( q == end )
+		q = bytescan(p, end);
+	st->h = hash_upto(h, &p, q);
+	st->done = p - line;
+	return q;
+}
+
+__attribute__ ((target("sse2")))
+static const char *findbreak_sse2(const char *p, const char *end) {
+	while( end - p >= 16 ) {
+		int m = breakmask16(p);
+
+		if( m != 0 )
+			return p + __builtin_ctz(m);
+		p += 16;
+	}
+	return bytescan(p, end);
+}
+
+__attribute__ ((target("avx2")))
+static inline unsigned int breakmask32(const char *p) {
+	__m256i v = _mm256_loadu_si256((const __m256i*)p);
+
+	return (unsigned int)_mm256_movemask_epi8(_mm256_or_si256(
+			_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')),
+			_mm256_cmpeq_epi8(v, _mm256_setzero_si256())));
+}
+
+__attribute__ ((target("avx2")))
+static const char *scanline_avx2(const char *line, const char *end, struct scanstate *st) {
+	const char *p = line + st->done, *q = end;
+	uint64_t h = st->h;
+
+	while( end - p >= 32 ) {
+		unsigned int m = breakmask32(p);
+
+		if( m != 0 ) {
+			q = p + __builtin_ctz(m);
+			break;
+		}
+		h = hash_mix(h, hash_word(p));
+		h = hash_mix(h, hash_word(p + 8));
+		h = hash_mix(h, hash_word(p + 16));
+		h = hash_mix(h, hash_word(p + 24));
+		p += 32;
+	}
+	if( q == end )
+		q = bytescan(p, end);
+	st->h = hash_upto(h, &p, q);
+	st->done = p - line;
+	return q;
+}
+
+__attribute__ ((target("avx2")))
+static const char *findbreak_avx2(const char *p, const char *end) {
+	while( end - p >= 32 ) {
+		unsigned int m = breakmask32(p);
+
+		if( m != 0 )
+			return p + __builtin_ctz(m);
+		p += 32;
+	}
+	return bytescan(p, end);
+}
+#endif
+
+const char *(*scanline)(const char *, const char *, struct scanstate *) = scanline_scalar;
+const char *(*findbreak)(const char *, const char *) = findbreak_scalar;
+
+void scan_init(void) {
+#ifdef SCAN_X86
+	__builtin_cpu_init();
+	if( __builtin_cpu_supports("avx2") ) {
+		scanline = scanline_avx2;
+		findbreak = findbreak_avx2;
+	} else if( __builtin_cpu_supports("sse2") ) {
+		scanline = scanline_sse2;
+		findbreak = findbreak_sse2;
+	}
+#endif
+}
@@ -0,0 +1,73 @@
+#ifndef TESTTOOL_SCAN_H
+#define TESTTOOL_SCAN_H
+
+#include <stdint.h>
+#include <string.h>
+
+/* Line hashing, done a machine word at a time, so that it can be
+ * computed while looking for the end of a line (see scanline). */
+
+#define HASH_SEED 0x9e3779b97f4a7c15ULL
+
+static inline uint64_t hash_word(const char *p) {
+	uint64_t w;
+
+	memcpy(&w, p, 8);
+	return w;
+}
+
+static inline uint64_t hash_mix(uint64_t h, uint64_t w) {
+	h = (h ^ w) * 0xff51afd7ed558ccdULL;
+	return h ^ (h >> 32);
+}
+
+/* add the last (less than 8) bytes and the length */
+static inline uint64_t hash_finish(uint64_t h, const char *tail, size_t taillen, size_t len) {
+	uint64_t w = 0;
+
+	if( taillen > 0 ) {
+		memcpy(&w, tail, taillen);
+		h = hash_mix(h, w);
+	}
+	h ^= len;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	return h ^ (h >> 29);
+}
+
+static inline uint64_t linehash(const char *line, size_t len) {
+	uint64_t h = HASH_SEED;
+	size_t i;
+
+	for( i = 0 ; i + 8 <= len ; i += 8 )
+		h = hash_mix(h, hash_word(line + i));
+	return hash_finish(h, line + i, len - i, len);
+}
+
+/* The hash of the line scanned so far: the first done bytes of the
+ * line (always a multiple of 8) are already in h. */
+struct scanstate {
+	uint64_t h;
+	size_t done;
+};
+
+static inline void scanstate_reset(struct scanstate *st) {
+	st->h = HASH_SEED;
+	st->done = 0;
+}
+
+/* the hash of the line [line, line+len) after scanning up to its end */
+static inline uint64_t scanstate_hash(const struct scanstate *st, const char *line, size_t len) {
+	return hash_finish(st->h, line + st->done, len - st->done, len);
+}
+
+/* Return the first '\n' or '\0' in [line + st->done, end) or end if
+ * there is none, adding all complete words before it to st. */
+extern const char *(*scanline)(const char *line, const char *end, struct scanstate *st);
+
+/* Return the first '\n' or '\0' in [p, end) or end if there is none. */
+extern const char *(*findbreak)(const char *p, const char *end);
+
+/* select the implementations best for this processor */
+void scan_init(void);
+
+#endif
@@ -0,0 +1,430 @@
+/*  This file is part of "testtool"
+ *  Copyright (C) 2006 Bernhard R. Link
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+#include <config.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <time.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "server.h"
+
+#define JOB_MAGIC "TTJOB\0\0\0"
+#define JOB_VERSION 1
+#define JOB_MAXSTRINGS (16*1024*1024)
+#define JOB_MAXRULES (1024*1024*1024)
+#define JOB_HASRULES 1
+
+struct jobheader {
+	char magic[8];
+	uint32_t version;
+	uint32_t flags;
+	uint32_t argc;
+	uint32_t envc;
+	uint64_t stringslen;
+	uint64_t ruleslen;
+};
+
+static bool sendall(int sock, const char *data, size_t len) {
+	ssize_t got;
+
+	while( len > 0 ) {
+		got = send(sock, data, len, MSG_NOSIGNAL);
+		if( got < 0 && errno == EINTR )
+			continue;
+		if( got < 0 )
+			return false;
+		data += got;
+		len -= got;
+	}
+	return true;
+}
+
+/* with a deadline the socket is non-blocking: wait for more data
+ * until then, false with ETIMEDOUT if it does not come in time */
+static bool waitfordata(int sock, const struct timespec *deadline) {
+	struct pollfd p;
+	struct timespec now;
+	long ms;
+	int r;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms = (deadline->tv_sec - now.tv_sec) * 1000 +
+		(deadline->tv_nsec - now.tv_nsec) / 1000000;
+	if( ms <= 0 ) {
+		errno = ETIMEDOUT;
+		return false;
+	}
+	p.fd = sock;
+	p.events = POLLIN;
+	r = poll(&p, 1, ms);
+	if( r == 0 )
+		errno = ETIMEDOUT;
+	return r > 0 || (r < 0 && errno == EINTR);
+}
+
+/* returns false with errno 0 on end of file */
+static bool receiveall(int sock, char *data, size_t len, const struct timespec *deadline) {
+	ssize_t got;
+
+	while( len > 0 ) {
+		got = recv(sock, data, len, 0);
+		if( got < 0 && errno == EINTR )
+			continue;
+		if( got < 0 && errno == EAGAIN && deadline != NULL ) {
+			if( !waitfordata(sock, deadline) )
+				return false;
+			continue;
+		}
+		if( got < 0 )
+			return false;
+		if( got == 0 ) {
+			errno = 0;
+			return false;
+		}
+		data += got;
+		len -= got;
+	}
+	return true;
+}
+
+static bool setaddress(struct sockaddr_un *addr, const char *path) {
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if( strlen(path) >= sizeof(addr->sun_path) ) {
+		errno = ENAMETOOLONG;
+		return false;
+	}
+	strcpy(addr->sun_path, path);
+	return true;
+}
+
+/* a socket at path only counts as left over if nothing answers */
+static bool removestale(const struct sockaddr_un *addr) {
+	struct stat st;
+	int sock, e;
+
+	if( lstat(addr->sun_path, &st) != 0 || !S_ISSOCK(st.st_mode) )
+		return true;
+	sock = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+	if( sock < 0 )
+		return false;
+	if( connect(sock, (const struct sockaddr*)addr, sizeof(*addr)) == 0 ) {
+		close(sock);
+		errno = EADDRINUSE;
+		return false;
+	}
+	e = errno;
+	close(sock);
+	if( e != ECONNREFUSED ) {
+		errno = e;
+		return false;
+	}
+	(void)unlink(addr->sun_path);
+	return true;
+}
+
+int job_listen(const char *path) {
+	struct sockaddr_un addr;
+	mode_t mask;
+	int sock, e, r;
+
+	if( !setaddress(&addr, path) )
+		return -1;
+	if( !removestale(&addr) )
+		return -1;
+	sock = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+	if( sock < 0 )
+		return -1;
+	/* whoever can connect can run anything as us */
+	mask = umask(077);
+	r = bind(sock, (struct sockaddr*)&addr, sizeof(addr));
+	e = errno;
+	umask(mask);
+	errno = e;
+	if( r != 0 || listen(sock, SOMAXCONN) != 0 ) {
+		e = errno;
+		close(sock);
+		errno = e;
+		return -1;
+	}
+	return sock;
+}
+
+int job_accept(int sock) {
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	int connection;
+
+	connection = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+	if( connection < 0 )
+		return -1;
+	if( getsockopt(connection, SOL_SOCKET, SO_PEERCRED,
+				&cred, &len) != 0 || cred.uid != getuid() ) {
+		close(connection);
+		errno = EPERM;
+		return -1;
+	}
+	return connection;
+}
+
+int job_connect(const char *path) {
+	struct sockaddr_un addr;
+	int sock, e;
+
+	if( !setaddress(&addr, path) )
+		return -1;
+	sock = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+	if( sock < 0 )
+		return -1;
+	if( connect(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0 ) {
+		e = errno;
+		close(sock);
+		errno = e;
+		return -1;
+	}
+	return sock;
+}
+
+bool job_send(int sock, char **argv, int argc, char **env, const char *cwd, const char *rules, size_t ruleslen, bool hasrules) {
+	struct jobheader h;
+	union {
+		char buffer[CMSG_SPACE(3*sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	int fds[3] = { 0, 1, 2 };
+	char *strings, *p;
+	size_t len;
+	ssize_t got;
+	int i, envc;
+	bool ok;
+
+	len = strlen(cwd) + 1;
+	for( i = 0 ; i < argc ; i++ )
+		len += strlen(argv[i]) + 1;
+	for( envc = 0 ; env[envc] != NULL ; envc++ )
+		len += strlen(env[envc]) + 1;
+	if( len > JOB_MAXSTRINGS || ruleslen > JOB_MAXRULES ) {
+		errno = E2BIG;
+		return false;
+	}
+	strings = malloc(len);
+	if( strings == NULL )
+		return false;
+	p = strings;
+	for( i = 0 ; i < argc ; i++ )
+		p = stpcpy(p, argv[i]) + 1;
+	for( i = 0 ; i < envc ; i++ )
+		p = stpcpy(p, env[i]) + 1;
+	strcpy(p, cwd);
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, JOB_MAGIC, 8);
+	h.version = JOB_VERSION;
+	h.flags = hasrules?JOB_HASRULES:0;
+	h.argc = argc;
+	h.envc = envc;
+	h.stringslen = len;
+	h.ruleslen = hasrules?ruleslen:0;
+
+	memset(&control, 0, sizeof(control));
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &h;
+	iov.iov_len = sizeof(h);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buffer;
+	msg.msg_controllen = sizeof(control.buffer);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	do {
+		got = sendmsg(sock, &msg, MSG_NOSIGNAL);
+	} while( got < 0 && errno == EINTR );
+	ok = got >= 0 &&
+		sendall(sock, (const char*)&h + got, sizeof(h) - got) &&
+		sendall(sock, strings, len) &&
+		(!hasrules || sendall(sock, rules, ruleslen));
+	free(strings);
+	return ok;
+}
+
+/* split count '\0'-terminated strings, the last one ending at end */
+static char **splitstrings(char **p, const char *end, uint32_t count) {
+	char **list;
+	char *q;
+	uint32_t i;
+
+	list = calloc(count + 1, sizeof(char*));
+	if( list == NULL )
+		return NULL;
+	for( i = 0 ; i < count ; i++ ) {
+		q = memchr(*p, '\0', end - *p);
+		if( q == NULL ) {
+			free(list);
+			errno = EPROTO;
+			return NULL;
+		}
+		list[i] = *p;
+		*p = q + 1;
+	}
+	return list;
+}
+
+bool job_receive(int sock, struct job *job, int timeout) {
+	struct jobheader h;
+	union {
+		char buffer[CMSG_SPACE(3*sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	struct timespec deadline;
+	ssize_t got;
+	char *p, *end;
+	int e, flags;
+
+	/* a client sending nothing must not keep the server from
+	 * accepting other jobs */
+	flags = fcntl(sock, F_GETFL);
+	if( flags < 0 || fcntl(sock, F_SETFL, flags|O_NONBLOCK) != 0 )
+		return false;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += timeout / 1000;
+	deadline.tv_nsec += (timeout % 1000) * 1000000;
+	if( deadline.tv_nsec >= 1000000000 ) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+	memset(job, 0, sizeof(*job));
+	job->fds[0] = job->fds[1] = job->fds[2] = -1;
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &h;
+	iov.iov_len = sizeof(h);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buffer;
+	msg.msg_controllen = sizeof(control.buffer);
+	do {
+		got = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+	} while( (got < 0 && errno == EINTR) || (got < 0 &&
+			errno == EAGAIN && waitfordata(sock, &deadline)) );
+	if( got <= 0 ) {
+		if( got == 0 )
+			errno = 0;
+		return false;
+	}
+	for( cmsg = CMSG_FIRSTHDR(&msg) ; cmsg != NULL ;
+			cmsg = CMSG_NXTHDR(&msg, cmsg) ) {
+		if( cmsg->cmsg_level == SOL_SOCKET &&
+				cmsg->cmsg_type == SCM_RIGHTS &&
+				cmsg->cmsg_len == CMSG_LEN(sizeof(job->fds)) )
+			memcpy(job->fds, CMSG_DATA(cmsg), sizeof(job->fds));
+	}
+	if( (msg.msg_flags & MSG_CTRUNC) != 0 || job->fds[0] < 0 ||
+			!receiveall(sock, (char*)&h + got, sizeof(h) - got,
+				&deadline) ||
+			memcmp(h.magic, JOB_MAGIC, 8) != 0 ||
+			h.version != JOB_VERSION ||
+			h.argc == 0 || h.argc > JOB_MAXSTRINGS ||
+			h.envc > JOB_MAXSTRINGS ||
+			h.stringslen == 0 || h.stringslen > JOB_MAXSTRINGS ||
+			h.ruleslen > JOB_MAXRULES ) {
+		job_done(job);
+		errno = EPROTO;
+		return false;
+	}
+	job->strings = malloc(h.stringslen);
+	job->hasrules = (h.flags & JOB_HASRULES) != 0;
+	job->ruleslen = h.ruleslen;
+	job->rules = malloc(h.ruleslen + 1);
+	if( job->strings == NULL || job->rules == NULL ) {
+		job_done(job);
+		errno = ENOMEM;
+		return false;
+	}
+	if( !receiveall(sock, job->strings, h.stringslen, &deadline) ||
+			!receiveall(sock, job->rules, h.ruleslen, &deadline) ) {
+		e = (errno == 0)?EPROTO:errno;
+		job_done(job);
+		errno = e;
+		return false;
+	}
+	job->rules[h.ruleslen] = '\0';
+	p = job->strings;
+	end = job->strings + h.stringslen;
+	job->argc = h.argc;
+	job->argv = splitstrings(&p, end, h.argc);
+	if( job->argv != NULL )
+		job->env = splitstrings(&p, end, h.envc);
+	if( job->argv == NULL || job->env == NULL ||
+			end[-1] != '\0' || p == end ) {
+		e = (job->argv == NULL || job->env == NULL)?errno:EPROTO;
+		job_done(job);
+		errno = e;
+		return false;
+	}
+	job->cwd = p;
+	/* the status is sent when the job is done */
+	(void)fcntl(sock, F_SETFL, flags);
+	return true;
+}
+
+void job_done(struct job *job) {
+	int i;
+
+	for( i = 0 ; i < 3 ; i++ ) {
+		if( job->fds[i] >= 0 )
+			close(job->fds[i]);
+		job->fds[i] = -1;
+	}
+	free(job->argv);
+	free(job->env);
+	free(job->strings);
+	free(job->rules);
+	job->argv = job->env = NULL;
+	job->strings = job->rules = NULL;
+}
+
+bool job_sendstatus(int sock, int status) {
+	int32_t s = status;
+
+	return sendall(sock, (const char*)&s, sizeof(s));
+}
+
+int job_receivestatus(int sock) {
+	int32_t s;
+
+	if( !receiveall(sock, (char*)&s, sizeof(s), NULL) )
+		return -1;
+	return s;
+}
@@ -0,0 +1,42 @@
+#ifndef TESTTOOL_SERVER_H
+#define TESTTOOL_SERVER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* The protocol between a testtool --server and the testtool processes
+ * handing their jobs to it: a job is sent as a header with the
+ * standard file descriptors attached, followed by argv, the
+ * environment, the working directory and the rules read by the
+ * client. The answer is the exit status. */
+
+struct job {
+	/* received stdin, stdout and stderr */
+	int fds[3];
+	int argc;
+	char **argv;
+	char **env;
+	char *cwd;
+	bool hasrules;
+	char *rules;
+	size_t ruleslen;
+	/* where the strings above are stored */
+	char *strings;
+};
+
+/* all return -1 (or false) with errno set on errors */
+/* fails with EADDRINUSE if a server already answers at path,
+ * the socket is only accessible by the user */
+int job_listen(const char *path);
+/* EPERM if the peer is another user (the connection is closed) */
+int job_accept(int sock);
+int job_connect(const char *path);
+bool job_send(int sock, char **argv, int argc, char **env, const char *cwd, const char *rules, size_t ruleslen, bool hasrules);
+/* errno is 0 if the connection was closed without any job,
+ * ETIMEDOUT if it was not all there within timeout milliseconds */
+bool job_receive(int sock, struct job *, int timeout);
+void job_done(struct job *);
+bool job_sendstatus(int sock, int status);
+int job_receivestatus(int sock);
+
+#endif
@@ -0,0 +1,152 @@
+/*  This file is part of "testtool"
+ *  Copyright (C) 2006 Bernhard R. Link
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+#include <config.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+/* Synthetic output for "make bench":
+ *
+ * ttbench rules RULES LENGTH
+ *	writes rules for stdout with RULES/2 expected and RULES/2 ignored
+ *	lines of LENGTH characters
+ * ttbench output RULES LENGTH LINES EXPECTED% IGNORED%
+ *	writes every expected line once and then LINES lines of LENGTH
+ *	characters, the given percentages of them expected and ignored
+ *	ones and the rest matching no rule
+ */
+
+#define OUTBUFFER (1024*1024)
+
+static char *buffer;
+static size_t buffered = 0;
+
+static void flush(void) {
+	size_t done = 0;
+	ssize_t got;
+
+	while( done < buffered ) {
+		got = write(1, buffer + done, buffered - done);
+		if( got < 0 && errno == EINTR )
+			continue;
+		if( got <= 0 ) {
+			fprintf(stderr, "ttbench: error writing: %s\n",
+					strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		done += got;
+	}
+	buffered = 0;
+}
+
+/* "<kind> <number> " padded with letters to length, then a newline */
+static void putline(const char *kind, unsigned long number, size_t length) {
+	size_t len, i;
+
+	if( buffered + length + 64 > OUTBUFFER )
+		flush();
+	len = snprintf(buffer + buffered, 64, "%s %lu ", kind, number);
+	for( i = len ; i < length ; i++ )
+		buffer[buffered + i] = 'a' + (number + i) % 26;
+	if( length < len )
+		length = len;
+	buffer[buffered + length] = '\n';
+	buffered += length + 1;
+}
+
+static void putstring(const char *s) {
+	size_t len = strlen(s);
+
+	if( buffered + len > OUTBUFFER )
+		flush();
+	memcpy(buffer + buffered, s, len);
+	buffered += len;
+}
+
+static unsigned long number(const char *s) {
+	char *e;
+	unsigned long n;
+
+	n = strtoul(s, &e, 10);
+	if( *s < '0' || *s > '9' || *e != '\0' ) {
+		fprintf(stderr, "ttbench: not a number: '%s'\n", s);
+		exit(EXIT_FAILURE);
+	}
+	return n;
+}
+
+int main(int argc, char *argv[]) {
+	unsigned long rules, length, lines, expected, ignored, i, r;
+	uint64_t state = 0x2545F4914F6CDD1DULL;
+
+	buffer = malloc(OUTBUFFER);
+	if( buffer == NULL ) {
+		fputs("Out of memory!\n", stderr);
+		return EXIT_FAILURE;
+	}
+	if( argc == 4 && strcmp(argv[1], "rules") == 0 ) {
+		rules = number(argv[2]) / 2;
+		length = number(argv[3]);
+		putstring("stdout*\n");
+		for( i = 0 ; i < rules ; i++ ) {
+			putstring("*=");
+			putline("expected", i, length);
+			putstring("=");
+			putline("ignored", i, length);
+		}
+	} else if( argc == 7 && strcmp(argv[1], "output") == 0 ) {
+		rules = number(argv[2]) / 2;
+		length = number(argv[3]);
+		lines = number(argv[4]);
+		expected = number(argv[5]);
+		ignored = number(argv[6]);
+		if( rules == 0 )
+			expected = ignored = 0;
+		if( expected + ignored > 100 ) {
+			fputs("ttbench: more than 100%\n", stderr);
+			return EXIT_FAILURE;
+		}
+		/* so that none of them is missing */
+		for( i = 0 ; i < rules ; i++ )
+			putline("expected", i, length);
+		for( i = 0 ; i < lines ; i++ ) {
+			/* xorshift, so the order is not too predictable */
+			state ^= state << 13;
+			state ^= state >> 7;
+			state ^= state << 17;
+			r = state % 100;
+			if( r < expected )
+				putline("expected", (state >> 8) % rules, length);
+			else if( r < expected + ignored )
+				putline("ignored", (state >> 8) % rules, length);
+			else
+				putline("unknown", i, length);
+		}
+	} else {
+		fputs("Syntax: ttbench rules RULES LENGTH\n"
+		      "or: ttbench output RULES LENGTH LINES EXPECTED% IGNORED%\n",
+		      stderr);
+		return EXIT_FAILURE;
+	}
+	flush();
+	free(buffer);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,354 @@
+/*  This file is part of "testtool"
+ *  Copyright (C) 2006 Bernhard R. Link
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+#include <config.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vgxml.h"
+
+/* Only as much XML as valgrind writes: elements, text, entities,
+ * attributes (skipped), comments and processing instructions
+ * (skipped). Everything is stored in fixed size buffers, longer
+ * names and texts are cut. */
+
+#define VX_MAXDEPTH 16
+#define VX_NAMELEN 32
+#define VX_TEXTMAX 4096
+#define VX_TAGMAX 1024
+#define VX_MAXFRAMES 64
+#define VX_POOLSIZE 16384
+
+enum vxstate { VX_TEXT, VX_TAG, VX_COMMENT };
+
+struct vgxml {
+	vgerror_handler *onerror;
+	vgcount_handler *oncount;
+	void *privdata;
+
+	enum vxstate state;
+	char quote;
+	bool broken, complete;
+	int depth;
+	char names[VX_MAXDEPTH][VX_NAMELEN];
+	char text[VX_TEXTMAX + 1];
+	size_t textlen;
+	char tag[VX_TAGMAX + 1];
+	size_t taglen;
+	/* last two characters inside a comment */
+	char commentend[2];
+
+	/* the <error> being read */
+	bool inerror;
+	int stacks;
+	char kind[64], what[512], location[256];
+	char fn[256], ip[32], file[256], line[16];
+	unsigned long long unique, leakedbytes, leakedblocks;
+	uint64_t digest;
+	size_t framecount;
+	const char *frames[VX_MAXFRAMES];
+	char pool[VX_POOLSIZE];
+	size_t poolused;
+
+	/* the <errorcounts><pair> being read */
+	unsigned long long paircount, pairunique;
+	bool havecount, haveunique;
+};
+
+struct vgxml *vgxml_new(vgerror_handler *onerror, vgcount_handler *oncount, void *privdata) {
+	struct vgxml *x;
+
+	x = calloc(1, sizeof(struct vgxml));
+	if( x == NULL )
+		return NULL;
+	x->onerror = onerror;
+	x->oncount = oncount;
+	x->privdata = privdata;
+	x->state = VX_TEXT;
+	return x;
+}
+
+void vgxml_free(struct vgxml *x) {
+	free(x);
+}
+
+bool vgxml_complete(const struct vgxml *x) {
+	return x->complete && !x->broken && x->depth == 0 &&
+		x->state == VX_TEXT;
+}
+
+/* copy as much as fits */
+static void copy(char *dst, size_t size, const char *src) {
+	size_t len = strnlen(src, size - 1);
+
+	memcpy(dst, src, len);
+	dst[len] = '\0';
+}
+
+/* is the element at that level (0 being the root) named name? */
+static bool at(const struct vgxml *x, int level, const char *name) {
+	return x->depth > level && level < VX_MAXDEPTH &&
+		strcmp(x->names[level], name) == 0;
+}
+
+static void decode(char *s) {
+	static const struct {
+		const char *entity;
+		char c;
+	} entities[] = {
+		{"&lt;", '<'}, {"&gt;", '>'}, {"&amp;", '&'},
+		{"&quot;", '"'}, {"&apos;", '\''}, {NULL, 0}
+	};
+	char *r = s, *w = s, *e;
+	unsigned long c;
+	int i;
+
+	while( *r != '\0' ) {
+		if( *r != '&' ) {
+			*(w++) = *(r++);
+			continue;
+		}
+		if( r[1] == '#' ) {
+			if( r[2] == 'x' )
+				c = strtoul(r + 3, &e, 16);
+			else
+				c = strtoul(r + 2, &e, 10);
+			if( *e == ';' && c > 0 && c < 128 ) {
+				*(w++) = c;
+				r = e + 1;
+				continue;
+			}
+		}
+		for( i = 0 ; entities[i].entity != NULL ; i++ ) {
+			size_t l = strlen(entities[i].entity);
+
+			if( strncmp(r, entities[i].entity, l) == 0 ) {
+				*(w++) = entities[i].c;
+				r += l;
+				break;
+			}
+		}
+		if( entities[i].entity == NULL )
+			*(w++) = *(r++);
+	}
+	*w = '\0';
+}
+
+static void startelement(struct vgxml *x, const char *name) {
+	int level = x->depth;
+
+	if( level < VX_MAXDEPTH )
+		copy(x->names[level], VX_NAMELEN, name);
+	x->depth++;
+	x->textlen = 0;
+	if( level == 1 && strcmp(name, "error") == 0 ) {
+		x->inerror = true;
+		x->stacks = 0;
+		x->kind[0] = x->what[0] = x->location[0] = '\0';
+		x->unique = x->leakedbytes = x->leakedblocks = 0;
+		x->digest = 0xcbf29ce484222325ULL;
+		x->framecount = 0;
+		x->poolused = 0;
+	} else if( x->inerror && level == 2 && strcmp(name, "stack") == 0 ) {
+		x->stacks++;
+	} else if( x->inerror && level == 3 && x->stacks == 1 &&
+			strcmp(name, "frame") == 0 ) {
+		x->fn[0] = x->ip[0] = x->file[0] = x->line[0] = '\0';
+	} else if( level == 2 && at(x, 1, "errorcounts") &&
+			strcmp(name, "pair") == 0 ) {
+		x->havecount = x->haveunique = false;
+	}
+}
+
+static void endframe(struct vgxml *x) {
+	const char *name = (x->fn[0] != '\0')?x->fn:x->ip;
+	size_t len = strlen(name);
+	const char *p;
+
+	for( p = name ; *p != '\0' ; p++ )
+		x->digest = (x->digest ^ (unsigned char)*p) * 0x100000001b3ULL;
+	x->digest = x->digest * 0x100000001b3ULL;
+	if( x->framecount < VX_MAXFRAMES &&
+			x->poolused + len + 1 <= VX_POOLSIZE ) {
+		memcpy(x->pool + x->poolused, name, len + 1);
+		x->frames[x->framecount++] = x->pool + x->poolused;
+		x->poolused += len + 1;
+	}
+	if( x->location[0] == '\0' && x->file[0] != '\0' ) {
+		copy(x->location, sizeof(x->location) - sizeof(x->line), x->file);
+		len = strlen(x->location);
+		x->location[len] = ':';
+		copy(x->location + len + 1, sizeof(x->line), x->line);
+	}
+}
+
+static void enderror(struct vgxml *x) {
+	struct vgerror e;
+
+	x->inerror = false;
+	if( x->onerror == NULL )
+		return;
+	e.unique = x->unique;
+	e.kind = x->kind;
+	e.what = x->what;
+	e.leakedbytes = x->leakedbytes;
+	e.leakedblocks = x->leakedblocks;
+	e.digest = x->digest;
+	e.framecount = x->framecount;
+	e.frames = x->frames;
+	e.location = x->location;
+	x->onerror(&e, x->privdata);
+}
+
+static void endelement(struct vgxml *x, const char *name) {
+	int level = x->depth - 1;
+	const char *t = x->text;
+
+	if( level < 0 || (level < VX_MAXDEPTH &&
+			strncmp(x->names[level], name, VX_NAMELEN - 1) != 0) ) {
+		x->broken = true;
+		return;
+	}
+	x->text[x->textlen] = '\0';
+	decode(x->text);
+	if( x->inerror && level == 2 ) {
+		if( strcmp(name, "kind") == 0 )
+			copy(x->kind, sizeof(x->kind), t);
+		else if( strcmp(name, "what") == 0 )
+			copy(x->what, sizeof(x->what), t);
+		else if( strcmp(name, "unique") == 0 )
+			x->unique = strtoull(t, NULL, 0);
+	} else if( x->inerror && level == 3 && at(x, 2, "xwhat") ) {
+		if( strcmp(name, "text") == 0 )
+			copy(x->what, sizeof(x->what), t);
+		else if( strcmp(name, "leakedbytes") == 0 )
+			x->leakedbytes = strtoull(t, NULL, 10);
+		else if( strcmp(name, "leakedblocks") == 0 )
+			x->leakedblocks = strtoull(t, NULL, 10);
+	} else if( x->inerror && level == 4 && x->stacks == 1 &&
+			at(x, 2, "stack") && at(x, 3, "frame") ) {
+		if( strcmp(name, "fn") == 0 )
+			copy(x->fn, sizeof(x->fn), t);
+		else if( strcmp(name, "ip") == 0 )
+			copy(x->ip, sizeof(x->ip), t);
+		else if( strcmp(name, "file") == 0 )
+			copy(x->file, sizeof(x->file), t);
+		else if( strcmp(name, "line") == 0 )
+			copy(x->line, sizeof(x->line), t);
+	} else if( x->inerror && level == 3 && x->stacks == 1 &&
+			at(x, 2, "stack") && strcmp(name, "frame") == 0 ) {
+		endframe(x);
+	} else if( x->inerror && level == 1 && strcmp(name, "error") == 0 ) {
+		enderror(x);
+	} else if( level == 3 && at(x, 1, "errorcounts") && at(x, 2, "pair") ) {
+		if( strcmp(name, "count") == 0 ) {
+			x->paircount = strtoull(t, NULL, 10);
+			x->havecount = true;
+		} else if( strcmp(name, "unique") == 0 ) {
+			x->pairunique = strtoull(t, NULL, 0);
+			x->haveunique = true;
+		}
+	} else if( level == 2 && at(x, 1, "errorcounts") &&
+			strcmp(name, "pair") == 0 ) {
+		if( x->havecount && x->haveunique && x->oncount != NULL )
+			x->oncount(x->pairunique, x->paircount, x->privdata);
+	}
+	x->depth--;
+	x->textlen = 0;
+	if( x->depth == 0 )
+		x->complete = true;
+}
+
+/* the contents of <...> */
+static void endtag(struct vgxml *x) {
+	char *name, *e;
+	bool empty;
+
+	x->tag[x->taglen] = '\0';
+	name = x->tag;
+	/* <?xml ...?>, <!DOCTYPE ...> */
+	if( name[0] == '?' || name[0] == '!' )
+		return;
+	if( name[0] == '/' ) {
+		name++;
+		name[strcspn(name, " \t\r\n")] = '\0';
+		endelement(x, name);
+		return;
+	}
+	empty = x->taglen > 0 && x->tag[x->taglen - 1] == '/';
+	e = name + strcspn(name, " \t\r\n/");
+	*e = '\0';
+	if( *name == '\0' ) {
+		x->broken = true;
+		return;
+	}
+	if( x->complete && x->depth == 0 ) {
+		/* another document following (e.g. from a child) */
+		x->complete = false;
+	}
+	startelement(x, name);
+	if( empty )
+		endelement(x, name);
+}
+
+bool vgxml_feed(struct vgxml *x, const char *data, size_t len) {
+	const char *end = data + len;
+	char c;
+
+	for( ; data < end && !x->broken ; data++ ) {
+		c = *data;
+		switch( x->state ) {
+			case VX_TEXT:
+				if( c == '<' ) {
+					x->state = VX_TAG;
+					x->taglen = 0;
+					x->quote = '\0';
+				} else if( x->textlen < VX_TEXTMAX )
+					x->text[x->textlen++] = c;
+				break;
+			case VX_TAG:
+				if( x->quote != '\0' ) {
+					if( c == x->quote )
+						x->quote = '\0';
+				} else if( c == '"' || c == '\'' ) {
+					x->quote = c;
+				} else if( c == '>' ) {
+					x->state = VX_TEXT;
+					endtag(x);
+					break;
+				}
+				if( x->taglen < VX_TAGMAX )
+					x->tag[x->taglen++] = c;
+				if( x->taglen == 3 && memcmp(x->tag, "!--", 3) == 0 ) {
+					x->state = VX_COMMENT;
+					x->commentend[0] = x->commentend[1] = '\0';
+				}
+				break;
+			case VX_COMMENT:
+				if( c == '>' && x->commentend[0] == '-' &&
+						x->commentend[1] == '-' ) {
+					x->state = VX_TEXT;
+					x->textlen = 0;
+				}
+				x->commentend[0] = x->commentend[1];
+				x->commentend[1] = c;
+				break;
+		}
+	}
+	return !x->broken;
+}
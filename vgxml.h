@@ -0,0 +1,40 @@
+#ifndef TESTTOOL_VGXML_H
+#define TESTTOOL_VGXML_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Incremental parser for valgrind's --xml=yes output, reporting each
+ * error as soon as its </error> has been seen. */
+
+struct vgerror {
+	unsigned long long unique;
+	const char *kind;
+	/* <what> or <xwhat><text> */
+	const char *what;
+	unsigned long long leakedbytes, leakedblocks;
+	/* hash of all frames of the first stack */
+	uint64_t digest;
+	/* function names (or addresses without them) of the first stack,
+	 * innermost first */
+	size_t framecount;
+	const char * const *frames;
+	/* "file:line" of the innermost frame having it, "" if none */
+	const char *location;
+};
+
+typedef void vgerror_handler(const struct vgerror *, void *privdata);
+/* from <errorcounts>: how often the error with that unique was seen */
+typedef void vgcount_handler(unsigned long long unique, unsigned long long count, void *privdata);
+
+struct vgxml;
+
+struct vgxml *vgxml_new(vgerror_handler *, vgcount_handler *, void *privdata);
+void vgxml_free(struct vgxml *);
+/* returns false once the data is not well-formed */
+bool vgxml_feed(struct vgxml *, const char *data, size_t len);
+/* true if a complete document was seen and nothing is left open */
+bool vgxml_complete(const struct vgxml *);
+
+#endif